@@ -1,53 +1,145 @@
 #include "azure_config.h"
 
-int azure_insert_entity(const std::string &device, size_t numShared, size_t numExclusive, size_t freeBlocks)
+#include <errno.h>
+#include <algorithm>
+
+/* Entity group transactions take at most 100 operations */
+#define AZURE_BATCH_SIZE 100
+
+static azure::storage::cloud_table create_resource_table()
 {
-	azure::storage::table_entity entity(U("OCSSD"), U(device));
+	azure::storage::cloud_table table =
+		azure::storage::cloud_storage_account::parse(AzureConnectionString)
+			.create_cloud_table_client()
+			.get_table_reference(OCSSDResourceTableName);
 
-	azure::storage::table_entity::properties_type &properties = entity.properties();
-	properties.reserve(3);
+	table.create_if_not_exists();
+	return table;
+}
 
-	properties[U("NumSharedChannels")] = azure::storage::entity_property(U(std::to_string(numShared)));
-	properties[U("NumExclusiveChannels")] = azure::storage::entity_property(U(std::to_string(numExclusive)));
-	properties[U("FreeBlocks")] = azure::storage::entity_property(U(std::to_string(freeBlocks)));
-	azure::storage::table_operation insert_operation =
-		azure::storage::table_operation::insert_or_replace_entity(entity);
+/*
+ * Parsing the connection string and checking the table cost a round
+ * trip each, do it once. The publisher inserts and the placement
+ * threads query, the first of them creates the table.
+ */
+static azure::storage::cloud_table &azure_resource_table()
+{
+	static azure::storage::cloud_table table = create_resource_table();
 
-	auto StorageAccount = azure::storage::cloud_storage_account::parse(AzureConnectionString);
-	auto TableClient = StorageAccount.create_cloud_table_client();
-	auto Table = TableClient.get_table_reference(OCSSDResourceTableName);
-	Table.create_if_not_exists();
-	azure::storage::table_result insert_result = Table.execute(insert_operation);
+	return table;
+}
+
+int azure_upsert_entities(const std::vector<azure_resource_row> &rows)
+{
+	try {
+		azure::storage::cloud_table &table = azure_resource_table();
+
+		for (size_t start = 0; start < rows.size(); start += AZURE_BATCH_SIZE) {
+			azure::storage::table_batch_operation batch;
+			size_t end = std::min(rows.size(), start + AZURE_BATCH_SIZE);
+
+			/* All rows share the partition, as a batch requires */
+			for (size_t i = start; i < end; i++) {
+				azure::storage::table_entity entity(U("OCSSD"), U(rows[i].device));
+				azure::storage::table_entity::properties_type &properties = entity.properties();
+
+				properties.reserve(5);
+				properties[U("NodeIp")] = azure::storage::entity_property(U(rows[i].nodeIp));
+				properties[U("NumaNode")] = azure::storage::entity_property(U(std::to_string(rows[i].numaNode)));
+				properties[U("NumSharedChannels")] = azure::storage::entity_property(U(std::to_string(rows[i].numShared)));
+				properties[U("NumExclusiveChannels")] = azure::storage::entity_property(U(std::to_string(rows[i].numExclusive)));
+				properties[U("FreeBlocks")] = azure::storage::entity_property(U(std::to_string(rows[i].freeBlocks)));
+				batch.insert_or_replace_entity(entity);
+			}
+
+			table.execute_batch(batch);
+		}
+	} catch (const std::exception &e) {
+		std::cout << __func__ << ": " << e.what() << std::endl;
+		return -EIO;
+	}
 
 	return 0;
 }
 
-int azure_retrieve_entity()
+int azure_insert_entity(const std::string &device, size_t numShared, size_t numExclusive, size_t freeBlocks)
+{
+	azure_resource_row row = {device, "", -1, numShared, numExclusive, freeBlocks};
+
+	return azure_upsert_entities(std::vector<azure_resource_row>(1, row));
+}
+
+/* A property as a string, empty if the row predates it */
+static std::string azure_property(const azure::storage::table_entity::properties_type &properties,
+				const utility::string_t &name)
+{
+	auto it = properties.find(name);
+
+	return it == properties.end() ? std::string() : it->second.string_value();
+}
+
+int azure_query_entities(std::vector<azure_resource_row> &rows)
 {
 	azure::storage::table_query query;
 
 	query.set_filter_string(azure::storage::table_query::generate_filter_condition(U("PartitionKey"),
 				azure::storage::query_comparison_operator::equal, U("OCSSD")));
 
-	auto StorageAccount = azure::storage::cloud_storage_account::parse(AzureConnectionString);
-	auto TableClient = StorageAccount.create_cloud_table_client();
-	auto Table = TableClient.get_table_reference(OCSSDResourceTableName);
-	Table.create_if_not_exists();
-	azure::storage::table_query_iterator it = Table.execute_query(query);
-
-	azure::storage::table_query_iterator end_of_results;
-	for (; it != end_of_results; ++it) {
-		const azure::storage::table_entity::properties_type &properties = it->properties();
-		std::cout << U("PartitionKey: ") << it->partition_key().c_str()
-			<< U(", Device: ") << it->row_key().c_str()
-			<< U(", NumSharedChannels: ") << properties.at(U("NumSharedChannels")).string_value().c_str()
-			<< U(", NumExclusiveChannels: ") << properties.at(U("NumExclusiveChannels")).string_value().c_str()
-			<< U(", FreeBlocks: ") << properties.at(U("FreeBlocks")).string_value().c_str() << std::endl;
+	rows.clear();
+	try {
+		azure::storage::table_query_iterator it = azure_resource_table().execute_query(query);
+		azure::storage::table_query_iterator end_of_results;
+
+		for (; it != end_of_results; ++it) {
+			const azure::storage::table_entity::properties_type &properties = it->properties();
+			azure_resource_row row;
+			std::string numa = azure_property(properties, U("NumaNode"));
+
+			row.device = it->row_key();
+			row.nodeIp = azure_property(properties, U("NodeIp"));
+			/* Older rows only have the IP as the prefix of the device */
+			if (row.nodeIp.empty())
+				row.nodeIp = row.device.substr(0, row.device.find('_'));
+
+			/* A malformed row is skipped, not the whole table */
+			try {
+				row.numaNode = numa.empty() ? -1 : std::stoi(numa);
+				row.numShared = std::stoul(azure_property(properties, U("NumSharedChannels")));
+				row.numExclusive = std::stoul(azure_property(properties, U("NumExclusiveChannels")));
+				row.freeBlocks = std::stoul(azure_property(properties, U("FreeBlocks")));
+			} catch (const std::logic_error &e) {
+				std::cout << __func__ << ": bad row " << row.device << std::endl;
+				continue;
+			}
+
+			rows.push_back(row);
+		}
+	} catch (const std::exception &e) {
+		std::cout << __func__ << ": " << e.what() << std::endl;
+		return -EIO;
 	}
 
 	return 0;
 }
 
+int azure_retrieve_entity()
+{
+	std::vector<azure_resource_row> rows;
+	int ret = azure_query_entities(rows);
+
+	for (const azure_resource_row &row : rows) {
+		std::cout << U("PartitionKey: OCSSD")
+			<< U(", Device: ") << row.device
+			<< U(", Node: ") << row.nodeIp
+			<< U(", NumaNode: ") << row.numaNode
+			<< U(", NumSharedChannels: ") << row.numShared
+			<< U(", NumExclusiveChannels: ") << row.numExclusive
+			<< U(", FreeBlocks: ") << row.freeBlocks << std::endl;
+	}
+
+	return ret;
+}
+
 int azure_delete_entities()
 {
 	azure::storage::table_query query;
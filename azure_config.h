@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <was/storage_account.h>
 #include <was/table.h>
 
@@ -11,7 +12,21 @@ const utility::string_t AzureConnectionString(U("DefaultEndpointsProtocol=https;
 
 const utility::string_t OCSSDResourceTableName(U("OCSSDResource"));
 
+/* Free capacity of one device, a row of the resource table */
+struct azure_resource_row {
+	std::string device;
+	std::string nodeIp;
+	int numaNode;
+	size_t numShared;
+	size_t numExclusive;
+	size_t freeBlocks;
+};
+
 int azure_insert_entity(const std::string &device, size_t numShared, size_t numExclusive, size_t freeBlocks);
+/* Insert or replace the rows, in batches over one table client; -EIO on failure */
+int azure_upsert_entities(const std::vector<azure_resource_row> &rows);
 int azure_retrieve_entity();
+/* All the rows of the resource table; -EIO on failure */
+int azure_query_entities(std::vector<azure_resource_row> &rows);
 int azure_delete_entities();
 
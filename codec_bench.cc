@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "ocssd_server.h"
+
+/*
+ * Cost of the wire codec: ns to encode and to decode each message, and
+ * for the fixed ones the host order casts the codec replaced, which are
+ * what it has to match on little endian hosts.
+ *
+ * Usage: codec_bench [iterations]
+ */
+
+static volatile uint64_t sink;
+
+static double now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ns per call of op */
+template<typename Op>
+static double run(long iterations, Op op)
+{
+	uint64_t sum = 0;
+	double start = now_ns();
+
+	for (long i = 0; i < iterations; i++) {
+		sum += op(i);
+		/* Keeps the buffer stores and loads in every iteration */
+		asm volatile("" : : : "memory");
+	}
+
+	sink = sum;
+	return (now_ns() - start) / iterations;
+}
+
+static void report(const char *name, size_t len, double encode, double decode)
+{
+	printf("%-22s %5lu bytes  encode %7.1f ns  decode %7.1f ns\n",
+		name, len, encode, decode);
+}
+
+/* The I/O request as it was encoded before ocssd_codec.h */
+static size_t raw_io_serialize(char *buffer, uint64_t tag, uint32_t block,
+	uint64_t count, uint64_t offset)
+{
+	*(uint32_t *)buffer = FRAME_MAGIC;
+	*(uint16_t *)(buffer + 4) = FRAME_VERSION;
+	*(uint16_t *)(buffer + 6) = READ_BLOCK_REQUEST;
+	*(uint64_t *)(buffer + 8) = tag;
+	*(uint32_t *)(buffer + 16) = 0;
+	*(uint32_t *)(buffer + 20) = REQUEST_IO_SIZE;
+	*(uint64_t *)(buffer + 24) = 0;
+	*(uint32_t *)(buffer + 32) = block;
+	*(uint32_t *)(buffer + 36) = 0;
+	*(uint64_t *)(buffer + 40) = count;
+	*(uint64_t *)(buffer + 48) = offset;
+	return FRAME_HEADER_SIZE + REQUEST_IO_SIZE;
+}
+
+static uint64_t raw_io_deserialize(const char *buffer)
+{
+	if (*(const uint32_t *)buffer != FRAME_MAGIC)
+		return 0;
+	return *(const uint64_t *)(buffer + 8) + *(const uint32_t *)(buffer + 32) +
+		*(const uint64_t *)(buffer + 40) + *(const uint64_t *)(buffer + 48);
+}
+
+/* 16 channels of 8 LUNs, shared so that every LUN is listed */
+static virtual_ocssd *make_vssd()
+{
+	struct nvm_geo geo;
+	virtual_ocssd *vssd = new virtual_ocssd();
+
+	memset(&geo, 0, sizeof(geo));
+	geo.nchannels = 16;
+	geo.nluns = 8;
+	geo.nplanes = 4;
+	geo.nblocks = 1024;
+	geo.npages = 512;
+	geo.nsectors = 4;
+	geo.sector_nbytes = 4096;
+	geo.page_nbytes = geo.nsectors * geo.sector_nbytes;
+	geo.meta_nbytes = 16;
+
+	virtual_ocssd_unit *unit = new virtual_ocssd_unit("/dev/nvme0n1", &geo);
+	for (uint32_t ch = 0; ch < geo.nchannels; ch++) {
+		std::vector<std::pair<size_t, std::pair<size_t, size_t>>> luns;
+
+		for (uint32_t lun = 0; lun < geo.nluns; lun++)
+			luns.push_back(std::make_pair(lun, std::make_pair(ch * 64, 64)));
+		unit->add(new virtual_ocssd_channel(ch, 1, luns));
+	}
+
+	vssd->set_id(7);
+	vssd->add(unit);
+	return vssd;
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+	char buffer[MESSAGE_BUFFER_SIZE];
+	double encode, decode;
+	size_t len;
+
+	printf("%ld iterations\n", iterations);
+
+	ocssd_frame_header header(WRITE_BLOCK_REQUEST, 1, REQUEST_IO_SIZE, 4096);
+	encode = run(iterations, [&](long i) {
+		header.set_data_len(i);
+		return header.serialize(buffer);
+	});
+	decode = run(iterations, [&](long) {
+		return ocssd_frame_header(buffer).get_data_len();
+	});
+	report("frame header", FRAME_HEADER_SIZE, encode, decode);
+
+	encode = run(iterations, [&](long i) {
+		ocssd_io_request request(READ_BLOCK_REQUEST, i & 0xff, 65536, i, i);
+		return request.serialize(buffer);
+	});
+	decode = run(iterations, [&](long) {
+		ocssd_frame_header h(buffer);
+		ocssd_io_request request(h, buffer + FRAME_HEADER_SIZE);
+		return request.get_offset() + request.get_count();
+	});
+	report("I/O request", FRAME_HEADER_SIZE + REQUEST_IO_SIZE, encode, decode);
+
+	encode = run(iterations, [&](long i) {
+		return raw_io_serialize(buffer, i, i & 0xff, 65536, i);
+	});
+	decode = run(iterations, [&](long) {
+		return raw_io_deserialize(buffer);
+	});
+	report("  host order casts", FRAME_HEADER_SIZE + REQUEST_IO_SIZE, encode,
+		decode);
+
+	ocssd_alloc_request alloc(4, 16, 1, 0, 1);
+	encode = run(iterations, [&](long i) {
+		alloc.set_tag(i);
+		return alloc.serialize(buffer);
+	});
+	decode = run(iterations, [&](long) {
+		ocssd_frame_header h(buffer);
+		ocssd_alloc_request request(h, buffer + FRAME_HEADER_SIZE);
+		return request.get_tag() + request.get_channels();
+	});
+	report("alloc request", FRAME_HEADER_SIZE + REQUEST_ALLOC_SIZE, encode,
+		decode);
+
+	ocssd_vector_request readv(READV_BLOCK_REQUEST);
+	for (uint32_t i = 0; i < MAX_VECTOR_EXTENTS; i++)
+		readv.add(i, i * 65536, 65536);
+	len = readv.serialize(buffer);
+	encode = run(iterations / 16, [&](long) {
+		return readv.serialize(buffer);
+	});
+	decode = run(iterations / 16, [&](long) {
+		ocssd_frame_header h(buffer);
+		ocssd_vector_request request(h, buffer + FRAME_HEADER_SIZE);
+		return request.get_extents().size();
+	});
+	report("vector request (64)", len, encode, decode);
+
+	virtual_ocssd *vssd = make_vssd();
+	std::vector<char> desc(vssd->get_serialized_size());
+	len = vssd->serialize(desc.data(), desc.size());
+	encode = run(iterations / 16, [&](long) {
+		return vssd->serialize(desc.data(), desc.size());
+	});
+	decode = run(iterations / 16, [&](long) {
+		virtual_ocssd copy;
+		return copy.deserialize(desc.data(), desc.size());
+	});
+	report("vSSD (16 x 8 LUNs)", len, encode, decode);
+
+	/* A descriptor cut short anywhere is refused, never read past */
+	for (size_t cut = 0; cut < len; cut++) {
+		virtual_ocssd copy;
+
+		if (copy.deserialize(desc.data(), cut)) {
+			printf("vSSD cut at %lu bytes was accepted\n", cut);
+			return 1;
+		}
+	}
+
+	delete vssd;
+	return 0;
+}
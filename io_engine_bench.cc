@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+
+#include "ocssd_io_engine.h"
+
+/*
+ * The I/O engine over file backed stand-in vblks, no OCSSD needed.
+ *
+ * Every block runs a loop of erase, appends until it is full, and reads
+ * of all it holds, with up to depth appends or reads of the block in
+ * flight. The reads are checked against what was appended: one that
+ * comes back wrong means the engine reordered I/Os on a target, or ran
+ * two at once. Blocks are dealt over the channels, so the scheduler
+ * has dies to share out.
+ *
+ * Usage: io_engine_bench [file] [blocks] [channels] [block KB]
+ *	[request KB] [depth] [workers] [seconds]
+ */
+
+enum bench_phase {BENCH_ERASE, BENCH_WRITE, BENCH_READ};
+
+struct bench_block {
+	ocssd_io_target *target;
+	uint32_t index;
+	uint32_t gen;		/* Erases so far, changes the data */
+	bench_phase phase;
+	size_t next;		/* Offset of the next append or read */
+	int inflight;
+	bool stopped;
+};
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The data of block index at offset, len a multiple of 8 */
+static void fill(char *buf, size_t len, uint32_t index, uint32_t gen,
+	size_t offset)
+{
+	for (size_t i = 0; i < len; i += 8) {
+		uint64_t word = (uint64_t)index << 48 ^ (uint64_t)gen << 32 ^
+			(offset + i);
+
+		memcpy(buf + i, &word, 8);
+	}
+}
+
+class bench_runner : public ocssd_io_handler {
+public:
+	bench_runner(ocssd_io_engine *engine, ocssd_io_port *port,
+			struct event_base *base, size_t request, int depth,
+			double seconds)
+		: engine_(engine), port_(port), base_(base), request_(request),
+		depth_(depth), expected_(request), deadline_(now_sec() + seconds),
+		outstanding_(0), bytes_(0), errors_(0), mismatches_(0)
+	{
+		memset(ios_, 0, sizeof(ios_));
+	}
+
+	void start(bench_block *block) {
+		block->phase = BENCH_ERASE;
+		block->inflight = 0;
+		block->stopped = false;
+		submit(block);
+	}
+
+	void io_complete(ocssd_io *io);
+	void report(double elapsed) const;
+	bool ok() const {return !errors_ && !mismatches_;}
+
+private:
+	void submit(bench_block *block);
+	void advance(bench_block *block);
+
+	ocssd_io_engine *engine_;
+	ocssd_io_port *port_;
+	struct event_base *base_;
+	size_t request_;
+	int depth_;
+	std::vector<char> expected_;
+	double deadline_;
+	int outstanding_;
+
+	/* Completed I/Os by phase */
+	uint64_t ios_[3];
+	uint64_t bytes_;
+	uint64_t errors_;
+	uint64_t mismatches_;
+};
+
+void bench_runner::submit(bench_block *block)
+{
+	static const REQUEST_CODE opcodes[] = {
+		ERASE_BLOCK_REQUEST, WRITE_BLOCK_REQUEST, READ_BLOCK_REQUEST,
+	};
+	ocssd_io *io = new ocssd_io(opcodes[block->phase], 0, block->target,
+				this, port_);
+
+	io->block_index = block->index;
+	io->private_data = block;
+	io->buf = new char[request_];
+	io->count = request_;
+	io->offset = block->next;
+
+	if (block->phase == BENCH_WRITE)
+		fill(io->buf, request_, block->index, block->gen, block->next);
+	if (block->phase != BENCH_ERASE)
+		block->next += request_;
+
+	block->inflight++;
+	outstanding_++;
+	engine_->submit("io_engine_bench", io);
+}
+
+/* Keep the block busy, and move on once a phase has drained */
+void bench_runner::advance(bench_block *block)
+{
+	size_t nbytes = block->target->get_nbytes();
+
+	if (block->phase != BENCH_ERASE) {
+		while (block->inflight < depth_ && block->next + request_ <= nbytes)
+			submit(block);
+	}
+
+	if (block->inflight)
+		return;
+
+	switch (block->phase) {
+	case BENCH_ERASE:
+		block->gen++;
+		block->phase = BENCH_WRITE;
+		break;
+	case BENCH_WRITE:
+		block->phase = BENCH_READ;
+		break;
+	case BENCH_READ:
+		block->phase = BENCH_ERASE;
+		break;
+	}
+
+	block->next = 0;
+	if (block->phase == BENCH_ERASE)
+		submit(block);
+	else
+		advance(block);
+}
+
+/* On the event loop */
+void bench_runner::io_complete(ocssd_io *io)
+{
+	bench_block *block = static_cast<bench_block *>(io->private_data);
+	bool failed = io->error != 0;
+
+	block->inflight--;
+	outstanding_--;
+	if (failed) {
+		printf("block %u: %s at %lu failed: %s\n", block->index,
+			block->phase == BENCH_ERASE ? "erase" :
+			block->phase == BENCH_WRITE ? "write" : "read",
+			io->offset, strerror(io->error));
+		errors_++;
+	} else {
+		ios_[block->phase]++;
+		if (block->phase != BENCH_ERASE)
+			bytes_ += request_;
+	}
+
+	if (!failed && block->phase == BENCH_READ) {
+		fill(expected_.data(), request_, block->index, block->gen, io->offset);
+		if (memcmp(expected_.data(), io->buf, request_)) {
+			printf("block %u: read at %lu does not match the write\n",
+				block->index, io->offset);
+			mismatches_++;
+		}
+	}
+	delete [] io->buf;
+	delete io;
+
+	/* A failed block stops, the others drain */
+	if (failed || block->stopped || now_sec() > deadline_) {
+		block->stopped = true;
+		if (outstanding_ == 0)
+			event_base_loopbreak(base_);
+		return;
+	}
+
+	advance(block);
+}
+
+void bench_runner::report(double elapsed) const
+{
+	printf("%.1f s: %lu erases, %lu writes, %lu reads, %.0f I/Os/s, "
+		"%.2f MB/s\n", elapsed, ios_[BENCH_ERASE], ios_[BENCH_WRITE],
+		ios_[BENCH_READ],
+		(ios_[BENCH_ERASE] + ios_[BENCH_WRITE] + ios_[BENCH_READ]) / elapsed,
+		bytes_ / elapsed / 1e6);
+	printf("%lu errors, %lu reads not matching\n", errors_, mismatches_);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "io_engine_bench.dat";
+	int num_blocks = argc > 2 ? atoi(argv[2]) : 64;
+	int channels = argc > 3 ? atoi(argv[3]) : 8;
+	size_t block_size = (argc > 4 ? atol(argv[4]) : 1024) * 1024;
+	size_t request = (argc > 5 ? atol(argv[5]) : 64) * 1024;
+	int depth = argc > 6 ? atoi(argv[6]) : 4;
+	int workers = argc > 7 ? atoi(argv[7]) : 4;
+	double seconds = argc > 8 ? atof(argv[8]) : 5;
+	std::vector<ocssd_io_target *> targets;
+	std::vector<bench_block> blocks(num_blocks);
+	int ret;
+
+	if (num_blocks < 1 || channels < 1 || request == 0 ||
+			request > block_size || depth < 1 || workers < 1) {
+		printf("usage: %s [file] [blocks] [channels] [block KB] "
+			"[request KB] [depth] [workers] [seconds]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%d blocks of %lu KB on %d channels, %lu KB requests, "
+		"depth %d, %d workers, %.0f s\n", num_blocks, block_size / 1024,
+		channels, request / 1024, depth, workers, seconds);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	ret = ocssd_file_targets(fd, num_blocks, block_size, targets, channels);
+	if (ret < 0) {
+		printf("ocssd_file_targets failed: %s\n", strerror(-ret));
+		close(fd);
+		unlink(path);
+		return 1;
+	}
+
+	struct event_base *base = event_base_new();
+	ocssd_io_port *port = new ocssd_io_port(base);
+	ocssd_io_engine *engine = new ocssd_io_engine(workers);
+	bench_runner runner(engine, port, base, request, depth, seconds);
+	double start = now_sec();
+
+	for (int i = 0; i < num_blocks; i++) {
+		blocks[i].target = targets[i];
+		blocks[i].index = i;
+		blocks[i].gen = 0;
+		blocks[i].next = 0;
+		runner.start(&blocks[i]);
+	}
+
+	event_base_dispatch(base);
+	runner.report(now_sec() - start);
+
+	/* The workers are idle once every I/O has come back */
+	delete engine;
+	delete port;
+	event_base_free(base);
+	for (ocssd_io_target *target : targets)
+		delete target;
+	close(fd);
+	unlink(path);
+
+	return runner.ok() ? 0 : 1;
+}
@@ -0,0 +1,660 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <random>
+#include <memory>
+#include <atomic>
+#include <sstream>
+
+#include "ocssd_server.h"
+#include "ocssd_client_lib.h"
+#include "ocssd_stats.h"
+
+/*
+ * Load generator for remote vSSDs, through libocssd_client.
+ *
+ * Allocates volumes remote vSSDs, spread over as many client event
+ * loops, each reached through its own pool of connections, and keeps
+ * depth requests in flight on every volume for the set time: a read,
+ * write or erase as the mix draws, on a random block of the first
+ * good blocks of the vSSD.
+ *
+ * Writes append to their block and reads pick an offset in what was
+ * written so far; a read of an empty block appends instead. Once a
+ * block is full, or holds block_bytes, or the mix draws an erase, it
+ * is erased as soon as its requests in flight are done, and takes no
+ * new ones until then. Runs with no writes fill the blocks first.
+ *
+ * The client side reports what the requests saw, from issue to
+ * completion. With -a, the server side is read from the admin socket
+ * of a server on this host: the requests and bytes it served in the
+ * run, and its latency quantiles over the life of the vSSDs.
+ */
+
+struct bench_config {
+	std::vector<std::string> servers;
+	int volumes;
+	int conns;
+	int loops;
+	int channels;
+	int blocks_per_lun;
+	int shared;
+	int mix[STATS_NUM_OPS];
+	size_t size;
+	int depth;
+	uint32_t nblocks;
+	size_t block_bytes;
+	double seconds;
+	std::string admin;
+	std::string csv;
+};
+
+struct bench_block {
+	bench_block() : index(0), pos_write(0), written(0), inflight(0),
+		erasing(false), erase_slot(-1) {}
+
+	/* In the vSSD, past the bad blocks */
+	uint32_t index;
+	size_t pos_write;
+	size_t written;
+	int inflight;
+	bool erasing;
+	/* The slot that issues the erase once inflight drops to 0 */
+	int erase_slot;
+};
+
+/* A vSSD and the requests kept in flight on it */
+struct bench_volume {
+	bench_volume(const bench_config &config, ocssd_volume *volume,
+			unsigned seed)
+		: config(config), volume(volume), rng(seed),
+		blocks(config.nblocks), buffers(config.depth) {
+		block_bytes = std::min(config.block_bytes,
+			vblk_bytes(volume->get_vssd()));
+		block_bytes -= block_bytes % config.size;
+
+		for (std::vector<char> &buf : buffers)
+			buf.assign(config.size, 'b');
+	}
+
+	void issue(int slot);
+	void erase(uint32_t blk, int slot);
+	void complete(uint32_t blk, int slot, STATS_OP op, uint64_t start,
+		size_t end, int status);
+
+	/* A vblk has one block of every LUN of its unit */
+	static size_t vblk_bytes(const virtual_ocssd &vssd) {
+		size_t bytes = SIZE_MAX;
+
+		for (size_t u = 0; u < vssd.get_num_units(); u++) {
+			const virtual_ocssd_unit *unit = vssd.get_unit(u);
+			const struct nvm_geo *geo = unit->get_geo();
+			size_t luns = 0;
+
+			for (const virtual_ocssd_channel *channel : unit->get_channels())
+				luns += channel->get_num_luns();
+			bytes = std::min(bytes, luns * geo->nplanes * geo->npages *
+				geo->nsectors * geo->sector_nbytes);
+		}
+
+		return bytes;
+	}
+
+	const bench_config &config;
+	ocssd_volume *volume;
+	size_t block_bytes;
+
+	std::mutex mutex_;
+	std::mt19937_64 rng;
+	std::vector<bench_block> blocks;
+	std::vector<std::vector<char>> buffers;
+	/* Slots waiting for a block that is not being erased */
+	std::deque<int> parked;
+	ocssd_op_stats stats;
+};
+
+static uint64_t deadline_ns;
+static std::atomic<int> active_slots(0);
+
+/* Called with mutex_ held */
+void bench_volume::issue(int slot)
+{
+	if (stats_now_ns() >= deadline_ns) {
+		active_slots--;
+		return;
+	}
+
+	int draw = rng() % 100;
+	STATS_OP op = draw < config.mix[STATS_READ] ? STATS_READ :
+		draw < config.mix[STATS_READ] + config.mix[STATS_WRITE] ?
+		STATS_WRITE : STATS_ERASE;
+	uint32_t first = rng() % config.nblocks;
+	uint32_t blk = first;
+
+	while (blocks[blk].erasing) {
+		blk = (blk + 1) % config.nblocks;
+		if (blk == first) {
+			parked.push_back(slot);
+			return;
+		}
+	}
+
+	bench_block &block = blocks[blk];
+	char *buf = buffers[slot].data();
+	uint64_t start = stats_now_ns();
+
+	if (op == STATS_READ && block.written < config.size)
+		op = STATS_WRITE;
+	if (op == STATS_WRITE && block.pos_write + config.size > block_bytes)
+		op = STATS_ERASE;
+
+	if (op == STATS_ERASE) {
+		block.erasing = true;
+		if (block.inflight)
+			block.erase_slot = slot;
+		else
+			erase(blk, slot);
+		return;
+	}
+
+	block.inflight++;
+	if (op == STATS_READ) {
+		size_t offset = rng() % (block.written / config.size) * config.size;
+
+		volume->read(block.index, buf, config.size, offset,
+			[this, blk, slot, start](int status, size_t len) {
+				complete(blk, slot, STATS_READ, start, 0, status);
+			});
+	} else {
+		size_t end = block.pos_write += config.size;
+
+		volume->write(block.index, buf, config.size,
+			[this, blk, slot, start, end](int status, size_t len) {
+				complete(blk, slot, STATS_WRITE, start, end, status);
+			});
+	}
+}
+
+/* Called with mutex_ held, once the block has nothing in flight */
+void bench_volume::erase(uint32_t blk, int slot)
+{
+	uint64_t start = stats_now_ns();
+
+	blocks[blk].inflight++;
+	blocks[blk].erase_slot = -1;
+	volume->erase(blocks[blk].index, [this, blk, slot, start](int status, size_t len) {
+		complete(blk, slot, STATS_ERASE, start, 0, status);
+	});
+}
+
+void bench_volume::complete(uint32_t blk, int slot, STATS_OP op,
+	uint64_t start, size_t end, int status)
+{
+	MutexLock lock(&mutex_);
+	bench_block &block = blocks[blk];
+
+	stats.record(op, stats_now_ns() - start,
+		op == STATS_ERASE || status ? 0 : config.size, status != 0);
+	block.inflight--;
+
+	if (op == STATS_ERASE) {
+		std::deque<int> waiting;
+
+		block.erasing = false;
+		block.pos_write = 0;
+		block.written = 0;
+
+		waiting.swap(parked);
+		for (int parked_slot : waiting)
+			issue(parked_slot);
+	} else if (op == STATS_WRITE) {
+		/* Writes to a block complete in order, the hole of a failed
+		 * one is gone with the next erase */
+		if (status == 0)
+			block.written = std::max(block.written, end);
+		else
+			block.erasing = true;
+	}
+
+	if (block.erasing && block.inflight == 0 && op != STATS_ERASE)
+		erase(blk, block.erase_slot);
+
+	if (slot >= 0)
+		issue(slot);
+}
+
+static void usage()
+{
+	printf("usage: ./ocssd_bench -H IP[,IP] [options]\n"
+		"  -v VOLUMES    remote vSSDs to allocate (1)\n"
+		"  -C CONNS      connections per vSSD (%d)\n"
+		"  -L LOOPS      client event loops, the vSSDs go round them (1)\n"
+		"  -c CHANNELS   channels per vSSD (4)\n"
+		"  -k BLOCKS     blocks per LUN of shared channels (1024)\n"
+		"  -x            exclusive channels\n"
+		"  -m R:W:E      percent of reads, writes and erases (70:30:0)\n"
+		"  -b BYTES      request size (65536)\n"
+		"  -q DEPTH      requests in flight per vSSD (16)\n"
+		"  -n BLOCKS     good blocks used on every vSSD (8)\n"
+		"  -s BYTES      bytes written to a block before it is erased\n"
+		"                (all of it)\n"
+		"  -T SECONDS    length of the run (10)\n"
+		"  -a PATH       admin socket of the server, on this host\n"
+		"  -o FILE       CSV report\n", CLIENT_CONNS_PER_VOLUME);
+}
+
+/* Every sample line of an admin socket dump */
+static int scrape(const std::string &path, std::vector<std::string> &lines)
+{
+	struct sockaddr_un addr;
+	std::string out;
+	char buf[4096];
+	ssize_t ret;
+	int fd;
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		out.append(buf, ret);
+	close(fd);
+
+	std::istringstream in(out);
+	std::string line;
+
+	lines.clear();
+	while (std::getline(in, line))
+		lines.push_back(line);
+	return 0;
+}
+
+/* What the server reports for the vSSDs of the run */
+struct server_stats {
+	server_stats() {
+		for (int op = 0; op < STATS_NUM_OPS; op++)
+			ops[op] = bytes[op] = errors[op] = 0;
+	}
+
+	uint64_t ops[STATS_NUM_OPS];
+	uint64_t bytes[STATS_NUM_OPS];
+	uint64_t errors[STATS_NUM_OPS];
+	/* The worst vSSD, by op and quantile */
+	std::map<std::string, uint64_t> quantiles[STATS_NUM_OPS];
+};
+
+static void parse_server_stats(const std::vector<std::string> &lines,
+	const std::set<uint32_t> &ids, server_stats &stats)
+{
+	for (const std::string &line : lines) {
+		char name[64], op_name[16], quantile[16];
+		unsigned vssd;
+		unsigned long value;
+		int op;
+
+		if (sscanf(line.c_str(), "%63[a-z_]{vssd=\"%u\",op=\"%15[a-z]\","
+				"quantile=\"%15[0-9.]\"} %lu", name, &vssd, op_name,
+				quantile, &value) != 5) {
+			quantile[0] = 0;
+			if (sscanf(line.c_str(), "%63[a-z_]{vssd=\"%u\",op=\"%15[a-z]\"} %lu",
+					name, &vssd, op_name, &value) != 4)
+				continue;
+		}
+
+		if (!ids.count(vssd))
+			continue;
+		for (op = 0; op < STATS_NUM_OPS; op++)
+			if (strcmp(op_name, stats_op_names[op]) == 0)
+				break;
+		if (op == STATS_NUM_OPS)
+			continue;
+
+		if (quantile[0] && strcmp(name, "ocssd_latency_ns") == 0) {
+			uint64_t &worst = stats.quantiles[op][quantile];
+
+			worst = std::max<uint64_t>(worst, value);
+		} else if (strcmp(name, "ocssd_ops_total") == 0) {
+			stats.ops[op] += value;
+		} else if (strcmp(name, "ocssd_bytes_total") == 0) {
+			stats.bytes[op] += value;
+		} else if (strcmp(name, "ocssd_errors_total") == 0) {
+			stats.errors[op] += value;
+		}
+	}
+}
+
+static bool parse_mix(const char *arg, int mix[STATS_NUM_OPS])
+{
+	int read, write, erase;
+
+	if (sscanf(arg, "%d:%d:%d", &read, &write, &erase) != 3 ||
+			read < 0 || write < 0 || erase < 0 ||
+			read + write + erase != 100)
+		return false;
+
+	mix[STATS_ALLOC] = 0;
+	mix[STATS_READ] = read;
+	mix[STATS_WRITE] = write;
+	mix[STATS_ERASE] = erase;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	bench_config config;
+	std::vector<std::unique_ptr<ocssd_client>> clients;
+	std::vector<std::unique_ptr<bench_volume>> volumes;
+	std::set<uint32_t> ids;
+	std::vector<std::string> lines;
+	server_stats before, after;
+	bool server = false;
+	uint64_t start;
+	double seconds;
+	int ret = 0;
+	int opt;
+
+	config.volumes = 1;
+	config.conns = CLIENT_CONNS_PER_VOLUME;
+	config.loops = 1;
+	config.channels = 4;
+	config.blocks_per_lun = 1024;
+	config.shared = 1;
+	parse_mix("70:30:0", config.mix);
+	config.size = 65536;
+	config.depth = 16;
+	config.nblocks = 8;
+	config.block_bytes = SIZE_MAX;
+	config.seconds = 10;
+
+	while ((opt = getopt(argc, argv, "H:v:C:L:c:k:xm:b:q:n:s:T:a:o:h")) != -1) {
+		switch (opt) {
+		case 'H': {
+			std::istringstream in(optarg);
+			std::string ip;
+
+			while (std::getline(in, ip, ','))
+				if (!ip.empty())
+					config.servers.push_back(ip);
+			break;
+		}
+		case 'v':
+			config.volumes = atoi(optarg);
+			break;
+		case 'C':
+			config.conns = atoi(optarg);
+			break;
+		case 'L':
+			config.loops = atoi(optarg);
+			break;
+		case 'c':
+			config.channels = atoi(optarg);
+			break;
+		case 'k':
+			config.blocks_per_lun = atoi(optarg);
+			break;
+		case 'x':
+			config.shared = 0;
+			break;
+		case 'm':
+			if (!parse_mix(optarg, config.mix)) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'b':
+			config.size = atol(optarg);
+			break;
+		case 'q':
+			config.depth = atoi(optarg);
+			break;
+		case 'n':
+			config.nblocks = atoi(optarg);
+			break;
+		case 's':
+			config.block_bytes = atol(optarg);
+			break;
+		case 'T':
+			config.seconds = atof(optarg);
+			break;
+		case 'a':
+			config.admin = optarg;
+			break;
+		case 'o':
+			config.csv = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (config.servers.empty() || config.volumes < 1 || config.conns < 1 ||
+			config.loops < 1 || config.channels < 1 || config.size == 0 ||
+			config.depth < 1 || config.nblocks < 1 ||
+			config.block_bytes < config.size || config.seconds <= 0) {
+		usage();
+		return 1;
+	}
+
+	for (int i = 0; i < config.loops; i++) {
+		clients.push_back(std::unique_ptr<ocssd_client>(
+			new ocssd_client(config.conns)));
+		for (const std::string &ip : config.servers)
+			clients.back()->add_server(ip);
+	}
+
+	for (int i = 0; i < config.volumes; i++) {
+		ocssd_client *client = clients[i % config.loops].get();
+		ocssd_volume *volume = client->alloc(ocssd_alloc_request(
+			config.channels, config.blocks_per_lun, config.shared, 0, 1,
+			VSSD_INIT_BBT)).get();
+
+		if (!volume) {
+			printf("alloc of vSSD %d failed\n", i);
+			ret = 1;
+			goto out;
+		}
+
+		volumes.push_back(std::unique_ptr<bench_volume>(
+			new bench_volume(config, volume, i)));
+		ids.insert(volume->get_id());
+
+		if (volumes.back()->block_bytes == 0) {
+			printf("vSSD %u: blocks smaller than a request\n",
+				volume->get_id());
+			ret = 1;
+			goto out;
+		}
+	}
+
+	/* Start from erased blocks, or full ones if nothing is written */
+	for (auto &vol : volumes) {
+		std::vector<char> data(config.size, 'f');
+		uint32_t index = 0;
+
+		for (uint32_t blk = 0; blk < config.nblocks; blk++) {
+			bench_block &block = vol->blocks[blk];
+			int status;
+
+			/* Bad blocks fail with EIO, the end of the vSSD with EINVAL */
+			while ((status = vol->volume->erase(index).get()) == EIO)
+				index++;
+			if (status) {
+				printf("vSSD %u: erase of block %u failed: %s\n",
+					vol->volume->get_id(), index, strerror(status));
+				ret = 1;
+				goto out;
+			}
+			block.index = index++;
+
+			while (config.mix[STATS_WRITE] == 0 &&
+					block.pos_write + config.size <= vol->block_bytes) {
+				if (vol->volume->write(block.index, data.data(),
+						config.size).get()) {
+					printf("vSSD %u: fill of block %u failed\n",
+						vol->volume->get_id(), block.index);
+					ret = 1;
+					goto out;
+				}
+				block.pos_write += config.size;
+			}
+			block.written = block.pos_write;
+		}
+	}
+
+	if (!config.admin.empty()) {
+		int err = scrape(config.admin, lines);
+
+		if (err < 0)
+			printf("admin socket %s: %s\n", config.admin.c_str(), strerror(-err));
+		else
+			server = true;
+		parse_server_stats(lines, ids, before);
+	}
+
+	printf("%d vSSDs, %d connections each, %d loops, %d channels, mix %d:%d:%d, "
+		"size %lu, depth %d, %u blocks of %lu bytes, %.1f s\n",
+		config.volumes, config.conns, config.loops, config.channels,
+		config.mix[STATS_READ], config.mix[STATS_WRITE],
+		config.mix[STATS_ERASE], config.size, config.depth, config.nblocks,
+		volumes[0]->block_bytes, config.seconds);
+
+	start = stats_now_ns();
+	deadline_ns = start + config.seconds * 1e9;
+	active_slots = config.volumes * config.depth;
+	for (auto &vol : volumes) {
+		MutexLock lock(&vol->mutex_);
+
+		for (int slot = 0; slot < config.depth; slot++)
+			vol->issue(slot);
+	}
+
+	/* Slots stop at their first completion past the deadline */
+	while (active_slots.load() > 0)
+		usleep(1000);
+	for (auto &vol : volumes) {
+		while (true) {
+			MutexLock lock(&vol->mutex_);
+			bool busy = false;
+
+			for (bench_block &block : vol->blocks)
+				busy |= block.inflight > 0;
+			if (!busy)
+				break;
+			usleep(1000);
+		}
+	}
+	seconds = (stats_now_ns() - start) / 1e9;
+
+	if (server) {
+		if (scrape(config.admin, lines) < 0)
+			server = false;
+		parse_server_stats(lines, ids, after);
+	}
+
+	{
+		FILE *csv = NULL;
+
+		if (!config.csv.empty()) {
+			csv = fopen(config.csv.c_str(), "w");
+			if (!csv)
+				perror("fopen");
+			else
+				fprintf(csv, "side,op,mbps,iops,p50_us,p99_us,p999_us,"
+					"max_us,errors\n");
+		}
+
+		for (int op = STATS_READ; op <= STATS_ERASE; op++) {
+			std::vector<uint64_t> counts(HIST_NUM_BUCKETS, 0);
+			uint64_t ops = 0, bytes = 0, errors = 0, max = 0;
+			uint64_t p[3];
+
+			for (auto &vol : volumes) {
+				const ocssd_histogram &hist = vol->stats.latency_ns[op];
+
+				hist.snapshot(counts);
+				ops += hist.get_count();
+				max = std::max(max, hist.get_max());
+				bytes += vol->stats.bytes[op].load();
+				errors += vol->stats.errors[op].load();
+			}
+
+			if (ops == 0)
+				continue;
+			if (errors)
+				ret = 1;
+
+			p[0] = std::min(ocssd_histogram::percentile(counts, 0.5), max);
+			p[1] = std::min(ocssd_histogram::percentile(counts, 0.99), max);
+			p[2] = std::min(ocssd_histogram::percentile(counts, 0.999), max);
+
+			printf("client %-5s %8.2f MB/s %8.0f IOPS, p50 %lu us, p99 %lu us, "
+				"p999 %lu us, max %lu us, %lu errors\n", stats_op_names[op],
+				bytes / seconds / 1e6, ops / seconds, p[0] / 1000,
+				p[1] / 1000, p[2] / 1000, max / 1000, errors);
+			if (csv)
+				fprintf(csv, "client,%s,%.2f,%.0f,%lu,%lu,%lu,%lu,%lu\n",
+					stats_op_names[op], bytes / seconds / 1e6,
+					ops / seconds, p[0] / 1000, p[1] / 1000,
+					p[2] / 1000, max / 1000, errors);
+
+			if (!server)
+				continue;
+
+			/* The server reports requests and bytes for the run, and
+			 * quantiles for the life of the vSSDs, worst one first */
+			ops = after.ops[op] - before.ops[op];
+			bytes = after.bytes[op] - before.bytes[op];
+			errors = after.errors[op] - before.errors[op];
+			p[0] = after.quantiles[op]["0.5"];
+			p[1] = after.quantiles[op]["0.99"];
+			p[2] = after.quantiles[op]["0.999"];
+
+			printf("server %-5s %8.2f MB/s %8.0f IOPS, p50 %lu us, p99 %lu us, "
+				"p999 %lu us, %lu errors\n", stats_op_names[op],
+				bytes / seconds / 1e6, ops / seconds, p[0] / 1000,
+				p[1] / 1000, p[2] / 1000, errors);
+			if (csv)
+				fprintf(csv, "server,%s,%.2f,%.0f,%lu,%lu,%lu,,%lu\n",
+					stats_op_names[op], bytes / seconds / 1e6,
+					ops / seconds, p[0] / 1000, p[1] / 1000,
+					p[2] / 1000, errors);
+		}
+
+		if (csv)
+			fclose(csv);
+	}
+
+out:
+	for (int i = 0; i < (int)volumes.size(); i++) {
+		ocssd_client *client = clients[i % config.loops].get();
+		uint32_t id = volumes[i]->volume->get_id();
+
+		if (client->release(volumes[i]->volume).get())
+			printf("vSSD %u: release failed\n", id);
+	}
+
+	return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef OCSSD_BUFFER_POOL_H
+#define OCSSD_BUFFER_POOL_H
+
+#include <sys/mman.h>
+#include <cstdio>
+#include <vector>
+#include <stdexcept>
+
+/*
+ * Fixed-size I/O buffers carved out of one region that is mapped and
+ * faulted in up front. Chunks are aligned like nvm_buf_alloc() buffers,
+ * so they can be handed to the vblk calls directly and then to the
+ * socket without copying.
+ *
+ * A pool belongs to one reactor and is only touched from its thread.
+ */
+class ocssd_buffer_pool {
+public:
+	ocssd_buffer_pool(size_t chunk_size, size_t num_chunks, size_t align = 4096)
+		: chunk_size_((chunk_size + align - 1) / align * align),
+		region_size_(chunk_size_ * num_chunks)
+	{
+		void *region = mmap(NULL, region_size_, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (region == MAP_FAILED)
+			throw std::runtime_error("Error: buffer pool mmap failed\n");
+
+		base_ = (char *)region;
+		for (size_t i = num_chunks; i > 0; i--)
+			free_.push_back(base_ + (i - 1) * chunk_size_);
+	}
+
+	~ocssd_buffer_pool() {
+		munmap(base_, region_size_);
+	}
+
+	/* NULL when the pool is exhausted, the caller falls back to malloc */
+	char *get() {
+		if (free_.empty())
+			return NULL;
+
+		char *chunk = free_.back();
+		free_.pop_back();
+		return chunk;
+	}
+
+	void put(char *chunk) {
+		free_.push_back(chunk);
+	}
+
+	size_t get_chunk_size() const {return chunk_size_;}
+	size_t get_num_free() const {return free_.size();}
+
+private:
+	ocssd_buffer_pool(const ocssd_buffer_pool &);
+	ocssd_buffer_pool & operator=(const ocssd_buffer_pool &);
+
+	size_t chunk_size_;
+	size_t region_size_;
+	char *base_;
+	std::vector<char *> free_;
+};
+
+#endif
@@ -7,11 +7,69 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "ocssd_server.h"
+#include "ocssd_client_lib.h"
 
 #define BUFFER_SIZE 1024
 
+static int recv_full(int sock, char *buffer, size_t count)
+{
+	size_t received = 0;
+	int ret;
+
+	while (received < count) {
+		ret = recv(sock, buffer + received, count - received, 0);
+		if (ret <= 0)
+			return -1;
+		received += ret;
+	}
+
+	return 0;
+}
+
+/* Receive one reply frame, the payload goes to data if there is room */
+static int recv_reply(int sock, ocssd_frame_header &header, char *data, size_t size)
+{
+	char buffer[FRAME_HEADER_SIZE];
+
+	if (recv_full(sock, buffer, FRAME_HEADER_SIZE) < 0)
+		return -1;
+
+	header = ocssd_frame_header(buffer);
+	if (header.get_data_len() > size)
+		return -1;
+
+	return recv_full(sock, data, header.get_data_len());
+}
+
+static int recv_vssd(int sock, virtual_ocssd &vssd)
+{
+	char buffer[FRAME_HEADER_SIZE];
+	ocssd_frame_header reply;
+
+	/* The descriptor grows with the vSSD, take it whatever its size */
+	if (recv_full(sock, buffer, FRAME_HEADER_SIZE) < 0)
+		return -1;
+
+	reply = ocssd_frame_header(buffer);
+	std::vector<char> desc(reply.get_data_len());
+	if (recv_full(sock, desc.data(), desc.size()) < 0)
+		return -1;
+
+	printf("Received %lu, status %d\n", reply.get_data_len(), reply.get_status());
+	if (reply.get_status())
+		return -reply.get_status();
+
+	if (!vssd.deserialize(desc.data(), desc.size())) {
+		printf("Bad vSSD descriptor\n");
+		return -1;
+	}
+	vssd.print();
+	return 0;
+}
+
 static int test_local_ocssd(int sock)
 {
 	char buffer[BUFFER_SIZE];
@@ -24,9 +82,9 @@ static int test_local_ocssd(int sock)
 	printf("Request size %lu, sent %d\n", size, sent);
 
 	class virtual_ocssd vssd;
-	size = recv(sock, buffer, BUFFER_SIZE, 0);
-	printf("Received %lu\n", size);
-	vssd.deserialize(buffer);
+	if (recv_vssd(sock, vssd) < 0)
+		return -1;
+
 	const virtual_ocssd_unit *vunit = vssd.get_unit(0);
 
 	for (const virtual_ocssd_channel *vchannel : vunit->get_channels()) {
@@ -52,6 +110,7 @@ static int test_local_ocssd(int sock)
 static int test_erase_block(int sock, uint32_t block_idx)
 {
 	ocssd_io_request request(ERASE_BLOCK_REQUEST, block_idx, 0, 0);
+	ocssd_frame_header reply;
 	char buffer[BUFFER_SIZE];
 
 	size_t size = request.serialize(buffer);
@@ -59,12 +118,17 @@ static int test_erase_block(int sock, uint32_t block_idx)
 	int sent = send(sock, buffer, size, 0);
 	printf("%s: Request size %lu, sent %d\n", __func__, size, sent);
 
+	if (recv_reply(sock, reply, NULL, 0) < 0)
+		return -1;
+
+	printf("%s: status %d\n", __func__, reply.get_status());
 	return 0;
 }
 
 static int test_write_block(int sock, uint32_t block_idx, size_t count)
 {
 	ocssd_io_request request(WRITE_BLOCK_REQUEST, block_idx, count, 0);
+	ocssd_frame_header reply;
 	char buffer[BUFFER_SIZE];
 
 	size_t size = request.serialize(buffer);
@@ -79,12 +143,18 @@ static int test_write_block(int sock, uint32_t block_idx, size_t count)
 	printf("%s: write size %lu, sent %d\n", __func__, size, sent);
 
 	free(data_buf);
+
+	if (recv_reply(sock, reply, NULL, 0) < 0)
+		return -1;
+
+	printf("%s: status %d\n", __func__, reply.get_status());
 	return 0;
 }
 
 static int test_read_block(int sock, uint32_t block_idx, size_t count, size_t offset)
 {
 	ocssd_io_request request(READ_BLOCK_REQUEST, block_idx, count, offset);
+	ocssd_frame_header reply;
 	char buffer[BUFFER_SIZE];
 
 	size_t size = request.serialize(buffer);
@@ -95,54 +165,393 @@ static int test_read_block(int sock, uint32_t block_idx, size_t count, size_t of
 	char* data_buf = (char *)malloc(count);
 
 	memset(data_buf, 'b', count);
-	size_t received = 0;
-	int ret;
-	while ((ret = recv(sock, data_buf + received, count - received, 0)) > 0) {
-		received += ret;
-		if (received >= count)
-		break;
+	if (recv_reply(sock, reply, data_buf, count) < 0) {
+		free(data_buf);
+		return -1;
 	}
 
-	printf("%s: read size %lu, recv %lu, %c %c\n", __func__, size, received,
+	printf("%s: read size %lu, recv %lu, status %d, %c %c\n", __func__, size,
+			reply.get_data_len(), reply.get_status(),
 			data_buf[0], data_buf[count - 1]);
 
 	free(data_buf);
 	return 0;
 }
 
+/*
+ * Keep depth reads in flight on one connection and match the replies
+ * by tag, they are not required to come back in order.
+ */
+static int test_pipelined_read(int sock, uint32_t block_idx, size_t count, int depth)
+{
+	std::vector<bool> completed(depth, false);
+	char buffer[BUFFER_SIZE];
+	char* data_buf = (char *)malloc(count);
+	int done = 0;
+
+	for (int i = 0; i < depth; i++) {
+		ocssd_io_request request(READ_BLOCK_REQUEST, block_idx, count,
+					count * i, i);
+		size_t size = request.serialize(buffer);
+
+		if (send(sock, buffer, size, 0) != (ssize_t)size) {
+			free(data_buf);
+			return -1;
+		}
+	}
+
+	while (done < depth) {
+		ocssd_frame_header reply;
+
+		if (recv_reply(sock, reply, data_buf, count) < 0)
+			break;
+
+		if (reply.get_tag() >= (uint64_t)depth || completed[reply.get_tag()]) {
+			printf("%s: unexpected tag %lu\n", __func__, reply.get_tag());
+			break;
+		}
+
+		completed[reply.get_tag()] = true;
+		done++;
+	}
+
+	printf("%s: %d of %d reads completed\n", __func__, done, depth);
+
+	free(data_buf);
+	return done == depth ? 0 : -1;
+}
+
+/*
+ * Write count bytes to each of two blocks with one vectored write,
+ * then read both back with one vectored read.
+ */
+static int test_vector_io(int sock, uint32_t block_idx, size_t count)
+{
+	ocssd_vector_request writev(WRITEV_BLOCK_REQUEST, 1);
+	ocssd_vector_request readv(READV_BLOCK_REQUEST, 2);
+	ocssd_frame_header reply;
+	char buffer[BUFFER_SIZE];
+
+	writev.add(block_idx, 0, count);
+	writev.add(block_idx + 1, 0, count);
+	readv.add(block_idx, 0, count);
+	readv.add(block_idx + 1, 0, count);
+
+	char* data_buf = (char *)malloc(count * 2);
+
+	memset(data_buf, 'c', count);
+	memset(data_buf + count, 'd', count);
+
+	size_t size = writev.serialize(buffer);
+	if (send(sock, buffer, size, 0) != (ssize_t)size ||
+			send(sock, data_buf, count * 2, 0) != (ssize_t)(count * 2) ||
+			recv_reply(sock, reply, NULL, 0) < 0) {
+		free(data_buf);
+		return -1;
+	}
+
+	printf("%s: writev status %d\n", __func__, reply.get_status());
+
+	memset(data_buf, 'b', count * 2);
+	size = readv.serialize(buffer);
+	if (send(sock, buffer, size, 0) != (ssize_t)size ||
+			recv_reply(sock, reply, data_buf, count * 2) < 0) {
+		free(data_buf);
+		return -1;
+	}
+
+	printf("%s: readv recv %lu, status %d, %c %c\n", __func__,
+			reply.get_data_len(), reply.get_status(),
+			data_buf[0], data_buf[count * 2 - 1]);
+
+	free(data_buf);
+	return 0;
+}
+
 static int test_remote_ocssd(int sock)
 {
 	char buffer[BUFFER_SIZE];
 	memset(buffer, 0, BUFFER_SIZE);
 
-	ocssd_alloc_request request(4, 1024, 1, 0, 1);
+	ocssd_alloc_request request(4, 1024, 1, 0, 1, VSSD_INIT_BBT);
 	size_t size = request.serialize(buffer);
 
 	int sent = send(sock, buffer, size, 0);
 	printf("Request size %lu, sent %d\n", size, sent);
 
 	class virtual_ocssd vssd;
-	size = recv(sock, buffer, BUFFER_SIZE, 0);
-	printf("Received %lu\n", size);
-	vssd.deserialize(buffer);
+	if (recv_vssd(sock, vssd) < 0)
+		return -1;
 
 	test_erase_block(sock, 0);
 	test_write_block(sock, 0, 1048576);
 	test_read_block(sock, 0, 1048576, 0);
+	test_pipelined_read(sock, 0, 65536, 16);
+	test_erase_block(sock, 1);
+	test_erase_block(sock, 2);
+	test_vector_io(sock, 1, 262144);
 
 	return 0;
 }
 
+/*
+ * Allocate a vSSD limited to iops and time pipelined reads on it, they
+ * should take about depth / iops seconds past the initial burst.
+ */
+static int test_qos_ocssd(int sock, uint32_t iops)
+{
+	char buffer[BUFFER_SIZE];
+	struct timespec start, end;
+	ocssd_qos qos;
+
+	qos.iops = iops;
+	ocssd_alloc_request request(4, 1024, 1, 0, 1, VSSD_INIT_BBT);
+	request.set_qos(qos);
+	size_t size = request.serialize(buffer);
+
+	int sent = send(sock, buffer, size, 0);
+	printf("Request size %lu, sent %d\n", size, sent);
+
+	class virtual_ocssd vssd;
+	if (recv_vssd(sock, vssd) < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	test_pipelined_read(sock, 0, 4096, 64);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%s: 64 reads at %u IOPS took %.3f s\n", __func__, iops,
+		end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	return 0;
+}
+
+/* Attach to a vSSD allocated earlier, its blocks keep their data */
+static int test_attach_ocssd(int sock, uint32_t vssd_id)
+{
+	char buffer[BUFFER_SIZE];
+
+	ocssd_attach_request request(vssd_id);
+	size_t size = request.serialize(buffer);
+
+	int sent = send(sock, buffer, size, 0);
+	printf("Request size %lu, sent %d\n", size, sent);
+
+	class virtual_ocssd vssd;
+	if (recv_vssd(sock, vssd) < 0)
+		return -1;
+
+	test_read_block(sock, 0, 1048576, 0);
+
+	return 0;
+}
+
+/* The byte at offset of a block written by test_staged_writes() */
+static char staged_byte(size_t offset)
+{
+	return (char)(offset * 7 + 3);
+}
+
+/* Append count bytes of the pattern at offset, or check them */
+static int staged_io(int sock, uint32_t block_idx, size_t offset, size_t count,
+	bool write)
+{
+	ocssd_io_request request(write ? WRITE_BLOCK_REQUEST : READ_BLOCK_REQUEST,
+				block_idx, count, write ? 0 : offset);
+	ocssd_frame_header reply;
+	char buffer[BUFFER_SIZE];
+	std::vector<char> data(count);
+	size_t size = request.serialize(buffer);
+	int ret = -1;
+
+	for (size_t i = 0; write && i < count; i++)
+		data[i] = staged_byte(offset + i);
+
+	if (send(sock, buffer, size, 0) != (ssize_t)size ||
+			(write && send(sock, data.data(), count, 0) != (ssize_t)count) ||
+			recv_reply(sock, reply, data.data(), count) < 0)
+		return -1;
+
+	if (!reply.get_status() && (write || reply.get_data_len() == count)) {
+		ret = 0;
+		for (size_t i = 0; !write && i < count; i++) {
+			if (data[i] != staged_byte(offset + i)) {
+				printf("%s: mismatch at %lu\n", __func__, offset + i);
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	printf("%s: %s %lu at %lu, status %d, %s\n", __func__,
+		write ? "write" : "read", count, offset, reply.get_status(),
+		ret ? "FAILED" : "ok");
+	return ret;
+}
+
+/*
+ * Writes that are not write unit aligned are staged by the server:
+ * append a few small ones and a large one, and read all of it back,
+ * also across the staged tail. With a vssd_id, attach to the vSSD of
+ * an earlier run instead, after a server restart, and check its last
+ * writes, which were still staged, are all there.
+ */
+static int test_staged_writes(int sock, int vssd_id)
+{
+	char buffer[BUFFER_SIZE];
+	size_t size;
+	int ret = 0;
+
+	if (vssd_id >= 0) {
+		ocssd_attach_request request(vssd_id);
+
+		size = request.serialize(buffer);
+	} else {
+		ocssd_alloc_request request(4, 1024, 1, 0, 1, VSSD_INIT_BBT);
+
+		size = request.serialize(buffer);
+	}
+
+	class virtual_ocssd vssd;
+	if (send(sock, buffer, size, 0) != (ssize_t)size || recv_vssd(sock, vssd) < 0)
+		return -1;
+
+	if (vssd_id >= 0)
+		return staged_io(sock, 0, 104000, 5000, false);
+
+	test_erase_block(sock, 0);
+	for (size_t i = 0; i < 5; i++)
+		ret |= staged_io(sock, 0, i * 1000, 1000, true);
+	ret |= staged_io(sock, 0, 0, 5000, false);
+	ret |= staged_io(sock, 0, 5000, 100000, true);
+	ret |= staged_io(sock, 0, 0, 105000, false);
+	ret |= staged_io(sock, 0, 104000, 1000, false);
+	ret |= staged_io(sock, 0, 105000, 4000, true);
+
+	printf("%s: vSSD %u\n", __func__, vssd.get_id());
+	return ret;
+}
+
+/* Give a vSSD back, its capacity is reused once nothing is attached */
+static int test_release_ocssd(int sock, uint32_t vssd_id)
+{
+	char buffer[BUFFER_SIZE];
+	ocssd_frame_header reply;
+
+	ocssd_release_request request(vssd_id);
+	size_t size = request.serialize(buffer);
+
+	if (send(sock, buffer, size, 0) != (ssize_t)size ||
+			recv_reply(sock, reply, NULL, 0) < 0)
+		return -1;
+
+	printf("%s: vSSD %u, status %d\n", __func__, vssd_id, reply.get_status());
+	return reply.get_status() ? -1 : 0;
+}
+
+/*
+ * The same over the client library: write two blocks, then read them
+ * back with depth reads in flight across the connection pool. The vSSD
+ * is released after, and its capacity must do for a second one.
+ */
+static int test_client_lib(const char *ip, int depth)
+{
+	ocssd_client client;
+	const size_t count = 65536;
+
+	client.add_server(ip);
+	ocssd_volume *volume = client.alloc(
+		ocssd_alloc_request(4, 1024, 1, 0, 1, VSSD_INIT_BBT)).get();
+	if (!volume) {
+		printf("%s: alloc failed\n", __func__);
+		return -1;
+	}
+
+	std::vector<char> data(count * depth, 'e');
+	std::vector<std::future<int>> results;
+
+	for (uint32_t blk = 0; blk < 2; blk++) {
+		if (volume->erase(blk).get() ||
+				volume->write(blk, data.data(), count * depth / 2).get())
+			printf("%s: block %u erase or write failed\n", __func__, blk);
+	}
+
+	std::fill(data.begin(), data.end(), 'b');
+	for (int i = 0; i < depth; i++)
+		results.push_back(volume->read(i % 2, data.data() + count * i,
+					count, count * (i / 2)));
+
+	int failed = 0;
+	for (auto &result : results)
+		failed += result.get() != 0;
+
+	printf("%s: vSSD %u, %d of %d reads failed, %c %c\n", __func__,
+		volume->get_id(), failed, depth, data[0], data[count * depth - 1]);
+
+	if (client.release(volume).get()) {
+		printf("%s: release failed\n", __func__);
+		return -1;
+	}
+
+	volume = client.alloc(
+		ocssd_alloc_request(4, 1024, 1, 0, 1, VSSD_INIT_BBT)).get();
+	printf("%s: realloc after release %s\n", __func__, volume ? "OK" : "failed");
+
+	return failed || !volume ? -1 : 0;
+}
+
+/*
+ * Place a vSSD from in-process rows: ip shows as a node short of
+ * channels, and as 127.0.0.2, on the same server through loopback, as
+ * one with room on the requested NUMA node. The latter must be picked.
+ */
+static int test_placement(const char *ip)
+{
+	ocssd_memory_source *source = new ocssd_memory_source();
+	ocssd_placement placement(source);
+	ocssd_client client;
+	ocssd_alloc_request request(4, 1024, 1, 0, 1, VSSD_INIT_BBT);
+	std::vector<std::string> nodes;
+
+	source->publish({"short_dev_nvme1n1", ip, 0, 2, 0, 256});
+	source->publish({"roomy_dev_nvme1n1", "127.0.0.2", 0, 4, 0, 512});
+
+	placement.place(request, nodes, 2);
+	printf("%s: %lu nodes, best %s\n", __func__, nodes.size(),
+		nodes.empty() ? "none" : nodes[0].c_str());
+
+	/* Placing charged the node, read the rows again for the real one */
+	placement.invalidate();
+
+	ocssd_volume *volume = client.alloc(request, &placement).get();
+	if (!volume) {
+		printf("%s: alloc failed\n", __func__);
+		return -1;
+	}
+
+	printf("%s: vSSD %u on server %lu\n", __func__, volume->get_id(),
+		volume->get_server());
+	return client.release(volume).get() ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	if (argc <= 2) {
-		printf("Usage: %s ip_address remote\n", argv[0]);
+		printf("Usage: %s ip_address remote [vssd_id]\n", argv[0]);
+		printf("remote: 0 local, 1 remote, 2 attach to vssd_id, 3 QoS test, "
+			"4 client library test, 5 release vssd_id, 6 placement test, "
+			"7 staged writes [on vssd_id]\n");
 		return 1;
 	}
 
 	const char *ip = argv[1];
 	int remote = atoi(argv[2]);
 
+	if (remote == 4)
+		return test_client_lib(ip, 32) ? 1 : 0;
+	if (remote == 6)
+		return test_placement(ip) ? 1 : 0;
+
 	struct sockaddr_in server_address;
 	bzero(&server_address, sizeof(server_address));
 	server_address.sin_family = AF_INET;
@@ -158,11 +567,19 @@ int main(int argc, char **argv)
 		printf("errno %d\n", errno);
 	} else if (remote == 0) {
 		test_local_ocssd(sock);
+	} else if (remote == 2) {
+		test_attach_ocssd(sock, argc > 3 ? atoi(argv[3]) : 0);
+	} else if (remote == 3) {
+		test_qos_ocssd(sock, 100);
+	} else if (remote == 5) {
+		test_release_ocssd(sock, argc > 3 ? atoi(argv[3]) : 0);
+	} else if (remote == 7) {
+		ret = test_staged_writes(sock, argc > 3 ? atoi(argv[3]) : -1);
 	} else {
 		test_remote_ocssd(sock);
 	}
 
 	close(sock);
 
-	return 0;
+	return ret ? 1 : 0;
 }
@@ -0,0 +1,927 @@
+#ifndef OCSSD_CLIENT_LIB_H
+#define OCSSD_CLIENT_LIB_H
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <event.h>
+
+#include "ocssd_server.h"
+#include "ocssd_placement.h"
+
+/*
+ * libocssd_client: asynchronous access to remote vSSDs.
+ *
+ * An ocssd_client runs one event loop thread that owns every socket.
+ * Calls can be made from any thread: they queue the request and wake
+ * the loop, and the callback runs later on the loop thread, so it must
+ * not block. Each call also has a form that returns a future.
+ *
+ * A volume is one vSSD on one server, reached through a pool of
+ * connections that are all attached to it. Each connection pipelines
+ * up to CLIENT_MAX_INFLIGHT requests, matched to replies by tag, and
+ * sends as many queued requests as fit in one sendmsg(). All requests
+ * for a block go through the same connection, so writes to a vblk are
+ * appended in the order they were issued.
+ */
+
+/* Requests in flight per connection, the rest wait in the client */
+#define CLIENT_MAX_INFLIGHT 64
+
+/* Connections to a remote vSSD, its blocks are spread over them */
+#define CLIENT_CONNS_PER_VOLUME 4
+
+/* Requests coalesced into one sendmsg() */
+#define CLIENT_SEND_IOVS 64
+
+class ocssd_client;
+class ocssd_volume;
+
+/* 0 or an errno, and the number of bytes that came back */
+typedef std::function<void(int status, size_t len)> ocssd_io_callback;
+typedef std::function<void(int status, ocssd_volume *volume)> ocssd_volume_callback;
+typedef std::function<void(int status)> ocssd_status_callback;
+
+/* A request on its way through a client connection */
+struct client_op {
+	client_op(uint64_t tag)
+		: tag(tag), payload(NULL), payload_len(0), dest(NULL),
+		dest_len(0), sent(0), received(0) {}
+
+	template <typename Request>
+	void set_frame(Request &request) {
+		frame.resize(MESSAGE_BUFFER_SIZE);
+		frame.resize(request.serialize(frame.data()));
+	}
+
+	/* Run the callback and free the request */
+	void complete(int status) {
+		done(status, this);
+		delete this;
+	}
+
+	uint64_t tag;
+	std::vector<char> frame;	/* Header and parameters */
+	const char *payload;		/* Write data, owned by the caller */
+	size_t payload_len;
+	char *dest;			/* Read data goes here if set, */
+	size_t dest_len;
+	std::vector<char> data;		/* and here otherwise */
+	size_t sent;
+	size_t received;
+	std::function<void(int status, client_op *op)> done;
+};
+
+/* One socket to a server, only touched from the loop thread */
+class client_conn {
+public:
+	client_conn(struct event_base *base, const struct sockaddr_in &addr);
+	~client_conn();
+
+	/* The request completes with ENOTCONN if the connection is gone */
+	void submit(client_op *op);
+
+private:
+	client_conn(const client_conn &);
+	client_conn & operator=(const client_conn &);
+
+	static void on_read(int fd, short ev, void *arg);
+	static void on_write(int fd, short ev, void *arg);
+	void receive();
+	void send_queued();
+	void fail(int error);
+
+	int fd_;
+	struct event ev_read_;
+	struct event ev_write_;
+
+	/* Waiting for room in the pipeline */
+	std::deque<client_op *> backlog_;
+
+	/* Being sent, the head may be partly out */
+	std::deque<client_op *> sendq_;
+
+	/* Sent or being sent, by tag */
+	std::map<uint64_t, client_op *> inflight_;
+
+	/* The reply being received, cur_ is NULL for an unknown tag */
+	char header_buf_[FRAME_HEADER_SIZE];
+	size_t header_got_;
+	ocssd_frame_header reply_;
+	client_op *cur_;
+	size_t data_got_;
+};
+
+client_conn::client_conn(struct event_base *base, const struct sockaddr_in &addr)
+	: header_got_(0), cur_(NULL), data_got_(0)
+{
+	int one = 1;
+
+	fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd_ < 0) {
+		printf("%s: socket failed: %s\n", __func__, strerror(errno));
+		return;
+	}
+
+	setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* Requests queue up until the connection is made */
+	if (connect(fd_, (const struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+			errno != EINPROGRESS) {
+		printf("%s: connect failed: %s\n", __func__, strerror(errno));
+		close(fd_);
+		fd_ = -1;
+		return;
+	}
+
+	event_set(&ev_read_, fd_, EV_READ|EV_PERSIST, on_read, this);
+	event_base_set(base, &ev_read_);
+	event_add(&ev_read_, NULL);
+
+	event_set(&ev_write_, fd_, EV_WRITE, on_write, this);
+	event_base_set(base, &ev_write_);
+}
+
+client_conn::~client_conn()
+{
+	fail(ECANCELED);
+}
+
+void client_conn::on_read(int fd, short ev, void *arg)
+{
+	static_cast<client_conn *>(arg)->receive();
+}
+
+void client_conn::on_write(int fd, short ev, void *arg)
+{
+	static_cast<client_conn *>(arg)->send_queued();
+}
+
+void client_conn::submit(client_op *op)
+{
+	if (fd_ < 0) {
+		op->complete(ENOTCONN);
+		return;
+	}
+
+	backlog_.push_back(op);
+	send_queued();
+}
+
+/* Close the socket and fail every request on it */
+void client_conn::fail(int error)
+{
+	std::map<uint64_t, client_op *> inflight;
+	std::deque<client_op *> backlog;
+
+	if (fd_ >= 0) {
+		if (error != ECANCELED)
+			printf("%s: connection lost: %s\n", __func__, strerror(error));
+		event_del(&ev_read_);
+		event_del(&ev_write_);
+		close(fd_);
+		fd_ = -1;
+	}
+
+	/* The callbacks may submit again, which now fails right away */
+	inflight.swap(inflight_);
+	backlog.swap(backlog_);
+	sendq_.clear();
+	cur_ = NULL;
+
+	for (auto &it : inflight)
+		it.second->complete(error);
+	for (client_op *op : backlog)
+		op->complete(error);
+}
+
+void client_conn::send_queued()
+{
+	while (!backlog_.empty() && inflight_.size() < CLIENT_MAX_INFLIGHT) {
+		client_op *op = backlog_.front();
+
+		backlog_.pop_front();
+		inflight_[op->tag] = op;
+		sendq_.push_back(op);
+	}
+
+	while (fd_ >= 0 && !sendq_.empty()) {
+		struct iovec iov[CLIENT_SEND_IOVS];
+		struct msghdr msg;
+		int n = 0;
+
+		/* As much of the queue as fits, frames and payloads */
+		for (client_op *op : sendq_) {
+			size_t frame_len = op->frame.size();
+			size_t off = op->sent > frame_len ? op->sent - frame_len : 0;
+
+			if (n + 2 > CLIENT_SEND_IOVS)
+				break;
+
+			if (op->sent < frame_len) {
+				iov[n].iov_base = op->frame.data() + op->sent;
+				iov[n].iov_len = frame_len - op->sent;
+				n++;
+			}
+			if (off < op->payload_len) {
+				iov[n].iov_base = (void *)(op->payload + off);
+				iov[n].iov_len = op->payload_len - off;
+				n++;
+			}
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		ssize_t len = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				event_add(&ev_write_, NULL);
+				return;
+			}
+			fail(errno);
+			return;
+		}
+
+		while (len > 0) {
+			client_op *op = sendq_.front();
+			size_t left = op->frame.size() + op->payload_len - op->sent;
+			size_t step = std::min(left, (size_t)len);
+
+			op->sent += step;
+			len -= step;
+			if (step == left)
+				sendq_.pop_front();
+		}
+	}
+}
+
+void client_conn::receive()
+{
+	while (fd_ >= 0) {
+		char scratch[4096];
+		char *dst;
+		size_t want;
+
+		if (header_got_ < FRAME_HEADER_SIZE) {
+			dst = header_buf_ + header_got_;
+			want = FRAME_HEADER_SIZE - header_got_;
+		} else if (!cur_) {
+			/* A reply to a request we no longer know, skip it */
+			dst = scratch;
+			want = std::min(sizeof(scratch), reply_.get_data_len() - data_got_);
+		} else {
+			dst = (cur_->dest ? cur_->dest : cur_->data.data()) + data_got_;
+			want = reply_.get_data_len() - data_got_;
+		}
+
+		if (want > 0) {
+			ssize_t len = read(fd_, dst, want);
+
+			if (len == 0) {
+				fail(ECONNRESET);
+				return;
+			} else if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					fail(errno);
+				return;
+			}
+
+			if (header_got_ < FRAME_HEADER_SIZE) {
+				header_got_ += len;
+				if (header_got_ < FRAME_HEADER_SIZE)
+					continue;
+
+				try {
+					reply_ = ocssd_frame_header(header_buf_);
+				} catch (const std::runtime_error &e) {
+					fail(EPROTO);
+					return;
+				}
+
+				auto it = inflight_.find(reply_.get_tag());
+				cur_ = it == inflight_.end() ? NULL : it->second;
+				data_got_ = 0;
+
+				if (cur_ && !cur_->dest) {
+					cur_->data.resize(reply_.get_data_len());
+				} else if (cur_ && reply_.get_data_len() > cur_->dest_len) {
+					fail(EPROTO);
+					return;
+				}
+			} else {
+				data_got_ += len;
+			}
+
+			if (data_got_ < reply_.get_data_len())
+				continue;
+		}
+
+		/* The whole reply is in */
+		client_op *op = cur_;
+
+		header_got_ = 0;
+		cur_ = NULL;
+		if (op) {
+			inflight_.erase(op->tag);
+			op->received = data_got_;
+			op->complete(reply_.get_status());
+		}
+
+		send_queued();
+	}
+}
+
+/* A vSSD on one server, see ocssd_client */
+class ocssd_volume {
+public:
+	uint32_t get_id() const {return vssd_.get_id();}
+	size_t get_server() const {return server_;}
+	const virtual_ocssd & get_vssd() const {return vssd_;}
+
+	/* Buffers must stay valid until the request completes */
+	void read(uint32_t block, char *buf, size_t count, size_t offset,
+			ocssd_io_callback cb);
+	void write(uint32_t block, const char *buf, size_t count,
+			ocssd_io_callback cb);
+	void erase(uint32_t block, ocssd_io_callback cb);
+
+	std::future<int> read(uint32_t block, char *buf, size_t count, size_t offset);
+	std::future<int> write(uint32_t block, const char *buf, size_t count);
+	std::future<int> erase(uint32_t block);
+
+private:
+	friend class ocssd_client;
+
+	ocssd_volume(ocssd_client *client, size_t server)
+		: client_(client), server_(server) {}
+	ocssd_volume(const ocssd_volume &);
+	ocssd_volume & operator=(const ocssd_volume &);
+
+	void submit(uint32_t block, client_op *op, ocssd_io_callback cb);
+
+	ocssd_client *client_;
+	size_t server_;
+	virtual_ocssd vssd_;
+
+	/* Set up on the loop thread before the volume is handed out */
+	std::vector<client_conn *> conns_;
+};
+
+class ocssd_client {
+public:
+	ocssd_client(int conns_per_volume = CLIENT_CONNS_PER_VOLUME);
+	~ocssd_client();
+
+	/* Returns the index of the server, for attach(); the same one if known */
+	size_t add_server(const std::string &ip, uint16_t port = OCSSD_MESSAGE_PORT);
+
+	/* Try the servers in turn until one has the resources */
+	void alloc(const ocssd_alloc_request &request, ocssd_volume_callback cb);
+
+	/*
+	 * Try the nodes placement picks for the request, best first, adding
+	 * them as servers. May wait for placement to refresh its rows, so
+	 * not to be called from a callback.
+	 */
+	void alloc(const ocssd_alloc_request &request, ocssd_placement *placement,
+			ocssd_volume_callback cb);
+
+	/* A vSSD allocated earlier as remote, possibly by another client */
+	void attach(size_t server, uint32_t vssd_id, ocssd_volume_callback cb);
+
+	/*
+	 * Give the vSSD back to its server and close the volume, which
+	 * must not be used once this is called. Requests still in flight
+	 * fail with ECANCELED.
+	 */
+	void release(ocssd_volume *volume, ocssd_status_callback cb);
+
+	/* The volume is NULL on failure, see the log */
+	std::future<ocssd_volume *> alloc(const ocssd_alloc_request &request);
+	std::future<ocssd_volume *> alloc(const ocssd_alloc_request &request,
+			ocssd_placement *placement);
+	std::future<ocssd_volume *> attach(size_t server, uint32_t vssd_id);
+	std::future<int> release(ocssd_volume *volume);
+
+private:
+	friend class ocssd_volume;
+
+	ocssd_client(const ocssd_client &);
+	ocssd_client & operator=(const ocssd_client &);
+
+	uint64_t next_tag() {return next_tag_++;}
+
+	/* Run fn on the loop thread */
+	void post(std::function<void()> fn);
+	static void on_wake(int fd, short ev, void *arg);
+	void run_posted();
+
+	client_conn *new_conn(size_t server);
+	void delete_conn(client_conn *conn);
+	void alloc_on(std::vector<size_t> servers, size_t next,
+			ocssd_alloc_request request, ocssd_volume_callback cb);
+	void open_volume(size_t server, client_op *op, bool pool,
+			ocssd_volume_callback cb);
+	void attach_pool(ocssd_volume *volume, ocssd_volume_callback cb);
+	void close_volume(ocssd_volume *volume);
+
+	int conns_per_volume_;
+	std::atomic<uint64_t> next_tag_;
+
+	struct event_base *base_;
+	int efd_;
+	struct event ev_wake_;
+	std::thread thread_;
+
+	std::mutex mutex_;
+	std::deque<std::function<void()>> posted_;
+	std::vector<struct sockaddr_in> servers_;
+
+	/* Loop thread only */
+	std::set<client_conn *> conns_;
+	std::vector<ocssd_volume *> volumes_;
+};
+
+void ocssd_volume::submit(uint32_t block, client_op *op, ocssd_io_callback cb)
+{
+	op->done = [cb](int status, client_op *op) {
+		cb(status, op->received);
+	};
+
+	client_->post([this, block, op]() {
+		if (conns_.empty())
+			op->complete(ENOTCONN);
+		else
+			conns_[block % conns_.size()]->submit(op);
+	});
+}
+
+void ocssd_volume::read(uint32_t block, char *buf, size_t count, size_t offset,
+			ocssd_io_callback cb)
+{
+	client_op *op = new client_op(client_->next_tag());
+	ocssd_io_request request(READ_BLOCK_REQUEST, block, count, offset, op->tag);
+
+	op->set_frame(request);
+	op->dest = buf;
+	op->dest_len = count;
+	submit(block, op, cb);
+}
+
+void ocssd_volume::write(uint32_t block, const char *buf, size_t count,
+			ocssd_io_callback cb)
+{
+	client_op *op = new client_op(client_->next_tag());
+	ocssd_io_request request(WRITE_BLOCK_REQUEST, block, count, 0, op->tag);
+
+	op->set_frame(request);
+	op->payload = buf;
+	op->payload_len = count;
+	submit(block, op, cb);
+}
+
+void ocssd_volume::erase(uint32_t block, ocssd_io_callback cb)
+{
+	client_op *op = new client_op(client_->next_tag());
+	ocssd_io_request request(ERASE_BLOCK_REQUEST, block, 0, 0, op->tag);
+
+	op->set_frame(request);
+	submit(block, op, cb);
+}
+
+std::future<int> ocssd_volume::read(uint32_t block, char *buf, size_t count,
+				size_t offset)
+{
+	auto promise = std::make_shared<std::promise<int>>();
+	std::future<int> future = promise->get_future();
+
+	read(block, buf, count, offset, [promise](int status, size_t len) {
+		promise->set_value(status);
+	});
+	return future;
+}
+
+std::future<int> ocssd_volume::write(uint32_t block, const char *buf, size_t count)
+{
+	auto promise = std::make_shared<std::promise<int>>();
+	std::future<int> future = promise->get_future();
+
+	write(block, buf, count, [promise](int status, size_t len) {
+		promise->set_value(status);
+	});
+	return future;
+}
+
+std::future<int> ocssd_volume::erase(uint32_t block)
+{
+	auto promise = std::make_shared<std::promise<int>>();
+	std::future<int> future = promise->get_future();
+
+	erase(block, [promise](int status, size_t len) {
+		promise->set_value(status);
+	});
+	return future;
+}
+
+ocssd_client::ocssd_client(int conns_per_volume)
+	: conns_per_volume_(std::max(conns_per_volume, 1)), next_tag_(0)
+{
+	base_ = event_base_new();
+	if (!base_)
+		throw std::runtime_error("Error: event_base_new failed\n");
+
+	efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd_ < 0) {
+		event_base_free(base_);
+		throw std::runtime_error("Error: eventfd failed\n");
+	}
+
+	event_set(&ev_wake_, efd_, EV_READ|EV_PERSIST, on_wake, this);
+	event_base_set(base_, &ev_wake_);
+	event_add(&ev_wake_, NULL);
+
+	thread_ = std::thread([this]() {
+		event_base_dispatch(base_);
+	});
+}
+
+/* Requests still outstanding complete with ECANCELED */
+ocssd_client::~ocssd_client()
+{
+	post([this]() {
+		event_base_loopbreak(base_);
+	});
+	thread_.join();
+
+	/* Volumes go last, failed requests may still refer to them */
+	while (!conns_.empty()) {
+		client_conn *conn = *conns_.begin();
+
+		conns_.erase(conns_.begin());
+		delete conn;
+	}
+	for (ocssd_volume *volume : volumes_)
+		delete volume;
+
+	event_del(&ev_wake_);
+	close(efd_);
+	event_base_free(base_);
+}
+
+void ocssd_client::post(std::function<void()> fn)
+{
+	uint64_t one = 1;
+
+	{
+		MutexLock lock(&mutex_);
+		posted_.push_back(fn);
+	}
+
+	if (write(efd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		printf("%s: eventfd write failed: %s\n", __func__, strerror(errno));
+}
+
+void ocssd_client::on_wake(int fd, short ev, void *arg)
+{
+	static_cast<ocssd_client *>(arg)->run_posted();
+}
+
+void ocssd_client::run_posted()
+{
+	std::deque<std::function<void()>> posted;
+	uint64_t count;
+
+	if (read(efd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		printf("%s: eventfd read failed: %s\n", __func__, strerror(errno));
+
+	{
+		MutexLock lock(&mutex_);
+		posted.swap(posted_);
+	}
+
+	for (auto &fn : posted)
+		fn();
+}
+
+size_t ocssd_client::add_server(const std::string &ip, uint16_t port)
+{
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1)
+		throw std::runtime_error("Error: invalid server address\n");
+
+	MutexLock lock(&mutex_);
+	for (size_t i = 0; i < servers_.size(); i++) {
+		if (servers_[i].sin_addr.s_addr == addr.sin_addr.s_addr &&
+				servers_[i].sin_port == addr.sin_port)
+			return i;
+	}
+
+	servers_.push_back(addr);
+	return servers_.size() - 1;
+}
+
+client_conn *ocssd_client::new_conn(size_t server)
+{
+	struct sockaddr_in addr;
+
+	{
+		MutexLock lock(&mutex_);
+		addr = servers_[server];
+	}
+
+	client_conn *conn = new client_conn(base_, addr);
+	conns_.insert(conn);
+	return conn;
+}
+
+/* Free a connection from one of its own callbacks, on the next turn */
+void ocssd_client::delete_conn(client_conn *conn)
+{
+	post([this, conn]() {
+		conns_.erase(conn);
+		delete conn;
+	});
+}
+
+void ocssd_client::alloc(const ocssd_alloc_request &request, ocssd_volume_callback cb)
+{
+	post([this, request, cb]() {
+		std::vector<size_t> servers;
+
+		{
+			MutexLock lock(&mutex_);
+			for (size_t i = 0; i < servers_.size(); i++)
+				servers.push_back(i);
+		}
+
+		alloc_on(servers, 0, request, cb);
+	});
+}
+
+/* Two fallbacks past the best node, in case it filled up since it published */
+#define CLIENT_PLACEMENT_NODES 3
+
+void ocssd_client::alloc(const ocssd_alloc_request &request, ocssd_placement *placement,
+			ocssd_volume_callback cb)
+{
+	std::vector<std::string> nodes;
+	std::vector<size_t> servers;
+
+	placement->place(request, nodes, CLIENT_PLACEMENT_NODES);
+	for (const std::string &ip : nodes) {
+		try {
+			servers.push_back(add_server(ip));
+		} catch (const std::runtime_error &e) {
+			printf("%s: bad node address %s\n", __func__, ip.c_str());
+		}
+	}
+
+	/* Whatever failed, the rows that led here were out of date */
+	post([this, servers, request, placement, cb]() {
+		alloc_on(servers, 0, request,
+			[placement, cb](int status, ocssd_volume *volume) {
+				if (status)
+					placement->invalidate();
+				cb(status, volume);
+			});
+	});
+}
+
+void ocssd_client::alloc_on(std::vector<size_t> servers, size_t next,
+			ocssd_alloc_request request, ocssd_volume_callback cb)
+{
+	if (next >= servers.size()) {
+		cb(ENOSPC, NULL);
+		return;
+	}
+
+	size_t server = servers[next];
+	client_op *op = new client_op(next_tag());
+
+	request.set_tag(op->tag);
+	op->set_frame(request);
+
+	/* Move on to the next server if this one cannot take it */
+	open_volume(server, op, request.get_remote(),
+		[this, servers, next, request, cb](int status, ocssd_volume *volume) {
+			if (status)
+				alloc_on(servers, next + 1, request, cb);
+			else
+				cb(0, volume);
+		});
+}
+
+void ocssd_client::attach(size_t server, uint32_t vssd_id, ocssd_volume_callback cb)
+{
+	client_op *op = new client_op(next_tag());
+	ocssd_attach_request request(vssd_id, op->tag);
+
+	op->set_frame(request);
+	post([this, server, op, cb]() {
+		bool known;
+
+		{
+			MutexLock lock(&mutex_);
+			known = server < servers_.size();
+		}
+
+		if (known) {
+			open_volume(server, op, true, cb);
+		} else {
+			delete op;
+			cb(EINVAL, NULL);
+		}
+	});
+}
+
+/*
+ * Send an alloc or attach request on a new connection, which becomes
+ * the first of the volume's. The rest of the pool is attached after.
+ */
+void ocssd_client::open_volume(size_t server, client_op *op, bool pool,
+			ocssd_volume_callback cb)
+{
+	client_conn *conn = new_conn(server);
+
+	op->done = [this, server, conn, pool, cb](int status, client_op *op) {
+		ocssd_volume *volume = NULL;
+
+		if (!status) {
+			volume = new ocssd_volume(this, server);
+			if (!volume->vssd_.deserialize(op->data.data(), op->data.size()))
+				status = EPROTO;
+		}
+
+		if (status) {
+			delete volume;
+			delete_conn(conn);
+			cb(status, NULL);
+			return;
+		}
+
+		volume->conns_.push_back(conn);
+		volumes_.push_back(volume);
+
+		if (pool)
+			attach_pool(volume, cb);
+		else
+			cb(0, volume);
+	};
+
+	conn->submit(op);
+}
+
+void ocssd_client::attach_pool(ocssd_volume *volume, ocssd_volume_callback cb)
+{
+	int extra = conns_per_volume_ - 1;
+
+	if (extra == 0) {
+		cb(0, volume);
+		return;
+	}
+
+	/* Keep the connections in order, so blocks map the same way every time */
+	auto attached = std::make_shared<std::vector<client_conn *>>(extra, (client_conn *)NULL);
+	auto left = std::make_shared<int>(extra);
+
+	for (int i = 0; i < extra; i++) {
+		client_conn *conn = new_conn(volume->server_);
+		client_op *op = new client_op(next_tag());
+		ocssd_attach_request request(volume->get_id(), op->tag);
+
+		op->set_frame(request);
+		op->done = [this, volume, conn, attached, left, i, cb](int status,
+								client_op *op) {
+			if (status)
+				delete_conn(conn);
+			else
+				(*attached)[i] = conn;
+
+			if (--*left)
+				return;
+
+			for (client_conn *pooled : *attached) {
+				if (pooled)
+					volume->conns_.push_back(pooled);
+			}
+			cb(0, volume);
+		};
+
+		conn->submit(op);
+	}
+}
+
+void ocssd_client::release(ocssd_volume *volume, ocssd_status_callback cb)
+{
+	client_op *op = new client_op(next_tag());
+	ocssd_release_request request(volume->get_id(), op->tag);
+
+	op->set_frame(request);
+
+	/*
+	 * The server replies once nothing holds the vSSD, the volume's
+	 * connections included, so they are closed first and the request
+	 * goes on a connection of its own.
+	 */
+	post([this, volume, op, cb]() {
+		client_conn *conn = new_conn(volume->server_);
+
+		op->done = [this, conn, cb](int status, client_op *op) {
+			delete_conn(conn);
+			cb(status);
+		};
+
+		close_volume(volume);
+		conn->submit(op);
+	});
+}
+
+/* Loop thread only. The reply may be read by one of these connections,
+ * so they and the volume go away on a later turn of the loop */
+void ocssd_client::close_volume(ocssd_volume *volume)
+{
+	for (client_conn *conn : volume->conns_)
+		delete_conn(conn);
+	volume->conns_.clear();
+
+	volumes_.erase(std::remove(volumes_.begin(), volumes_.end(), volume),
+			volumes_.end());
+	post([volume]() {
+		delete volume;
+	});
+}
+
+std::future<ocssd_volume *> ocssd_client::alloc(const ocssd_alloc_request &request)
+{
+	auto promise = std::make_shared<std::promise<ocssd_volume *>>();
+	std::future<ocssd_volume *> future = promise->get_future();
+
+	alloc(request, [promise](int status, ocssd_volume *volume) {
+		promise->set_value(volume);
+	});
+	return future;
+}
+
+std::future<ocssd_volume *> ocssd_client::alloc(const ocssd_alloc_request &request,
+			ocssd_placement *placement)
+{
+	auto promise = std::make_shared<std::promise<ocssd_volume *>>();
+	std::future<ocssd_volume *> future = promise->get_future();
+
+	alloc(request, placement, [promise](int status, ocssd_volume *volume) {
+		promise->set_value(volume);
+	});
+	return future;
+}
+
+std::future<ocssd_volume *> ocssd_client::attach(size_t server, uint32_t vssd_id)
+{
+	auto promise = std::make_shared<std::promise<ocssd_volume *>>();
+	std::future<ocssd_volume *> future = promise->get_future();
+
+	attach(server, vssd_id, [promise](int status, ocssd_volume *volume) {
+		promise->set_value(volume);
+	});
+	return future;
+}
+
+std::future<int> ocssd_client::release(ocssd_volume *volume)
+{
+	auto promise = std::make_shared<std::promise<int>>();
+	std::future<int> future = promise->get_future();
+
+	release(volume, [promise](int status) {
+		promise->set_value(status);
+	});
+	return future;
+}
+
+#endif
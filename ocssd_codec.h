@@ -0,0 +1,164 @@
+#ifndef OCSSD_CODEC_H
+#define OCSSD_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+#include <type_traits>
+
+/*
+ * Encoding of the wire messages and journal records: integers of fixed
+ * width, little endian whatever the host, at any alignment.
+ *
+ * The size of a fixed message is computed from its field types at
+ * compile time with wire_size<>, so it cannot drift from the encoder,
+ * and is checked there against the size its format documents.
+ *
+ * Messages of variable size go through an ocssd_writer and come back
+ * through an ocssd_reader, which check every field against the end of
+ * the buffer. Past it the writer stores nothing more and the reader
+ * returns zeros, and both remember it, so a message is checked once,
+ * after its last field. A writer without a buffer only counts, which
+ * sizes the buffer for the real encoding.
+ */
+
+template <typename... Fields>
+struct wire_size;
+
+template <>
+struct wire_size<> {
+	static constexpr size_t value = 0;
+};
+
+template <typename T, typename... Rest>
+struct wire_size<T, Rest...> {
+	static_assert(std::is_integral<T>::value, "wire fields are integers");
+	static constexpr size_t value = sizeof(T) + wire_size<Rest...>::value;
+};
+
+static inline uint8_t wire_swap(uint8_t v) {return v;}
+static inline uint16_t wire_swap(uint16_t v) {return __builtin_bswap16(v);}
+static inline uint32_t wire_swap(uint32_t v) {return __builtin_bswap32(v);}
+static inline uint64_t wire_swap(uint64_t v) {return __builtin_bswap64(v);}
+
+/* Little endian and host order are the same, the swaps compile away */
+template <typename T>
+static inline typename std::make_unsigned<T>::type wire_order(T value)
+{
+	typedef typename std::make_unsigned<T>::type U;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return wire_swap((U)value);
+#else
+	return (U)value;
+#endif
+}
+
+/* p has room for sizeof(T) bytes */
+template <typename T>
+static inline void wire_put(char *p, T value)
+{
+	auto v = wire_order(value);
+
+	memcpy(p, &v, sizeof(v));
+}
+
+template <typename T>
+static inline T wire_get(const char *p)
+{
+	typename std::make_unsigned<T>::type v;
+
+	memcpy(&v, p, sizeof(v));
+	return (T)wire_order(v);
+}
+
+class ocssd_writer {
+public:
+	/* Counts the bytes a message takes, stores nothing */
+	ocssd_writer() : buf_(NULL), size_(SIZE_MAX), len_(0), ok_(true) {}
+
+	ocssd_writer(char *buffer, size_t size)
+		: buf_(buffer), size_(size), len_(0), ok_(true) {}
+
+	template <typename T>
+	void put(T value) {
+		if (!reserve(sizeof(T)))
+			return;
+		if (buf_)
+			wire_put(buf_ + len_, value);
+		len_ += sizeof(T);
+	}
+
+	void put_bytes(const void *data, size_t len) {
+		if (!reserve(len))
+			return;
+		if (buf_)
+			memcpy(buf_ + len_, data, len);
+		len_ += len;
+	}
+
+	void put_zeros(size_t len) {
+		if (!reserve(len))
+			return;
+		if (buf_)
+			memset(buf_ + len_, 0, len);
+		len_ += len;
+	}
+
+	/* Nothing was cut off */
+	bool ok() const {return ok_;}
+	size_t length() const {return len_;}
+
+private:
+	bool reserve(size_t len) {
+		if (ok_ && size_ - len_ < len)
+			ok_ = false;
+		return ok_;
+	}
+
+	char *buf_;
+	size_t size_;
+	size_t len_;
+	bool ok_;
+};
+
+class ocssd_reader {
+public:
+	ocssd_reader(const char *buffer, size_t size)
+		: buf_(buffer), size_(size), len_(0), ok_(true) {}
+
+	template <typename T>
+	T get() {
+		if (!consume(sizeof(T)))
+			return 0;
+		return wire_get<T>(buf_ + len_ - sizeof(T));
+	}
+
+	/* The next len bytes, NULL if there are not that many */
+	const char *get_bytes(size_t len) {
+		if (!consume(len))
+			return NULL;
+		return buf_ + len_ - len;
+	}
+
+	/* Nothing was read past the end */
+	bool ok() const {return ok_;}
+	size_t length() const {return len_;}
+	size_t remaining() const {return size_ - len_;}
+
+private:
+	bool consume(size_t len) {
+		if (ok_ && size_ - len_ < len)
+			ok_ = false;
+		if (ok_)
+			len_ += len;
+		return ok_;
+	}
+
+	const char *buf_;
+	size_t size_;
+	size_t len_;
+	bool ok_;
+};
+
+#endif
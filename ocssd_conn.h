@@ -2,39 +2,181 @@
 #define OCSSD_CONN_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <cstdio>
 #include <iostream>
 #include <string>
 #include <deque>
+#include <map>
 #include <exception>
 
-#include "azure_config.h"
 #include "ocssd_server.h"
+#include "ocssd_io_engine.h"
+#include "ocssd_buffer_pool.h"
+#include "ocssd_stats.h"
+#include "ocssd_publisher.h"
+#include "ocssd_staging.h"
 
-#define VSSD_BUFFER_SIZE 1024
 #define DATA_BUFFER_SIZE (16 * 1024 * 1024)
 
+/* Pooled read buffers, per reactor */
+#define POOL_CHUNK_SIZE (1024 * 1024)
+#define POOL_NUM_CHUNKS 64
+
+/* Smaller replies are cheaper to copy than to pin */
+#define ZEROCOPY_MIN_SIZE (16 * 1024)
+
+/* Write chunks programmed at once per connection before we stop reading */
+#define MAX_WRITE_CHUNKS 4
+
+/* How much of its rate a vSSD may use in one burst */
+#define QOS_BURST_MS 50
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
 /**
  * In event based programming we need to queue up data to be written
  * until we are told by libevent that we can write.
+ *
+ * A buffer is either one malloc'd buf, or a small malloc'd buf for the
+ * frame header followed by device buffers borrowed from a pool. Pooled
+ * chunks go back to the pool when the buffer is freed, which for a
+ * zero-copy send is only once the kernel is done with them.
  */
 struct bufferq {
-	bufferq(size_t size) : len(size), offset(0) {
+	bufferq(size_t size) : len(size), offset(0), head_len(size),
+		pool(NULL), zc_used(false), zc_seq(0) {
 		buf = (char *)malloc(size);
 	}
 
-	~bufferq() {free(buf);}
+	/* Header of head_len bytes plus count bytes of pooled chunks */
+	bufferq(ocssd_buffer_pool *pool, size_t head_len, size_t count)
+		: len(head_len + count), offset(0), head_len(head_len),
+		pool(pool), zc_used(false), zc_seq(0) {
+		size_t chunk_size = pool->get_chunk_size();
+
+		buf = (char *)malloc(head_len);
+		for (size_t done = 0; done < count; done += chunk_size) {
+			struct iovec chunk;
+
+			chunk.iov_base = pool->get();
+			chunk.iov_len = std::min(chunk_size, count - done);
+			if (!chunk.iov_base)
+				break;
+			chunks.push_back(chunk);
+		}
+	}
+
+	~bufferq() {
+		free(buf);
+		for (struct iovec &chunk : chunks)
+			pool->put((char *)chunk.iov_base);
+	}
+
+	/* False if the pool ran out while building a pooled buffer */
+	bool pooled_ok() const {
+		size_t count = 0;
+
+		for (const struct iovec &chunk : chunks)
+			count += chunk.iov_len;
+		return head_len + count == len;
+	}
+
+	/* The data of a header-less buffer, filled in one piece */
+	char *data() const {
+		return chunks.empty() ? buf : (char *)chunks[0].iov_base;
+	}
+
+	/* Describe count data bytes starting at off, past the header */
+	void slice(size_t off, size_t count, std::vector<struct iovec> &iov) const {
+		if (chunks.empty()) {
+			struct iovec seg = {buf + head_len + off, count};
+
+			iov.push_back(seg);
+			return;
+		}
+
+		for (const struct iovec &chunk : chunks) {
+			if (count == 0)
+				break;
+			if (off >= chunk.iov_len) {
+				off -= chunk.iov_len;
+				continue;
+			}
+
+			struct iovec seg = {(char *)chunk.iov_base + off,
+					std::min(chunk.iov_len - off, count)};
+			iov.push_back(seg);
+			count -= seg.iov_len;
+			off = 0;
+		}
+	}
+
+	/* Describe the unsent bytes, returns the number of iovecs used */
+	int fill_iov(struct iovec *iov, int max) const {
+		size_t skip = offset;
+		size_t left = len - offset;
+		int cnt = 0;
+
+		if (skip < head_len) {
+			iov[cnt].iov_base = buf + skip;
+			iov[cnt].iov_len = std::min(head_len - skip, left);
+			left -= iov[cnt].iov_len;
+			skip = 0;
+			cnt++;
+		} else {
+			skip -= head_len;
+		}
+
+		for (const struct iovec &chunk : chunks) {
+			if (left == 0 || cnt == max)
+				break;
+			if (skip >= chunk.iov_len) {
+				skip -= chunk.iov_len;
+				continue;
+			}
+
+			iov[cnt].iov_base = (char *)chunk.iov_base + skip;
+			iov[cnt].iov_len = std::min(chunk.iov_len - skip, left);
+			left -= iov[cnt].iov_len;
+			skip = 0;
+			cnt++;
+		}
+
+		return cnt;
+	}
 
 	/* The buffer. */
 	char *buf;
 
-	/* The length of buf. */
+	/* The length on the wire. */
 	size_t len;
 
-	/* The offset into buf to start writing from. */
+	/* The offset into the wire bytes to start writing from. */
 	size_t offset;
+
+	/* The wire bytes held in buf, the rest are in chunks. */
+	size_t head_len;
+
+	ocssd_buffer_pool *pool;
+	std::vector<struct iovec> chunks;
+
+	/* Last zero-copy send that referenced this buffer */
+	bool zc_used;
+	uint32_t zc_seq;
 };
 
 enum conn_state {
@@ -42,19 +184,224 @@ enum conn_state {
 	RECEIVING_WRITE_DATA,
 };
 
-class ocssd_conn {
+enum vblk_state {
+	VBLK_TESTING = 0,
+	VBLK_READY,
+	VBLK_BAD,
+	VBLK_CHECKING,		/* Restored, write pointer not read back yet */
+	VBLK_UNERASED,		/* May still hold the last tenant's data */
+};
+
+/* Bad block table of each (channel, LUN), fetched once per allocation */
+typedef std::map<std::pair<uint32_t, uint32_t>, std::vector<uint8_t>> bbt_cache;
+
+/* A device under a remote vSSD, one per unit */
+struct vssd_device {
+	std::string name;
+	struct nvm_dev *dev;
+	const struct nvm_geo *geo;
+	size_t write_unit;	/* Bytes a program takes a multiple of */
+	bbt_cache bbts;		/* Only while the vblks are built */
+};
+
+/*
+ * Admits rate units per second, in bursts of up to QOS_BURST_MS worth.
+ * A request is let in whenever the bucket is not empty and may leave it
+ * in debt, so a request larger than the burst is delayed, not refused.
+ */
+class token_bucket {
 public:
-	ocssd_conn(ocssd_manager *manager, int connfd,
+	token_bucket() : rate_(0), burst_(0), tokens_(0), last_ns_(0) {}
+
+	/* 0 is unlimited */
+	void set_rate(uint64_t rate) {
+		rate_ = rate;
+		burst_ = std::max(1.0, rate * QOS_BURST_MS / 1000.0);
+		tokens_ = burst_;
+		last_ns_ = stats_now_ns();
+	}
+
+	/* Nanoseconds until the next request may go, 0 if it may now */
+	uint64_t wait_ns(uint64_t now) {
+		if (!rate_)
+			return 0;
+
+		tokens_ = std::min(burst_, tokens_ + (now - last_ns_) * rate_ / 1e9);
+		last_ns_ = now;
+		return tokens_ > 0 ? 0 : (uint64_t)(-tokens_ * 1e9 / rate_) + 1;
+	}
+
+	void consume(uint64_t amount) {
+		if (rate_)
+			tokens_ -= amount;
+	}
+
+private:
+	uint64_t rate_;
+	double burst_;
+	double tokens_;
+	uint64_t last_ns_;
+};
+
+/*
+ * The vblks of a remote vSSD. There is one set per vSSD, shared by all
+ * the connections using it, so a vblk has one target, one state and
+ * one write pointer however many clients attach. The first connection
+ * builds it and the last one frees it, see ocssd_manager::share_blocks().
+ * Once built, the states, write pointers, staged tails and QoS buckets
+ * change only under mutex; the rest stays as it is.
+ *
+ * A write chunk moves write_pos and write_stages on when it is
+ * submitted, so the next chunk knows where it goes and which tail it
+ * starts with. pos and stages, what readers see, only move once the
+ * program is done, and a failed program puts the write_ ones back to
+ * them.
+ */
+struct ocssd_vssd_blocks {
+	ocssd_vssd_blocks() : built(false), blk_size(0), testing(0) {}
+
+	~ocssd_vssd_blocks() {
+		clear();
+	}
+
+	/* Back to unbuilt, the devices closed */
+	void clear() {
+		for (ocssd_io_target *blk : blks)
+			delete blk;
+		for (vssd_device &device : devs)
+			nvm_dev_close(device.dev);
+
+		devs.clear();
+		blk_devs.clear();
+		blks.clear();
+		states.clear();
+		pos.clear();
+		stages.clear();
+		write_pos.clear();
+		write_stages.clear();
+		testing = 0;
+		built = false;
+	}
+
+	std::mutex mutex;
+	bool built;
+	std::vector<vssd_device> devs;
+	std::vector<uint16_t> blk_devs;		/* Index in devs of each vblk */
+
+	size_t blk_size;
+	std::vector<ocssd_io_target *> blks;	/* Real blocks, NULL if bad */
+	std::vector<vblk_state> states;
+	std::vector<uint64_t> pos;		/* Write pointers, journaled */
+	std::vector<std::string> stages;	/* Staged tails, at pos */
+	std::vector<uint64_t> write_pos;	/* Where the next chunk goes */
+	std::vector<std::string> write_stages;	/* Staged tails, at write_pos */
+	size_t testing;				/* Tests and checks not done */
+
+	/* The limits are per vSSD, whichever connections its requests use */
+	token_bucket iops_bucket;
+	token_bucket bw_bucket;
+};
+
+/*
+ * A write whose payload is still arriving or being programmed. The
+ * payload is cut into chunks of whole device write units, and every
+ * chunk goes to flash as soon as it is full. What is left of the last
+ * chunk past its last full unit is staged, see ocssd_staging.h. A
+ * vectored write has one extent per vblk, their payloads follow each
+ * other on the wire. An erase with staging on waits as one, with no
+ * extents, for the empty stage record that drops the old tails.
+ */
+struct write_extent {
+	uint32_t block_index;
+	ocssd_io_target *target;
+
+	/* Payload bytes not received yet */
+	size_t left;
+};
+
+struct write_request {
+	write_request(REQUEST_CODE opcode, uint64_t tag, uint64_t start_ns)
+		: opcode(opcode), tag(tag), start_ns(start_ns), cur(0), left(0),
+		total(0), inflight(0), status(0) {}
+
+	void add(uint32_t block_index, ocssd_io_target *target, size_t count) {
+		write_extent extent = {block_index, target, count};
+
+		extents.push_back(extent);
+		left += count;
+		total += count;
+	}
+
+	REQUEST_CODE opcode;
+	uint64_t tag;
+	uint64_t start_ns;
+
+	std::vector<write_extent> extents;
+	size_t cur;
+
+	/* Payload bytes not received yet, in total */
+	size_t left;
+	size_t total;
+
+	/* Chunks submitted and not completed yet */
+	int inflight;
+
+	/* First error, reported in the reply */
+	int status;
+};
+
+/* A vectored read, replied to once all of its extents are read */
+struct read_request {
+	read_request(uint64_t tag, uint64_t start_ns, bufferq *reply)
+		: tag(tag), start_ns(start_ns), reply(reply), inflight(0), status(0) {}
+
+	uint64_t tag;
+	uint64_t start_ns;
+	bufferq *reply;
+	int inflight;
+	int status;
+};
+
+class ocssd_conn : public ocssd_io_handler {
+public:
+	ocssd_conn(ocssd_manager *manager, ocssd_io_engine *engine,
+			ocssd_io_port *port, ocssd_buffer_pool *pool,
+			ocssd_stats *stats, ocssd_publisher *publisher,
+			ocssd_stage_log *stage, int connfd,
 			const struct sockaddr_in &client);
 	~ocssd_conn();
 
 	int process_incoming_requests(int fd);
+	void io_complete(ocssd_io *io);
+
+	/* Drop the connection, it is freed once no device I/O is in flight */
+	void release();
+
+	/* The QoS delay is over, see qos_throttle() */
+	void resume_throttled() {
+		event_add(&ev_read, NULL);
+	}
+
+	/* Zero-copy send bookkeeping, see on_write() */
+	bool use_zerocopy(const bufferq *bufferq) const {
+		return zc_enabled_ && bufferq->pool &&
+			bufferq->len >= ZEROCOPY_MIN_SIZE;
+	}
+	void zerocopy_sent(bufferq *bufferq) {
+		bufferq->zc_used = true;
+		bufferq->zc_seq = zc_next_seq_++;
+	}
+	void retire(bufferq *bufferq);
+	void reap_zerocopy();
 
 	/* Events. We need 2 event structures, one for read event
 	 * notification and the other for writing. */
 	struct event ev_read;
 	struct event ev_write;
 
+	/* Timer to resume reading after a QoS delay */
+	struct event ev_throttle;
+
 	/* This is the queue of data to be written to this client. As
 	 * we can't call write(2) until libevent tells us the socket
 	 * is ready for writing. */
@@ -66,41 +413,149 @@ private:
 
 	int process_command(int fd);
 	int process_write_data(int fd);
+	void submit_write_chunk(const write_extent &extent);
+	void submit_stage_record(size_t idx, write_request *req);
+	void complete_write_chunk(ocssd_io *io);
+	void commit_write_chunk(ocssd_io *io);
+	void finish_write_chunk(ocssd_io *io);
+	void complete_vector_read(ocssd_io *io);
+	void finish_vector_read(read_request *req);
+	size_t read_staged(size_t idx, size_t offset, size_t count,
+		bufferq *bufferq, size_t buf_off);
+	int disconnect(const char *reason);
+	void queue_reply(bufferq *bufferq);
+	int send_status(REQUEST_CODE opcode, uint64_t tag, int status);
+	int submit_io(ocssd_io *io);
+	int submit_stage_io(ocssd_io *io);
+	void account(STATS_OP op, uint64_t start_ns, size_t bytes, int status);
+	void request_cost(uint64_t &ops, uint64_t &bytes);
+	bool qos_throttle();
 
 	int process_alloc_request(int fd);
+	int process_attach_request(int fd);
+	int process_release_request(int fd);
 	int process_read_request(int fd);
 	int process_write_request(int fd);
 	int process_erase_request(int fd);
-	int publish_resource();
-	int initialize_remote_vssd(virtual_ocssd *vssd);
-	int initialize_vssd_blocks(const virtual_ocssd_unit * vunit);
-	struct nvm_vblk *GetBlockPointer(size_t blk_idx) {return blks_array_[blk_idx];}
+	int process_readv_request(int fd);
+	int process_writev_request(int fd);
+	int initialize_remote_vssd(virtual_ocssd *vssd, uint32_t init_mode);
+	int hold_remote_vssd(virtual_ocssd *vssd, uint32_t init_mode);
+	void drop_remote_vssd();
+	int initialize_vssd_blocks(const virtual_ocssd *vssd, uint32_t init_mode);
+	void generate_vblks(const virtual_ocssd_unit *vunit, const struct nvm_geo *geo,
+		std::vector<std::vector<struct nvm_addr>> &vblks);
+	bool bbt_has_bad(const std::vector<struct nvm_addr> &addrs, vssd_device &device);
+	void complete_block_test(ocssd_io *io);
+	void record_blocks(size_t first, size_t count);
+	int send_vssd(REQUEST_CODE opcode, uint64_t tag, virtual_ocssd *vssd);
+
+	/* NULL unless the block exists and is ready, see check_block() */
+	ocssd_io_target *GetBlockPointer(size_t blk_idx) {
+		return check_block(blk_idx) ? NULL : blocks_->blks[blk_idx];
+	}
+
+	/* A read that runs past what was written, staged tail included */
+	bool past_stage(size_t blk_idx, size_t offset, size_t count) {
+		MutexLock lock(&blocks_->mutex);
+
+		return offset + count > blocks_->pos[blk_idx] +
+			blocks_->stages[blk_idx].size();
+	}
+
+	/* The status to reply with for I/O to a block */
+	int check_block(size_t blk_idx) {
+		if (!blocks_ || blk_idx >= blocks_->blks.size())
+			return EINVAL;
+
+		MutexLock lock(&blocks_->mutex);
+		switch (blocks_->states[blk_idx]) {
+		case VBLK_READY:
+		case VBLK_UNERASED:
+			return 0;
+		case VBLK_TESTING:
+		case VBLK_CHECKING:
+			return EAGAIN;
+		default:
+			return EIO;
+		}
+	}
 
 	ocssd_manager *manager;
+	ocssd_io_engine *engine_;
+	ocssd_io_port *port_;
+	ocssd_buffer_pool *pool_;
+	ocssd_stats *stats_;
+	ocssd_op_stats *vssd_stats_;
+	ocssd_publisher *publisher_;
+	ocssd_stage_log *stage_;	/* NULL if writes are not staged */
 	std::mutex mutex_;
 	int connfd_;
 	std::string ipaddr_;
 	int message_start_;
 	int message_end_;
 	char message_buf_[MESSAGE_BUFFER_SIZE];
+	ocssd_frame_header header_;
+	uint64_t cmd_start_;	/* When header_ came in */
 	conn_state state;
 
+	/* Set when the socket has no more to give us for now */
+	bool would_block_;
+
+	/* Streaming write state, see process_write_data() */
+	write_request *write_req_;
+	bufferq *write_chunk_;
+	size_t write_fill_;
+	size_t write_chunk_size_;
+	int write_chunks_;
+	bool read_paused_;
+
+	/*
+	 * Chunks being programmed, per vblk, in the order they go to flash.
+	 * Completions can come back out of that order, a chunk is only
+	 * committed once those ahead of it are.
+	 */
+	std::map<uint32_t, std::deque<std::pair<ocssd_io *, bool> > > programs_;
+
+	/* Device I/Os submitted but not yet completed */
+	int inflight_;
+	bool closing_;
+
+	/* Sent buffers the kernel may still be reading from */
+	bool zc_enabled_;
+	uint32_t zc_next_seq_;
+	uint32_t zc_done_;
+	std::deque<bufferq *> zc_pending_;
+
 	/* Keep a virtual ssd here for remote access */
 	int remote_vssd_;
-	struct nvm_dev *dev_;
-	const struct nvm_geo *geo_;
+	std::shared_ptr<ocssd_vssd_blocks> blocks_;
+	uint32_t vssd_id_;
 
-	size_t num_blks_;
-	size_t blk_size_;
-	std::vector<struct nvm_vblk *> blks_array_;		/* Real blocks */
+	/* Limits of the attached vSSD, metered in blocks_ */
+	ocssd_qos qos_;
 };
 
-ocssd_conn::ocssd_conn(ocssd_manager *manager, int connfd,
+ocssd_conn::ocssd_conn(ocssd_manager *manager, ocssd_io_engine *engine,
+			ocssd_io_port *port, ocssd_buffer_pool *pool,
+			ocssd_stats *stats, ocssd_publisher *publisher,
+			ocssd_stage_log *stage, int connfd,
 			const struct sockaddr_in &client)
-	: manager(manager), connfd_(connfd), ipaddr_(inet_ntoa(client.sin_addr)),
-	message_start_(0), message_end_(0), state(RECEIVING_COMMAND),
-	remote_vssd_(0), dev_(NULL)
+	: manager(manager), engine_(engine), port_(port), pool_(pool),
+	stats_(stats), vssd_stats_(NULL), publisher_(publisher), stage_(stage),
+	connfd_(connfd), ipaddr_(inet_ntoa(client.sin_addr)),
+	message_start_(0), message_end_(0), cmd_start_(0), state(RECEIVING_COMMAND),
+	would_block_(false), write_req_(NULL), write_chunk_(NULL), write_fill_(0),
+	write_chunk_size_(POOL_CHUNK_SIZE), write_chunks_(0), read_paused_(false),
+	inflight_(0), closing_(false), zc_enabled_(false), zc_next_seq_(0),
+	zc_done_(0), remote_vssd_(0), vssd_id_(0)
 {
+	int one = 1;
+
+	/* Older kernels lack MSG_ZEROCOPY, replies are then copied */
+	if (setsockopt(connfd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+		zc_enabled_ = true;
+
 	std::cout << "New connection: conn " << connfd_
 		<< ", IP addr " << ipaddr_ << std::endl;
 }
@@ -108,109 +563,626 @@ ocssd_conn::ocssd_conn(ocssd_manager *manager, int connfd,
 ocssd_conn::~ocssd_conn()
 {
 	printf("%s\n", __func__);
-	if (remote_vssd_) {
-		nvm_dev_close(dev_);
-		for (auto &vblk : blks_array_)
-			nvm_vblk_free(vblk);
+	event_del(&ev_write);
+	for (bufferq *bufferq : writeq)
+		delete bufferq;
+
+	/* The socket is closed, any data still queued in it is lost */
+	for (bufferq *bufferq : zc_pending_)
+		delete bufferq;
+
+	delete write_chunk_;
+	delete write_req_;
+
+	if (remote_vssd_)
+		drop_remote_vssd();
+}
+
+/* A buffer has been fully sent */
+void ocssd_conn::retire(bufferq *bufferq)
+{
+	if (bufferq->zc_used)
+		zc_pending_.push_back(bufferq);
+	else
+		delete bufferq;
+}
+
+/*
+ * Drain zero-copy notifications from the socket error queue. Each
+ * notification covers a range of send calls; TCP completes them in
+ * order, so everything up to the end of the range can be freed.
+ */
+void ocssd_conn::reap_zerocopy()
+{
+	char control[128];
+	struct msghdr msg;
+
+	if (zc_next_seq_ == zc_done_ || connfd_ < 0)
+		return;
+
+	while (true) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(connfd_, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct sock_extended_err *serr;
+
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+			      (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+				continue;
+
+			/* ee_data is the last send of the range */
+			zc_done_ = serr->ee_data + 1;
+		}
 	}
+
+	while (!zc_pending_.empty() &&
+			(int32_t)(zc_pending_.front()->zc_seq - zc_done_) < 0) {
+		delete zc_pending_.front();
+		zc_pending_.pop_front();
+	}
+}
+
+void ocssd_conn::release()
+{
+	if (connfd_ >= 0)
+		disconnect("");
+
+	closing_ = true;
+	if (inflight_ == 0)
+		delete this;
 }
 
+/*
+ * Receive the payload of the current write into a chunk and submit the
+ * chunk as soon as it holds a full write unit stripe, so the network
+ * receive overlaps with programming. At most MAX_WRITE_CHUNKS chunks
+ * are programmed at a time; beyond that we stop reading the socket
+ * until one completes, which bounds the memory held per connection.
+ */
 int ocssd_conn::process_write_data(int fd)
 {
+	write_request *req = write_req_;
+
+	while (req->left > 0) {
+		/* Extents that are fully received, or empty */
+		while (req->extents[req->cur].left == 0)
+			req->cur++;
+
+		if (!write_chunk_) {
+			const write_extent &extent = req->extents[req->cur];
+			std::string staged;
+
+			if (write_chunks_ >= MAX_WRITE_CHUNKS) {
+				event_del(&ev_read);
+				read_paused_ = true;
+				would_block_ = true;
+				return 0;
+			}
+
+			/*
+			 * The staged tail goes to flash ahead of the new data.
+			 * Readers keep it until the chunk is programmed.
+			 */
+			if (stage_ && extent.target && !req->status) {
+				MutexLock lock(&blocks_->mutex);
+
+				staged = blocks_->write_stages[extent.block_index];
+			}
+
+			size_t size = std::min(write_chunk_size_, staged.size() + extent.left);
+
+			/* A chunk is filled in one piece, so one pool chunk at most */
+			if (size <= pool_->get_chunk_size())
+				write_chunk_ = new bufferq(pool_, 0, size);
+			if (!write_chunk_ || !write_chunk_->pooled_ok()) {
+				delete write_chunk_;
+				write_chunk_ = new bufferq(size);
+			}
+
+			write_fill_ = staged.size();
+			if (!staged.empty())
+				memcpy(write_chunk_->data(), staged.data(), staged.size());
+		}
+
+		int len = read(fd, write_chunk_->data() + write_fill_,
+				write_chunk_->len - write_fill_);
+
+		if (len == 0) {
+			return disconnect("Client disconnected.\n");
+		} else if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				would_block_ = true;
+				return 0;
+			}
+			printf("Socket failure, disconnecting client: %s\n",
+			    strerror(errno));
+			return disconnect("");
+		}
+
+		write_fill_ += len;
+		req->left -= len;
+		req->extents[req->cur].left -= len;
+
+		if (write_fill_ == write_chunk_->len)
+			submit_write_chunk(req->extents[req->cur]);
+	}
+
+	/* All received, the reply goes out with the last chunk */
+	state = RECEIVING_COMMAND;
+	write_req_ = NULL;
+	if (req->inflight == 0) {
+		account(STATS_WRITE, req->start_ns, req->total, req->status);
+		send_status(req->opcode, req->tag, req->status);
+		delete req;
+	}
+
 	return 0;
 }
 
+void ocssd_conn::submit_write_chunk(const write_extent &extent)
+{
+	write_request *req = write_req_;
+	bufferq *chunk = write_chunk_;
+
+	write_chunk_ = NULL;
+
+	/* After an error the rest of the payload is only drained */
+	if (!extent.target || req->status) {
+		delete chunk;
+		return;
+	}
+
+	size_t idx = extent.block_index;
+	char *data = chunk->data();
+	size_t count = chunk->len;
+	size_t start;
+	bool wipe;
+
+	/* Flash only takes whole write units, the rest is staged */
+	{
+		MutexLock lock(&blocks_->mutex);
+
+		start = blocks_->write_pos[idx];
+		wipe = blocks_->states[idx] == VBLK_UNERASED;
+		if (wipe)
+			blocks_->states[idx] = VBLK_READY;
+		if (stage_) {
+			size_t tail = count % blocks_->devs[blocks_->blk_devs[idx]].write_unit;
+
+			count -= tail;
+			blocks_->write_stages[idx].assign(data + count, tail);
+			blocks_->write_pos[idx] += count;
+			if (tail)
+				submit_stage_record(idx, req);
+
+			/* Only the tail grew, and no program is ahead of it */
+			if (count == 0 && start == blocks_->pos[idx])
+				blocks_->stages[idx] = blocks_->write_stages[idx];
+		} else {
+			blocks_->write_pos[idx] += count;
+		}
+	}
+
+	/* Same queue as the chunk, so the erase goes first */
+	if (wipe) {
+		ocssd_io *erase = new ocssd_io(ERASE_BLOCK_REQUEST, req->tag,
+						extent.target, this, port_);
+		erase->block_index = idx;
+		erase->parent = req;
+
+		req->inflight++;
+		programs_[idx].push_back(std::make_pair(erase, false));
+		submit_io(erase);
+	}
+
+	if (count == 0) {
+		delete chunk;
+		return;
+	}
+
+	ocssd_io *io = new ocssd_io(WRITE_BLOCK_REQUEST, req->tag, extent.target,
+					this, port_);
+	io->block_index = idx;
+	io->buf = data;
+	io->count = count;
+	io->offset = start;
+	io->private_data = chunk;
+	io->parent = req;
+
+	req->inflight++;
+	write_chunks_++;
+	programs_[idx].push_back(std::make_pair(io, false));
+	submit_io(io);
+}
+
+/*
+ * Make the staged tail of a vblk durable. A write is only replied to
+ * once its tail is, and an erase once its empty record is. With
+ * blocks_->mutex held.
+ */
+void ocssd_conn::submit_stage_record(size_t idx, write_request *req)
+{
+	std::string *record = new std::string(ocssd_stage_log::encode(vssd_id_,
+				idx, blocks_->write_pos[idx], blocks_->write_stages[idx]));
+	ocssd_io *io = new ocssd_io(WRITE_BLOCK_REQUEST, req->tag, stage_,
+					this, port_);
+
+	io->block_index = idx;
+	io->buf = &(*record)[0];
+	io->count = record->size();
+	io->private_data = record;
+	io->parent = req;
+
+	req->inflight++;
+	submit_stage_io(io);
+}
+
+/* Takes the I/O, which may be held back behind an earlier chunk */
+void ocssd_conn::complete_write_chunk(ocssd_io *io)
+{
+	if (io->target == stage_) {
+		finish_write_chunk(io);
+		return;
+	}
+
+	auto &programs = programs_[io->block_index];
+
+	for (auto &program : programs) {
+		if (program.first == io)
+			program.second = true;
+	}
+
+	while (!programs.empty() && programs.front().second) {
+		ocssd_io *done = programs.front().first;
+
+		programs.pop_front();
+		commit_write_chunk(done);
+		finish_write_chunk(done);
+	}
+
+	if (programs.empty())
+		programs_.erase(io->block_index);
+}
+
+void ocssd_conn::finish_write_chunk(ocssd_io *io)
+{
+	write_request *req = static_cast<write_request *>(io->parent);
+
+	if (io->target == stage_) {
+		delete static_cast<std::string *>(io->private_data);
+	} else if (io->opcode == WRITE_BLOCK_REQUEST) {
+		delete static_cast<struct bufferq *>(io->private_data);
+		write_chunks_--;
+	}
+
+	req->inflight--;
+	if (io->error && !req->status)
+		req->status = io->error;
+	delete io;
+
+	if (read_paused_ && !closing_) {
+		read_paused_ = false;
+		event_add(&ev_read, NULL);
+	}
+
+	/* Still receiving, the reply is sent once the payload is in */
+	if (req == write_req_ || req->inflight > 0)
+		return;
+
+	account(req->opcode == ERASE_BLOCK_REQUEST ? STATS_ERASE : STATS_WRITE,
+		req->start_ns, req->total, req->status);
+	if (!closing_)
+		send_status(req->opcode, req->tag, req->status);
+	delete req;
+}
+
+/*
+ * Move what readers see past a programmed chunk, or, if it failed,
+ * have the next chunk start over from there.
+ */
+void ocssd_conn::commit_write_chunk(ocssd_io *io)
+{
+	bufferq *chunk = static_cast<struct bufferq *>(io->private_data);
+	MutexLock lock(&blocks_->mutex);
+	size_t idx = io->block_index;
+
+	/* The erase ahead of the first write, a vblk left unerased is bad */
+	if (io->opcode == ERASE_BLOCK_REQUEST) {
+		if (io->error)
+			blocks_->states[idx] = VBLK_BAD;
+		record_blocks(idx, 1);
+		return;
+	}
+
+	/* Queued behind a chunk that failed, so not where it was meant to go */
+	if (!io->error && io->offset != blocks_->pos[idx])
+		io->error = EIO;
+
+	if (io->error) {
+		if (io->offset == blocks_->pos[idx]) {
+			blocks_->write_pos[idx] = blocks_->pos[idx];
+			blocks_->write_stages[idx] = blocks_->stages[idx];
+		}
+		return;
+	}
+
+	blocks_->pos[idx] += io->count;
+	if (blocks_->pos[idx] == blocks_->write_pos[idx])
+		blocks_->stages[idx] = blocks_->write_stages[idx];
+	else
+		blocks_->stages[idx].assign(chunk->data() + io->count,
+					chunk->len - io->count);
+
+	record_blocks(idx, 1);
+	if (stage_)
+		stage_->trim(vssd_id_, idx, blocks_->pos[idx]);
+}
+
+void ocssd_conn::complete_vector_read(ocssd_io *io)
+{
+	read_request *req = static_cast<read_request *>(io->parent);
+
+	req->inflight--;
+	if (io->error && !req->status)
+		req->status = io->error;
+
+	if (req->inflight == 0)
+		finish_vector_read(req);
+}
+
+void ocssd_conn::finish_vector_read(read_request *req)
+{
+	account(STATS_READ, req->start_ns, req->reply->len - FRAME_HEADER_SIZE,
+		req->status);
+
+	if (closing_) {
+		delete req->reply;
+		delete req;
+		return;
+	}
+
+	ocssd_frame_header reply(READV_BLOCK_REQUEST, req->tag, 0,
+				req->reply->len - FRAME_HEADER_SIZE, req->status);
+
+	if (req->status) {
+		reply.set_data_len(0);
+		req->reply->len = FRAME_HEADER_SIZE;
+	}
+
+	reply.serialize(req->reply->buf);
+	queue_reply(req->reply);
+	delete req;
+}
+
+/*
+ * Copy the staged part of [offset, offset + count) of a vblk into the
+ * data of bufferq at buf_off. The staged tail is the end of the vblk,
+ * so what comes before it is read from flash; returns how much.
+ */
+size_t ocssd_conn::read_staged(size_t idx, size_t offset, size_t count,
+	bufferq *bufferq, size_t buf_off)
+{
+	MutexLock lock(&blocks_->mutex);
+	const std::string &stage = blocks_->stages[idx];
+	size_t start = blocks_->pos[idx];
+
+	if (stage.empty() || offset + count <= start)
+		return count;
+
+	size_t from = std::max(offset, start);
+	const char *src = stage.data() + (from - start);
+	std::vector<struct iovec> iov;
+
+	bufferq->slice(buf_off + from - offset, offset + count - from, iov);
+	for (const struct iovec &seg : iov) {
+		memcpy(seg.iov_base, src, seg.iov_len);
+		src += seg.iov_len;
+	}
+
+	return from - offset;
+}
+
 int ocssd_conn::process_incoming_requests(int fd)
 {
 	int ret = 0;
 
-	if (state == RECEIVING_COMMAND)
-		ret = process_command(fd);
-	else
-		ret = process_write_data(fd);
+	would_block_ = false;
+
+	while (!would_block_) {
+		if (state == RECEIVING_COMMAND)
+			ret = process_command(fd);
+		else
+			ret = process_write_data(fd);
+
+		if (ret < 0)
+			break;
+	}
 
 	return ret;
 }
 
+int ocssd_conn::disconnect(const char *reason)
+{
+	/* Remove the read event, the caller frees the client structure. */
+	printf("%s", reason);
+	close(connfd_);
+	connfd_ = -1;
+	event_del(&ev_read);
+	event_del(&ev_write);
+	event_del(&ev_throttle);
+	return -1;
+}
+
+/*
+ * Read frames until the socket runs dry. A frame is only dispatched
+ * once its header and request parameters are complete, so any number
+ * of requests may be queued on the socket by a pipelining client.
+ */
 int ocssd_conn::process_command(int fd)
 {
-	while (message_end_ < MESSAGE_BUFFER_SIZE) {
-		int len = read(fd, message_buf_ + message_end_,
-				MESSAGE_BUFFER_SIZE - message_end_);
+	int ret = 0;
 
-		if (len == 0) {
-			/* Client disconnected, remove the read event and the
-			 * free the client structure. */
-			printf("Client disconnected.\n");
-			close(connfd_);
-			event_del(&ev_read);
-			return -1;
-		} else if (len < 0) {
-			/* Some other error occurred, close the socket, remove
-			 * the event and free the client structure. */
-			printf("Socket failure, disconnecting client: %s",
-			    strerror(errno));
-			close(connfd_);
-			event_del(&ev_read);
-			return -1;
-		}
+	while (true) {
+		int expected = FRAME_HEADER_SIZE;
+
+		if (message_end_ >= FRAME_HEADER_SIZE)
+			expected += header_.get_body_len();
+
+		if (message_end_ < expected) {
+			int len = read(fd, message_buf_ + message_end_,
+					expected - message_end_);
+
+			if (len == 0) {
+				return disconnect("Client disconnected.\n");
+			} else if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					would_block_ = true;
+					return 0;
+				}
+				printf("Socket failure, disconnecting client: %s\n",
+				    strerror(errno));
+				return disconnect("");
+			}
 
-		message_end_ += len;
-	}
+			message_end_ += len;
 
-	message_end_ = 0;
-	int ret = 0;
+			if (message_end_ == FRAME_HEADER_SIZE) {
+				try {
+					header_ = ocssd_frame_header(message_buf_);
+					cmd_start_ = stats_now_ns();
+				} catch (const std::runtime_error &e) {
+					return disconnect("Invalid frame, disconnecting client.\n");
+				}
 
-	uint32_t header = get_header(message_buf_);
+				if (header_.get_body_len() >
+						MESSAGE_BUFFER_SIZE - FRAME_HEADER_SIZE)
+					return disconnect("Frame too large, disconnecting client.\n");
+			}
 
-	switch (header) {
-	case REQUEST_MAGIC:
-		ret = process_alloc_request(fd);
-		break;
-	case READ_BLOCK_MAGIC:
-		ret = process_read_request(fd);
-		break;
-	case WRITE_BLOCK_MAGIC:
-		ret = process_write_request(fd);
-		break;
-	case ERASE_BLOCK_MAGIC:
-		ret = process_erase_request(fd);
-		break;
-	default:
-		return -1;
+			continue;
+		}
+
+		/* The request stays buffered while the vSSD is over its limits */
+		try {
+			if (qos_throttle())
+				return 0;
+		} catch (const std::runtime_error &e) {
+			return disconnect("Invalid request, disconnecting client.\n");
+		}
+
+		message_end_ = 0;
+
+		try {
+			switch (header_.get_opcode()) {
+			case ALLOC_VSSD_REQUEST:
+				ret = process_alloc_request(fd);
+				break;
+			case ATTACH_VSSD_REQUEST:
+				ret = process_attach_request(fd);
+				break;
+			case RELEASE_VSSD_REQUEST:
+				ret = process_release_request(fd);
+				break;
+			case READ_BLOCK_REQUEST:
+				ret = process_read_request(fd);
+				break;
+			case WRITE_BLOCK_REQUEST:
+				ret = process_write_request(fd);
+				break;
+			case ERASE_BLOCK_REQUEST:
+				ret = process_erase_request(fd);
+				break;
+			case READV_BLOCK_REQUEST:
+				ret = process_readv_request(fd);
+				break;
+			case WRITEV_BLOCK_REQUEST:
+				ret = process_writev_request(fd);
+				break;
+			default:
+				return disconnect("Unknown opcode, disconnecting client.\n");
+			}
+		} catch (const std::runtime_error &e) {
+			return disconnect("Invalid request, disconnecting client.\n");
+		}
+
+		/* Stop here if the payload of a write follows */
+		if (ret < 0 || state != RECEIVING_COMMAND)
+			return ret;
 	}
 
 	return ret;
 }
 
-int ocssd_conn::publish_resource()
+void ocssd_conn::queue_reply(bufferq *bufferq)
+{
+	writeq.push_back(bufferq);
+
+	/* Since we now have data that needs to be written back to the
+	 * client, add a write event. */
+	event_add(&ev_write, NULL);
+}
+
+int ocssd_conn::send_status(REQUEST_CODE opcode, uint64_t tag, int status)
+{
+	bufferq *bufferq = new class bufferq(FRAME_HEADER_SIZE);
+	ocssd_frame_header reply(opcode, tag, 0, 0, status);
+
+	reply.serialize(bufferq->buf);
+	queue_reply(bufferq);
+	return 0;
+}
+
+/* True if any plane of any of the blocks is marked in the bad block table */
+bool ocssd_conn::bbt_has_bad(const std::vector<struct nvm_addr> &addrs,
+	vssd_device &device)
 {
-	const std::vector<ocssd_unit *> & ocssds = manager->get_units();
+	for (const struct nvm_addr &addr : addrs) {
+		std::vector<uint8_t> &bbt = device.bbts[std::make_pair(addr.g.ch, addr.g.lun)];
 
-	for (auto unit : ocssds) {
-		size_t shared = 0;
-		size_t exclusive = 0;
-		size_t blocks = 0;
-		int ret;
+		if (bbt.empty()) {
+			struct nvm_ret ret;
+			const struct nvm_bbt *dev_bbt = nvm_bbt_get(device.dev, addr, &ret);
+
+			if (!dev_bbt)
+				return true;
+			bbt.assign(dev_bbt->blks, dev_bbt->blks + dev_bbt->nblks);
+		}
 
-		ret = unit->get_ocssd_stats(shared, exclusive, blocks);
+		for (size_t pl = 0; pl < device.geo->nplanes; pl++) {
+			size_t idx = addr.g.blk * device.geo->nplanes + pl;
 
-		if (!ret)
-			ret = azure_insert_entity(unit->get_desc(),
-						shared, exclusive, blocks);
+			if (idx >= bbt.size() || bbt[idx] != NVM_BBT_FREE)
+				return true;
+		}
 	}
 
-	return ocssds.size();
+	return false;
 }
 
-int ocssd_conn::initialize_vssd_blocks(const virtual_ocssd_unit * vunit)
+/* The block addresses of each vblk of a unit, one block of every LUN per vblk */
+void ocssd_conn::generate_vblks(const virtual_ocssd_unit *vunit,
+	const struct nvm_geo *geo, std::vector<std::vector<struct nvm_addr>> &vblks)
 {
 	std::vector<uint32_t> curr_blocks;
-	int count = 0;
 	int i = 0;
 
 	vunit->generate_units(curr_blocks);
-	std::cout << __func__ << ": OCSSD blocks " << curr_blocks.size() << std::endl;
+	std::cout << __func__ << ": " << vunit->get_dev_name() << " blocks "
+		<< curr_blocks.size() << std::endl;
 
 	while (true) {
 		std::vector<struct ::nvm_addr> addrs;
@@ -233,7 +1205,7 @@ int ocssd_conn::initialize_vssd_blocks(const virtual_ocssd_unit * vunit)
 				}
 			} else {
 				for (lun_id = 0; lun_id < num_luns; lun_id++) {
-					block_end = geo_->nblocks;
+					block_end = geo->nblocks;
 
 					if (curr_blocks[i] < block_end)
 						generate_addr(addrs, curr_blocks, channel_id, lun_id, i);
@@ -245,215 +1217,831 @@ int ocssd_conn::initialize_vssd_blocks(const virtual_ocssd_unit * vunit)
 		if (addrs.size() == 0)
 			break;
 
-		struct nvm_vblk *blk;
+		vblks.push_back(addrs);
+	}
+}
+
+/*
+ * Build the vblks of the vSSD. Each vblk lives on one unit, and the
+ * index space stripes over the units round robin: vblk n is on unit
+ * n % units while every unit has vblks left, so consecutive vblks go
+ * to different drives. The layout only depends on the vSSD, a vblk
+ * keeps its index for the life of the vSSD, bad ones stay as holes.
+ *
+ * With VSSD_INIT_BBT the vblks with a block marked bad on the device are
+ * bad, and the rest are ready at once. They may still hold what the last
+ * vSSD on those blocks wrote, so each is erased ahead of its first write
+ * unless the client erases it first, and no read goes past the write
+ * pointer. With VSSD_INIT_TEST every vblk is tested by the device
+ * workers, in parallel and after the alloc reply has gone out; each vblk
+ * is usable as soon as its own test passes. Until then I/O to it fails
+ * with EAGAIN, and with EIO after a failed test. With VSSD_INIT_RESTORE
+ * the states come from the journal, and vblks that were still under test
+ * or not erased yet are tested again. This only happens when no
+ * connection uses the vSSD, so nobody can have written to them. The
+ * journal may have lost the last write pointer updates, so the pointers
+ * of the other vblks are read back from the media before they are used,
+ * see nvm_vblk_find_pos_write(), and only then are their staged tails
+ * looked up.
+ *
+ * With blocks_->mutex held, once per set of vblks.
+ */
+int ocssd_conn::initialize_vssd_blocks(const virtual_ocssd *vssd, uint32_t init_mode)
+{
+	ocssd_vssd_blocks &blocks = *blocks_;
+	std::vector<std::vector<std::vector<struct nvm_addr>>> unit_vblks(blocks.devs.size());
+	std::vector<ocssd_vblk_record> saved;
+	size_t rounds = 0;
+
+	if (init_mode == VSSD_INIT_RESTORE)
+		manager->get_vblks(vssd_id_, saved);
+
+	for (size_t u = 0; u < blocks.devs.size(); u++) {
+		generate_vblks(vssd->get_unit(u), blocks.devs[u].geo, unit_vblks[u]);
+		rounds = std::max(rounds, unit_vblks[u].size());
+	}
+
+	for (size_t round = 0; round < rounds; round++) {
+		for (size_t u = 0; u < blocks.devs.size(); u++) {
+			if (round >= unit_vblks[u].size())
+				continue;
+
+			std::vector<struct nvm_addr> &addrs = unit_vblks[u][round];
+			vssd_device &device = blocks.devs[u];
+			size_t idx = blocks.blks.size();
+			vblk_state state = VBLK_TESTING;
+			uint64_t pos_write = 0;
+
+			if (idx < saved.size() && saved[idx].state != kReserved) {
+				if (saved[idx].state == kBad)
+					state = VBLK_BAD;
+				else
+					state = VBLK_CHECKING;
+				pos_write = saved[idx].pos_write;
+			} else if (init_mode == VSSD_INIT_BBT) {
+				state = bbt_has_bad(addrs, device) ? VBLK_BAD : VBLK_UNERASED;
+			}
+
+			blocks.blk_devs.push_back(u);
+			blocks.stages.push_back(std::string());
+			blocks.write_stages.push_back(std::string());
+			if (state == VBLK_BAD) {
+				blocks.blks.push_back(NULL);
+				blocks.states.push_back(state);
+				blocks.pos.push_back(0);
+				blocks.write_pos.push_back(0);
+				continue;
+			}
+
+			struct nvm_vblk *blk;
+
+			blk = nvm_vblk_alloc(device.dev, addrs.data(), addrs.size());
+			if (!blk) {
+				std::cout << __func__ << "FAILED: nvm_vblk_alloc" << std::endl;
+				return -ENOMEM;
+			}
+
+			if (pos_write)
+				nvm_vblk_set_pos_write(blk, pos_write);
 
-		blk = nvm_vblk_alloc(dev_, addrs.data(), addrs.size());
+			blocks.blks.push_back(new ocssd_vblk_target(device.dev, device.geo, blk));
+			blocks.states.push_back(state);
+			blocks.pos.push_back(pos_write);
+			blocks.write_pos.push_back(pos_write);
+			/* FIXME: Assume each block has equal size */
+			blocks.blk_size = nvm_vblk_get_nbytes(blk);
+		}
+	}
 
-		if (nvm_vblk_test(geo_, blk) < 0) {
-			std::cout << "Test block " << count << " failed" << std::endl;
-			nvm_vblk_free(blk);
+	for (vssd_device &device : blocks.devs)
+		device.bbts.clear();
+
+	size_t testing = std::count(blocks.states.begin(), blocks.states.end(),
+				VBLK_TESTING);
+	size_t checking = std::count(blocks.states.begin(), blocks.states.end(),
+				VBLK_CHECKING);
+
+	blocks.testing = testing + checking;
+	std::cout << __func__ << ": " << blocks.blks.size() << " vblks on "
+		<< blocks.devs.size() << " devices, "
+		<< std::count(blocks.states.begin(), blocks.states.end(), VBLK_BAD)
+		<< " bad, " << testing << " to test, " << checking << " to check"
+		<< std::endl;
+
+	record_blocks(0, blocks.blks.size());
+
+	/* Completed on this connection, which outlives its I/Os */
+	for (size_t idx = 0; idx < blocks.blks.size(); idx++) {
+		if (blocks.states[idx] != VBLK_TESTING &&
+				blocks.states[idx] != VBLK_CHECKING)
 			continue;
+
+		ocssd_io *io = new ocssd_io(blocks.states[idx] == VBLK_TESTING ?
+					TEST_BLOCK_REQUEST : CHECK_BLOCK_REQUEST,
+					0, blocks.blks[idx], this, port_);
+		io->block_index = idx;
+
+		submit_io(io);
+	}
+
+	return 0;
+}
+
+/* A vblk test or write pointer check is done */
+void ocssd_conn::complete_block_test(ocssd_io *io)
+{
+	MutexLock lock(&blocks_->mutex);
+	size_t idx = io->block_index;
+	bool check = io->opcode == CHECK_BLOCK_REQUEST;
+
+	blocks_->testing--;
+	if (io->error) {
+		std::cout << (check ? "Check" : "Test") << " block " << idx
+			<< " failed" << std::endl;
+		blocks_->states[idx] = VBLK_BAD;
+	} else {
+		/* Nothing else ran on the vblk, the target has its pointer */
+		uint64_t pos = io->target->get_pos_write();
+
+		if (check && pos != blocks_->pos[idx])
+			std::cout << "Block " << idx << " written up to " << pos
+				<< ", journal had " << blocks_->pos[idx] << std::endl;
+
+		blocks_->states[idx] = VBLK_READY;
+		blocks_->pos[idx] = pos;
+		blocks_->write_pos[idx] = pos;
+		if (check && stage_)
+			stage_->get_tail(vssd_id_, idx, pos, blocks_->stages[idx]);
+		blocks_->write_stages[idx] = blocks_->stages[idx];
+	}
+
+	record_blocks(idx, 1);
+
+	if (blocks_->testing == 0) {
+		size_t ready = std::count(blocks_->states.begin(),
+					blocks_->states.end(), VBLK_READY);
+		std::cout << __func__ << ": " << ready << " of "
+			<< blocks_->blks.size() << " vblks ready" << std::endl;
+	}
+}
+
+/*
+ * Journal the state and write pointer of vblks [first, first + count),
+ * with blocks_->mutex held
+ */
+void ocssd_conn::record_blocks(size_t first, size_t count)
+{
+	std::vector<ocssd_vblk_record> blks;
+
+	for (size_t idx = first; idx < first + count; idx++) {
+		ocssd_vblk_record blk;
+
+		switch (blocks_->states[idx]) {
+		case VBLK_TESTING:
+		case VBLK_UNERASED:
+			blk.state = kReserved;
+			break;
+		case VBLK_BAD:
+			blk.state = kBad;
+			break;
+		default:
+			blk.state = blocks_->pos[idx] ? kOpen : kFree;
+			break;
 		}
 
-		if (!blk) {
-			std::cout << __func__ << "FAILED: nvm_vblk_alloc" << std::endl;
-			for (auto &vblk : blks_array_)
-				nvm_vblk_free(vblk);
-			return -ENOMEM;
+		blk.pos_write = blocks_->pos[idx];
+		blks.push_back(blk);
+	}
+
+	manager->record_vblks(vssd_id_, first, blks);
+}
+
+/*
+ * Open the devices of the vSSD and build its vblks, unless another
+ * connection using the vSSD already has.
+ */
+int ocssd_conn::initialize_remote_vssd(virtual_ocssd *vssd, uint32_t init_mode)
+{
+	MutexLock lock(&blocks_->mutex);
+	size_t write_chunk = 0;
+	int ret;
+
+	for (size_t u = 0; u < vssd->get_num_units(); u++) {
+		const virtual_ocssd_unit *vunit = vssd->get_unit(u);
+
+		if (!blocks_->built) {
+			vssd_device device;
+
+			device.name = vunit->get_dev_name();
+			device.dev = nvm_dev_open(device.name.c_str());
+			if (!device.dev) {
+				std::cout << __func__ << ": FAILED: opening device "
+					<< device.name << std::endl;
+				blocks_->clear();
+				return -ENODEV;
+			}
+
+			device.geo = nvm_dev_get_geo(device.dev);
+			device.write_unit = device.geo->nplanes * device.geo->nsectors *
+						device.geo->sector_nbytes;
+			blocks_->devs.push_back(device);
+
+			std::cout << __func__ << ": " << device.name << std::endl;
 		}
 
-		blks_array_.push_back(blk);
-		/* FIXME: Assume each block has equal size */
-		blk_size_ = nvm_vblk_get_nbytes(blk);
-		count++;
+		/*
+		 * Stream writes in full stripes of write units, one unit per
+		 * LUN, cut to fit a pool chunk. A unit larger than that takes
+		 * a malloc'd chunk, see process_write_data().
+		 */
+		size_t write_unit = blocks_->devs[u].write_unit;
+		std::vector<uint32_t> luns;
+
+		vunit->generate_units(luns);
+		size_t size = write_unit * std::max<size_t>(luns.size(), 1);
+		if (size > POOL_CHUNK_SIZE)
+			size = std::max(POOL_CHUNK_SIZE / write_unit, 1UL) * write_unit;
+		write_chunk = std::max(write_chunk, size);
 	}
 
-	std::cout << __func__ << ": " << count << " vblks" << std::endl;
-	num_blks_ = count;
+	if (write_chunk)
+		write_chunk_size_ = write_chunk;
 
-	// FIXME: Restore vblk states
+	if (blocks_->built)
+		return 0;
 
+	blocks_->iops_bucket.set_rate(vssd->get_qos().iops);
+	blocks_->bw_bucket.set_rate(vssd->get_qos().bandwidth);
+
+	ret = initialize_vssd_blocks(vssd, init_mode);
+	if (ret < 0) {
+		blocks_->clear();
+		return ret;
+	}
+
+	blocks_->built = true;
 	return 0;
 }
 
-int ocssd_conn::initialize_remote_vssd(virtual_ocssd *vssd)
+/*
+ * Take the vSSD for remote I/O on this connection, 0 or an errno to
+ * reply with. Nothing is left held or open on failure.
+ */
+int ocssd_conn::hold_remote_vssd(virtual_ocssd *vssd, uint32_t init_mode)
 {
-	//FIXME: Use only one unit now
-	const virtual_ocssd_unit *vunit = vssd->get_unit(0);
-
-	std::string dev_path = vunit->get_dev_name();
-	dev_ = nvm_dev_open(dev_path.c_str());
-	if (!dev_) {
-		std::cout << __func__ << ": FAILED: opening device" << std::endl;
-		throw std::runtime_error("FAILED: opening device");
-		return -EIO;
-	}
+	int ret;
 
-	geo_ = nvm_dev_get_geo(dev_);
+	if (manager->hold_vssd(vssd->get_id()))
+		return ENOENT;
 
-	initialize_vssd_blocks(vunit);
+	remote_vssd_ = 1;
+	vssd_id_ = vssd->get_id();
+	vssd_stats_ = stats_->vssd_stats(vssd_id_);
+	qos_ = vssd->get_qos();
+	blocks_ = manager->share_blocks(vssd_id_,
+			std::make_shared<ocssd_vssd_blocks>());
 
-	std::cout << __func__ << ": " << dev_path << std::endl;
+	ret = initialize_remote_vssd(vssd, init_mode);
+	if (ret < 0) {
+		drop_remote_vssd();
+		return -ret;
+	}
 
 	return 0;
 }
 
+/* Only while no I/O of this connection is in flight */
+void ocssd_conn::drop_remote_vssd()
+{
+	blocks_.reset();
+	manager->put_vssd(vssd_id_);
+	vssd_stats_ = NULL;
+	qos_ = ocssd_qos();
+	remote_vssd_ = 0;
+}
+
+int ocssd_conn::send_vssd(REQUEST_CODE opcode, uint64_t tag, virtual_ocssd *vssd)
+{
+	size_t size = vssd->get_serialized_size();
+	bufferq *bufferq = new class bufferq(FRAME_HEADER_SIZE + size);
+	size_t len = vssd->serialize(bufferq->buf + FRAME_HEADER_SIZE, size);
+	ocssd_frame_header reply(opcode, tag, 0, len);
+
+	reply.serialize(bufferq->buf);
+	bufferq->len = FRAME_HEADER_SIZE + len;
+	queue_reply(bufferq);
+	return 0;
+}
 
 int ocssd_conn::process_alloc_request(int fd)
 {
-	ocssd_alloc_request request(message_buf_);
-	virtual_ocssd *vssd = new virtual_ocssd();
+	ocssd_alloc_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+	virtual_ocssd *vssd;
 	size_t ret = 0;
 
-	ret = manager->alloc_ocssd_resource(vssd, &request);
+	request.print();
 
-	if (!ret || vssd->get_num_units() < 1) {
-		printf("No resource to allocate.\n");
-		delete vssd;
-		return -1;
+	/* One vSSD per connection, as for attach */
+	if (request.get_remote() && remote_vssd_) {
+		account(STATS_ALLOC, cmd_start_, 0, EBUSY);
+		return send_status(ALLOC_VSSD_REQUEST, request.get_tag(), EBUSY);
 	}
 
-	bufferq *bufferq = new class bufferq(VSSD_BUFFER_SIZE);
-	if (!bufferq) {
+	vssd = new virtual_ocssd();
+	ret = manager->alloc_ocssd_resource(vssd, &request);
+
+	if (!ret || vssd->get_num_units() < 1) {
 		printf("No resource to allocate.\n");
 		delete vssd;
-		return -1;
+		account(STATS_ALLOC, cmd_start_, 0, ENOSPC);
+		return send_status(ALLOC_VSSD_REQUEST, request.get_tag(), ENOSPC);
 	}
 
 	if (request.get_remote()) {
 		printf("Remote VSSD request.\n");
-		remote_vssd_ = 1;
-		initialize_remote_vssd(vssd);
+		int err = hold_remote_vssd(vssd, request.get_init_mode() ==
+				VSSD_INIT_BBT ? VSSD_INIT_BBT : VSSD_INIT_TEST);
+
+		/* Nobody got to see the vSSD, its capacity goes back */
+		if (err) {
+			printf("Remote VSSD %u failed: %s\n", vssd->get_id(),
+				strerror(err));
+			manager->release_vssd(vssd->get_id());
+			publisher_->notify();
+			delete vssd;
+			account(STATS_ALLOC, cmd_start_, 0, err);
+			return send_status(ALLOC_VSSD_REQUEST, request.get_tag(), err);
+		}
 	}
 
-	size_t len = vssd->serialize(bufferq->buf);
+	send_vssd(ALLOC_VSSD_REQUEST, request.get_tag(), vssd);
+	account(STATS_ALLOC, cmd_start_, 0, 0);
 
-	bufferq->len = len;
-	writeq.push_back(bufferq);
+	vssd->print();
+	publisher_->notify();
 
-	/* Since we now have data that needs to be written back to the
-	 * client, add a write event. */
-	event_add(&ev_write, NULL);
+	delete vssd;
+	return 0;
+}
 
-	vssd->print();
-	manager->persist();
-	publish_resource();
+int ocssd_conn::process_attach_request(int fd)
+{
+	ocssd_attach_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+
+	if (remote_vssd_)
+		return send_status(ATTACH_VSSD_REQUEST, request.get_tag(), EBUSY);
+
+	virtual_ocssd *vssd = manager->get_vssd(request.get_vssd_id());
+	if (!vssd)
+		return send_status(ATTACH_VSSD_REQUEST, request.get_tag(), ENOENT);
+
+	printf("Attach VSSD %u.\n", vssd->get_id());
+	int err = hold_remote_vssd(vssd, VSSD_INIT_RESTORE);
+	if (err) {
+		delete vssd;
+		account(STATS_ALLOC, cmd_start_, 0, err);
+		return send_status(ATTACH_VSSD_REQUEST, request.get_tag(), err);
+	}
+
+	send_vssd(ATTACH_VSSD_REQUEST, request.get_tag(), vssd);
+	account(STATS_ALLOC, cmd_start_, 0, 0);
 
 	delete vssd;
 	return 0;
 }
 
-int ocssd_conn::process_read_request(int fd)
+/*
+ * Replied to once the capacity is back, so the client can allocate it
+ * again right away. That waits for every connection that holds the
+ * vSSD, this one included, which must have no I/O in flight.
+ */
+int ocssd_conn::process_release_request(int fd)
 {
-	ocssd_io_request request(message_buf_);
-	uint32_t idx = request.get_block_index();
-	size_t count = request.get_count();
-	size_t offset = request.get_offset();
-	ssize_t ret = 0;
+	ocssd_release_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+	uint32_t vssd_id = request.get_vssd_id();
+	bool held = remote_vssd_ && vssd_id_ == vssd_id;
 
-//	printf("%s: block %u, size %lu, offset%lu\n", __func__, idx, count, offset);
+	if (held && inflight_ > 0) {
+		account(STATS_ALLOC, cmd_start_, 0, EBUSY);
+		return send_status(RELEASE_VSSD_REQUEST, request.get_tag(), EBUSY);
+	}
 
-	struct nvm_vblk *blk = GetBlockPointer(idx);
-	if (!blk) {
-		//FIXME: send error
-		return -1;
+	/* Completed from whichever thread puts the vSSD last */
+	ocssd_io *io = new ocssd_io(RELEASE_VSSD_REQUEST, request.get_tag(), NULL,
+					this, port_);
+	io->start_ns = cmd_start_;
+
+	inflight_++;
+	int ret = manager->release_vssd(vssd_id, [io]() {
+		io->port->complete(io);
+	});
+
+	printf("Release VSSD %u: %d.\n", vssd_id, ret);
+	if (ret) {
+		inflight_--;
+		delete io;
+		account(STATS_ALLOC, cmd_start_, 0, -ret);
+		return send_status(RELEASE_VSSD_REQUEST, request.get_tag(), -ret);
 	}
 
-	bufferq *bufferq = new class bufferq(count);
-	if (!bufferq) {
-		printf("No resource to allocate.\n");
-		return -1;
+	if (held)
+		drop_remote_vssd();
+	if (stage_)
+		stage_->drop(vssd_id);
+	return 0;
+}
+
+/* Count a finished request in the thread's stats and the vSSD's */
+void ocssd_conn::account(STATS_OP op, uint64_t start_ns, size_t bytes, int status)
+{
+	uint64_t latency = stats_now_ns() - start_ns;
+
+	if (status)
+		bytes = 0;
+
+	stats_->thread_stats()->record(op, latency, bytes, status != 0);
+	if (vssd_stats_)
+		vssd_stats_->record(op, latency, bytes, status != 0);
+}
+
+/* Operations and bytes the request in message_buf_ is charged */
+void ocssd_conn::request_cost(uint64_t &ops, uint64_t &bytes)
+{
+	const char *body = message_buf_ + FRAME_HEADER_SIZE;
+
+	ops = 0;
+	bytes = 0;
+
+	switch (header_.get_opcode()) {
+	case READ_BLOCK_REQUEST:
+		ops = 1;
+		bytes = ocssd_io_request(header_, body).get_count();
+		break;
+	case WRITE_BLOCK_REQUEST:
+		ops = 1;
+		bytes = header_.get_data_len();
+		break;
+	case ERASE_BLOCK_REQUEST:
+		ops = 1;
+		break;
+	case READV_BLOCK_REQUEST:
+	case WRITEV_BLOCK_REQUEST: {
+		ocssd_vector_request request(header_, body);
+
+		ops = request.get_extents().size();
+		bytes = request.get_total_length();
+		break;
+	}
+	default:
+		break;
 	}
+}
 
-	ret = nvm_vblk_pread(blk, bufferq->buf, count, offset);
+/*
+ * Hold back the request in message_buf_ while the vSSD is over its
+ * limits. Reading stops until ev_throttle fires, so what follows waits
+ * in the socket and a client that keeps sending is pushed back by TCP.
+ */
+bool ocssd_conn::qos_throttle()
+{
+	uint64_t ops, bytes;
 
-	if (ret < 0) {
-		printf("%s: read %ld, errno %d\n", __func__, ret, errno);
-		printf("%s: block %u, size %lu, offset %lu\n", __func__, idx, count, offset);
-		printf("pos write %lu\n", nvm_vblk_get_pos_write(blk));
-		nvm_vblk_pr(blk);
+	if (!qos_.iops && !qos_.bandwidth)
+		return false;
+
+	request_cost(ops, bytes);
+	if (!ops)
+		return false;
+
+	MutexLock lock(&blocks_->mutex);
+	uint64_t now = stats_now_ns();
+	uint64_t wait = std::max(blocks_->iops_bucket.wait_ns(now),
+				blocks_->bw_bucket.wait_ns(now));
+
+	if (wait == 0) {
+		blocks_->iops_bucket.consume(ops);
+		blocks_->bw_bucket.consume(bytes);
+		return false;
 	}
 
-	writeq.push_back(bufferq);
+	struct timeval tv;
+	tv.tv_sec = wait / 1000000000;
+	tv.tv_usec = (wait % 1000000000 + 999) / 1000;
 
-	event_add(&ev_write, NULL);
+	event_del(&ev_read);
+	event_add(&ev_throttle, &tv);
+	would_block_ = true;
+	return true;
+}
 
-	return 0;
+int ocssd_conn::submit_io(ocssd_io *io)
+{
+	io->tenant = vssd_id_;
+	io->weight = qos_.weight;
+	inflight_++;
+	return engine_->submit(blocks_->devs[blocks_->blk_devs[io->block_index]].name, io);
 }
 
-int ocssd_conn::process_write_request(int fd)
+/* Stage records are appended on a queue of their own */
+int ocssd_conn::submit_stage_io(ocssd_io *io)
 {
-	ocssd_io_request request(message_buf_);
-	uint32_t idx = request.get_block_index();
-	size_t count = request.get_count();
-	size_t received = 0;
-	ssize_t ret = 0;
+	io->tenant = vssd_id_;
+	io->weight = qos_.weight;
+	inflight_++;
+	return engine_->submit(stage_->get_name(), io);
+}
 
-//	printf("%s: block %u, size %lu\n", __func__, idx, count);
+void ocssd_conn::io_complete(ocssd_io *io)
+{
+	bufferq *bufferq = static_cast<struct bufferq *>(io->private_data);
+
+	inflight_--;
+
+	if (io->opcode == RELEASE_VSSD_REQUEST) {
+		publisher_->notify();
+		account(STATS_ALLOC, io->start_ns, 0, 0);
+		if (!closing_)
+			send_status(RELEASE_VSSD_REQUEST, io->tag, 0);
+		delete io;
+		if (closing_ && inflight_ == 0)
+			delete this;
+		return;
+	}
 
-	struct nvm_vblk *blk = GetBlockPointer(idx);
-	if (!blk) {
-		//FIXME: send error
-		return -1;
+	if (io->opcode == TEST_BLOCK_REQUEST || io->opcode == CHECK_BLOCK_REQUEST) {
+		complete_block_test(io);
+		delete io;
+		if (closing_ && inflight_ == 0)
+			delete this;
+		return;
 	}
 
-	bufferq *bufferq = new class bufferq(count);
-	if (!bufferq) {
-		printf("No resource to allocate.\n");
-		return -1;
+	/* Part of a request that was split into several I/Os */
+	if (io->parent) {
+		if (io->opcode == READ_BLOCK_REQUEST) {
+			complete_vector_read(io);
+			delete io;
+		} else {
+			complete_write_chunk(io);
+		}
+		if (closing_ && inflight_ == 0)
+			delete this;
+		return;
 	}
 
-	while (received < count) {
-		int len = read(fd, bufferq->buf + received, count - received);
+	if (io->error) {
+		printf("%s: opcode %d, tag %lu, result %ld, errno %d\n", __func__,
+			io->opcode, io->tag, io->result, io->error);
+		printf("%s: size %lu, offset %lu\n", __func__, io->count, io->offset);
+		io->target->print();
+	}
 
-		if (len == 0) {
-			/* Client disconnected, remove the read event and the
-			 * free the client structure. */
-			printf("Client disconnected.\n");
-			close(connfd_);
-			event_del(&ev_read);
-			return -1;
-		} else if (len < 0) {
-			/* Some other error occurred, close the socket, remove
-			 * the event and free the client structure. */
-			printf("Socket failure, disconnecting client: %s",
-			    strerror(errno));
-			close(connfd_);
-			event_del(&ev_read);
-			return -1;
+	if (io->opcode == ERASE_BLOCK_REQUEST && !io->error) {
+		MutexLock lock(&blocks_->mutex);
+
+		if (blocks_->states[io->block_index] == VBLK_UNERASED)
+			blocks_->states[io->block_index] = VBLK_READY;
+		blocks_->pos[io->block_index] = 0;
+		blocks_->write_pos[io->block_index] = 0;
+		blocks_->stages[io->block_index].clear();
+		blocks_->write_stages[io->block_index].clear();
+		record_blocks(io->block_index, 1);
+
+		/*
+		 * Replied to once the old tails are dropped for good. A tail
+		 * left in the log could otherwise come back after a restart,
+		 * should the vblk be written up to where it started again.
+		 */
+		if (stage_) {
+			write_request *req = new write_request(ERASE_BLOCK_REQUEST,
+							io->tag, io->start_ns);
+
+			submit_stage_record(io->block_index, req);
+			delete io;
+			return;
 		}
+	}
 
-		received += len;
-//		printf("%s: received %lu\n", __func__, received);
+	if (io->opcode == READ_BLOCK_REQUEST)
+		account(STATS_READ, io->start_ns, bufferq->len - FRAME_HEADER_SIZE,
+			io->error);
+	else if (io->opcode == ERASE_BLOCK_REQUEST)
+		account(STATS_ERASE, io->start_ns, 0, io->error);
+
+	if (closing_) {
+		delete bufferq;
+		delete io;
+		if (inflight_ == 0)
+			delete this;
+		return;
 	}
 
-	ret = nvm_vblk_write(blk, bufferq->buf, received);
-	if (ret < 0) {
-		printf("%s: written %ld, errno %d\n", __func__, ret, errno);
-		printf("%s: block %u, size %lu\n", __func__, idx, count);
-		printf("pos write %lu\n", nvm_vblk_get_pos_write(blk));
-		nvm_vblk_pr(blk);
+	switch (io->opcode) {
+	case READ_BLOCK_REQUEST: {
+		ocssd_frame_header reply(READ_BLOCK_REQUEST, io->tag, 0,
+					io->error ? 0 : bufferq->len - FRAME_HEADER_SIZE,
+					io->error);
+
+		reply.serialize(bufferq->buf);
+		if (io->error)
+			bufferq->len = FRAME_HEADER_SIZE;
+		queue_reply(bufferq);
+		break;
+	}
+	default:
+		send_status(io->opcode, io->tag, io->error);
+		break;
+	}
+
+	delete io;
+}
+
+int ocssd_conn::process_read_request(int fd)
+{
+	ocssd_io_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+	uint32_t idx = request.get_block_index();
+	size_t count = request.get_count();
+	size_t offset = request.get_offset();
+
+//	printf("%s: block %u, size %lu, offset%lu\n", __func__, idx, count, offset);
+
+	ocssd_io_target *blk = GetBlockPointer(idx);
+	if (!blk)
+		return send_status(READ_BLOCK_REQUEST, request.get_tag(), check_block(idx));
+	if (count > DATA_BUFFER_SIZE || past_stage(idx, offset, count))
+		return send_status(READ_BLOCK_REQUEST, request.get_tag(), EINVAL);
+
+	/* Read straight into pooled device buffers when there are
+	 * enough of them, otherwise into one malloc'd buffer. */
+	bufferq *bufferq = new class bufferq(pool_, FRAME_HEADER_SIZE, count);
+	if (!bufferq->pooled_ok()) {
+		delete bufferq;
+		bufferq = new class bufferq(FRAME_HEADER_SIZE + count);
 	}
 
-	delete bufferq;
+	size_t flash = read_staged(idx, offset, count, bufferq, 0);
+	if (flash == 0) {
+		ocssd_frame_header reply(READ_BLOCK_REQUEST, request.get_tag(), 0, count);
+
+		reply.serialize(bufferq->buf);
+		queue_reply(bufferq);
+		account(STATS_READ, cmd_start_, count, 0);
+		return 0;
+	}
+
+	ocssd_io *io = new ocssd_io(READ_BLOCK_REQUEST, request.get_tag(), blk,
+					this, port_);
+	io->block_index = idx;
+	io->start_ns = cmd_start_;
+	io->count = flash;
+	io->offset = offset;
+	io->private_data = bufferq;
+	if (bufferq->chunks.empty())
+		io->buf = bufferq->buf + FRAME_HEADER_SIZE;
+	else
+		bufferq->slice(0, flash, io->iov);
+
+	return submit_io(io);
+}
+
+int ocssd_conn::process_write_request(int fd)
+{
+	ocssd_io_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+	uint32_t idx = request.get_block_index();
+	size_t count = request.get_count();
+
+//	printf("%s: block %u, size %lu\n", __func__, idx, count);
+
+	if (header_.get_data_len() != count)
+		return disconnect("Invalid write payload, disconnecting client.\n");
+
+	/* The payload is always drained so the stream stays in sync */
+	ocssd_io_target *blk = GetBlockPointer(idx);
+	write_req_ = new write_request(WRITE_BLOCK_REQUEST, request.get_tag(),
+					cmd_start_);
+	write_req_->add(idx, blk, count);
+	if (!blk)
+		write_req_->status = check_block(idx);
+	else if (count > blk->get_nbytes())
+		write_req_->status = EINVAL;
+
+	state = RECEIVING_WRITE_DATA;
 	return 0;
 }
 
 int ocssd_conn::process_erase_request(int fd)
 {
-	ocssd_io_request request(message_buf_);
+	ocssd_io_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
 	uint32_t idx = request.get_block_index();
 
 	printf("Request block %u\n", idx);
 
-	struct nvm_vblk *blk = GetBlockPointer(idx);
-	if (!blk) {
-		//FIXME: send error
-		return -1;
+	ocssd_io_target *blk = GetBlockPointer(idx);
+	if (!blk)
+		return send_status(ERASE_BLOCK_REQUEST, request.get_tag(), check_block(idx));
+
+	ocssd_io *io = new ocssd_io(ERASE_BLOCK_REQUEST, request.get_tag(), blk,
+					this, port_);
+	io->block_index = idx;
+	io->start_ns = cmd_start_;
+
+	return submit_io(io);
+}
+
+/*
+ * Read all extents in parallel, each into its slice of one reply
+ * buffer, and reply once the last of them completes.
+ */
+int ocssd_conn::process_readv_request(int fd)
+{
+	ocssd_vector_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+	const std::vector<ocssd_extent> &extents = request.get_extents();
+	size_t total = request.get_total_length();
+
+	if (extents.empty() || total > DATA_BUFFER_SIZE)
+		return send_status(READV_BLOCK_REQUEST, request.get_tag(), EINVAL);
+
+	for (const ocssd_extent &extent : extents) {
+		int status = check_block(extent.block_index);
+
+		if (!status && past_stage(extent.block_index, extent.offset,
+					extent.length))
+			status = EINVAL;
+		if (status)
+			return send_status(READV_BLOCK_REQUEST, request.get_tag(), status);
+	}
+
+	bufferq *bufferq = new class bufferq(pool_, FRAME_HEADER_SIZE, total);
+	if (!bufferq->pooled_ok()) {
+		delete bufferq;
+		bufferq = new class bufferq(FRAME_HEADER_SIZE + total);
+	}
+
+	read_request *req = new read_request(request.get_tag(), cmd_start_, bufferq);
+	std::vector<ocssd_io *> ios;
+	size_t off = 0;
+
+	for (const ocssd_extent &extent : extents) {
+		size_t flash = read_staged(extent.block_index, extent.offset,
+					extent.length, bufferq, off);
+
+		if (flash) {
+			ocssd_io *io = new ocssd_io(READ_BLOCK_REQUEST, request.get_tag(),
+						GetBlockPointer(extent.block_index),
+						this, port_);
+			io->block_index = extent.block_index;
+			io->count = flash;
+			io->offset = extent.offset;
+			io->parent = req;
+			bufferq->slice(off, flash, io->iov);
+			ios.push_back(io);
+		}
+		off += extent.length;
+	}
+
+	/* All of it was staged */
+	if (ios.empty()) {
+		finish_vector_read(req);
+		return 0;
+	}
+
+	req->inflight = ios.size();
+	for (ocssd_io *io : ios)
+		submit_io(io);
+
+	return 0;
+}
+
+/*
+ * Stream the payload of every extent to its own vblk, see
+ * process_write_data(). Chunks of different extents are programmed in
+ * parallel.
+ */
+int ocssd_conn::process_writev_request(int fd)
+{
+	ocssd_vector_request request(header_, message_buf_ + FRAME_HEADER_SIZE);
+	const std::vector<ocssd_extent> &extents = request.get_extents();
+
+	if (header_.get_data_len() != request.get_total_length())
+		return disconnect("Invalid write payload, disconnecting client.\n");
+
+	/* The payload is always drained so the stream stays in sync */
+	write_req_ = new write_request(WRITEV_BLOCK_REQUEST, request.get_tag(),
+					cmd_start_);
+	for (const ocssd_extent &extent : extents) {
+		ocssd_io_target *blk = GetBlockPointer(extent.block_index);
+
+		write_req_->add(extent.block_index, blk, extent.length);
+		if (!blk)
+			write_req_->status = check_block(extent.block_index);
+		else if (extent.length > blk->get_nbytes())
+			write_req_->status = EINVAL;
 	}
 
-	nvm_vblk_erase(blk);
+	if (extents.empty())
+		write_req_->status = EINVAL;
 
+	state = RECEIVING_WRITE_DATA;
 	return 0;
 }
 
@@ -0,0 +1,834 @@
+#ifndef OCSSD_IO_ENGINE_H
+#define OCSSD_IO_ENGINE_H
+
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+#include <event.h>
+
+#include "ocssd_server.h"
+
+/*
+ * Asynchronous device I/O for the event loops.
+ *
+ * Each device gets a submission queue served by its own worker threads,
+ * which make the blocking liblightnvm calls. The device queues are
+ * shared by all event loops; finished I/Os are handed back to the loop
+ * that submitted them through that loop's completion port, an eventfd,
+ * and delivered to the submitting handler, so no loop waits on flash.
+ */
+
+/* The thing an I/O is issued against: one virtual block */
+class ocssd_io_target {
+public:
+	virtual ~ocssd_io_target() {}
+
+	virtual ssize_t pread(void *buf, size_t count, size_t offset) = 0;
+	virtual ssize_t write(const void *buf, size_t count) = 0;
+	virtual ssize_t erase() = 0;
+
+	/* Check the block is usable before it is handed out, 0 if it is */
+	virtual ssize_t test() = 0;
+
+	/* Set the write pointer from what the media holds, 0 if it could */
+	virtual ssize_t find_pos_write() = 0;
+
+	virtual size_t get_nbytes() const = 0;
+
+	/* Bit n set if the target spans channel n */
+	virtual uint64_t get_channel_mask() const = 0;
+
+	/* The LUNs the target spans, as channel << 16 | LUN */
+	virtual const std::vector<uint32_t> & get_luns() const = 0;
+
+	/* Only while no I/O on the target is in flight */
+	virtual size_t get_pos_write() const = 0;
+	virtual void set_pos_write(size_t pos) = 0;
+
+	virtual void print() const = 0;
+};
+
+/* A vblk on a real OCSSD, the target owns the vblk */
+class ocssd_vblk_target : public ocssd_io_target {
+public:
+	ocssd_vblk_target(struct nvm_dev *dev, const struct nvm_geo *geo,
+			struct nvm_vblk *blk)
+		: dev_(dev), geo_(geo), blk_(blk), channel_mask_(0)
+	{
+		struct nvm_addr *addrs = nvm_vblk_get_addrs(blk_);
+
+		for (int i = 0; i < nvm_vblk_get_naddrs(blk_); i++) {
+			channel_mask_ |= 1ULL << (addrs[i].g.ch % 64);
+			luns_.push_back(addrs[i].g.ch << 16 | addrs[i].g.lun);
+		}
+	}
+	~ocssd_vblk_target() {nvm_vblk_free(blk_);}
+
+	ssize_t pread(void *buf, size_t count, size_t offset) {
+		return nvm_vblk_pread(blk_, buf, count, offset);
+	}
+
+	ssize_t write(const void *buf, size_t count) {
+		return nvm_vblk_write(blk_, buf, count);
+	}
+
+	ssize_t erase() {
+		return nvm_vblk_erase(blk_);
+	}
+
+	/*
+	 * Full erase, write and read of the vblk. Blocks that fail are
+	 * marked in the device bad block table, so later allocations can
+	 * skip them without testing again.
+	 */
+	ssize_t test() {
+		ssize_t ret = nvm_vblk_test(geo_, blk_);
+
+		if (ret < 0)
+			nvm_vblk_mark_bad(dev_, geo_, blk_);
+		return ret;
+	}
+
+	ssize_t find_pos_write() {
+		return nvm_vblk_find_pos_write(geo_, blk_);
+	}
+
+	size_t get_nbytes() const {return nvm_vblk_get_nbytes(blk_);}
+	uint64_t get_channel_mask() const {return channel_mask_;}
+	const std::vector<uint32_t> & get_luns() const {return luns_;}
+	size_t get_pos_write() const {return nvm_vblk_get_pos_write(blk_);}
+	void set_pos_write(size_t pos) {nvm_vblk_set_pos_write(blk_, pos);}
+	struct nvm_vblk *get_vblk() const {return blk_;}
+
+	void print() const {
+		printf("pos write %lu\n", nvm_vblk_get_pos_write(blk_));
+		nvm_vblk_pr(blk_);
+	}
+
+private:
+	ocssd_vblk_target(const ocssd_vblk_target &);
+	ocssd_vblk_target & operator=(const ocssd_vblk_target &);
+
+	struct nvm_dev *dev_;
+	const struct nvm_geo *geo_;
+	struct nvm_vblk *blk_;
+	uint64_t channel_mask_;
+	std::vector<uint32_t> luns_;
+};
+
+/*
+ * A stand-in for a vblk backed by a region of a regular file, so the
+ * engine can run without OCSSD hardware. It keeps the vblk rules that
+ * matter to callers: writes append at the write pointer, and erase
+ * resets the write pointer. It sits on LUN 0 of the given channel, for
+ * the scheduler.
+ */
+class ocssd_file_target : public ocssd_io_target {
+public:
+	ocssd_file_target(int fd, size_t base, size_t nbytes, int channel = 0)
+		: fd_(fd), base_(base), nbytes_(nbytes), pos_write_(0),
+		channel_(channel % 64), luns_(1, channel << 16) {}
+
+	ssize_t pread(void *buf, size_t count, size_t offset) {
+		if (offset + count > nbytes_) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		return ::pread(fd_, buf, count, base_ + offset);
+	}
+
+	ssize_t write(const void *buf, size_t count) {
+		if (pos_write_ + count > nbytes_) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		ssize_t ret = ::pwrite(fd_, buf, count, base_ + pos_write_);
+		if (ret > 0)
+			pos_write_ += ret;
+		return ret;
+	}
+
+	ssize_t erase() {
+		if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				base_, nbytes_) < 0)
+			return -1;
+
+		pos_write_ = 0;
+		return 0;
+	}
+
+	ssize_t test() {
+		return erase();
+	}
+
+	/* The file does not tell, the pointer only lives here */
+	ssize_t find_pos_write() {return 0;}
+
+	size_t get_nbytes() const {return nbytes_;}
+	uint64_t get_channel_mask() const {return 1ULL << channel_;}
+	const std::vector<uint32_t> & get_luns() const {return luns_;}
+	size_t get_pos_write() const {return pos_write_;}
+	void set_pos_write(size_t pos) {pos_write_ = pos;}
+
+	void print() const {
+		printf("file region %lu, %lu bytes, pos write %lu\n",
+			base_, nbytes_, pos_write_);
+	}
+
+private:
+	int fd_;
+	size_t base_;
+	size_t nbytes_;
+	size_t pos_write_;
+	int channel_;
+	std::vector<uint32_t> luns_;
+};
+
+/*
+ * Split a regular file into num_blks stand-in vblks of blk_size bytes,
+ * dealt round robin over num_channels channels. The file is grown as
+ * needed; the caller owns the fd and the targets.
+ */
+int ocssd_file_targets(int fd, size_t num_blks, size_t blk_size,
+	std::vector<ocssd_io_target *> &targets, int num_channels = 1)
+{
+	if (ftruncate(fd, num_blks * blk_size) < 0)
+		return -errno;
+
+	for (size_t i = 0; i < num_blks; i++)
+		targets.push_back(new ocssd_file_target(fd, i * blk_size, blk_size,
+					i % std::max(num_channels, 1)));
+
+	return 0;
+}
+
+class ocssd_io;
+class ocssd_io_port;
+
+class ocssd_io_handler {
+public:
+	virtual ~ocssd_io_handler() {}
+
+	/* Called on the event loop thread once the I/O has finished */
+	virtual void io_complete(ocssd_io *io) = 0;
+};
+
+struct ocssd_io {
+	ocssd_io(REQUEST_CODE opcode, uint64_t tag, ocssd_io_target *target,
+			ocssd_io_handler *handler, ocssd_io_port *port)
+		: opcode(opcode), tag(tag), target(target), handler(handler),
+		port(port), block_index(0), buf(NULL), count(0), offset(0),
+		result(0), error(0), start_ns(0), seq(0), tenant(0), weight(1),
+		private_data(NULL), parent(NULL) {}
+
+	REQUEST_CODE opcode;
+	uint64_t tag;
+	ocssd_io_target *target;
+	ocssd_io_handler *handler;
+	ocssd_io_port *port;
+
+	/* Index of the target in the submitter's block table */
+	uint32_t block_index;
+
+	/* Reads fill iov when it is set, buf otherwise */
+	char *buf;
+	std::vector<struct iovec> iov;
+	size_t count;
+	size_t offset;
+
+	/* Filled in by the worker */
+	ssize_t result;
+	int error;
+
+	/* When the request arrived, for the latency stats */
+	uint64_t start_ns;
+
+	/* Submission order on the device queue */
+	uint64_t seq;
+
+	/* The vSSD this I/O is for and its share of the device */
+	uint32_t tenant;
+	uint32_t weight;
+
+	/* Owned by the submitter: the data buffer, and the request this
+	 * I/O is a part of when one request is split into several I/Os */
+	void *private_data;
+	void *parent;
+};
+
+/* Completion port of one event loop */
+class ocssd_io_port {
+public:
+	ocssd_io_port(struct event_base *base);
+	~ocssd_io_port();
+
+	/* Called by the device workers */
+	void complete(ocssd_io *io);
+
+	/*
+	 * Hand what has completed to the handlers, returns how many. On
+	 * the loop thread, or on any one thread once the loop is gone.
+	 */
+	size_t reap();
+
+private:
+	ocssd_io_port(const ocssd_io_port &);
+	ocssd_io_port & operator=(const ocssd_io_port &);
+
+	static void on_complete(int fd, short ev, void *arg);
+
+	struct event_base *base_;
+	int efd_;
+	struct event ev_complete_;
+
+	std::mutex mutex_;
+	std::deque<ocssd_io *> completed_;
+};
+
+/*
+ * Submission queue of a single device. I/Os on the same target run in
+ * submission order, one at a time, which keeps appends to a vblk in the
+ * order the client sent them; I/Os on different targets run in parallel.
+ *
+ * Among the targets that are idle, the scheduler picks:
+ * - reads, and the write pointer checks that only read, before programs
+ *   (writes and erases), and programs before vblk tests, as a program
+ *   holds its dies for milliseconds while a read takes tens of
+ *   microseconds. An I/O moves up a class for every SCHED_MAX_BYPASS
+ *   I/Os submitted after it, so none of them starves;
+ * - programs only while none of the LUNs they touch already has
+ *   SCHED_PROGRAMS_PER_LUN in flight, and while one worker is left for
+ *   reads, so an erase storm on a shared channel takes neither the dies
+ *   nor the workers that other tenants read from;
+ * - tests only on at most half of the workers not kept for reads, one
+ *   at least. A test erases, fills and reads back a whole vblk, every
+ *   LUN of it, so it is not counted against the LUNs: it would keep
+ *   every write of the vSSD off its dies for as long, and the tests of
+ *   a vSSD would run one at a time;
+ * - within a class, the tenant that is furthest behind its weighted
+ *   share of the device. This is start-time fair queuing: every tenant
+ *   has a virtual finish time that advances by cost / weight for each
+ *   I/O it is served, and a tenant coming back from idle starts at the
+ *   current virtual time, so it cannot claim the time it did not use;
+ * - then the target on the next channel after the last one served,
+ *   round robin, and the oldest I/O among equals.
+ */
+#define SCHED_PROGRAMS_PER_LUN 1
+#define SCHED_MAX_BYPASS 64
+#define SCHED_ERASE_COST (1 << 20)	/* Bytes of transfer an erase is worth */
+class ocssd_io_queue {
+public:
+	/* Workers are pinned to the CPUs of numa_node, if it is known */
+	ocssd_io_queue(int num_workers, int numa_node = -1);
+	~ocssd_io_queue();
+
+	void submit(ocssd_io *io);
+
+	/* Wait until every I/O submitted so far is in its port */
+	void drain();
+
+	/* Queue depth gauges, one line per channel */
+	void dump_stats(std::string &out, const std::string &device);
+
+private:
+	ocssd_io_queue(const ocssd_io_queue &);
+	ocssd_io_queue & operator=(const ocssd_io_queue &);
+
+	void run();
+	ocssd_io *next_io();
+	void execute(ocssd_io *io);
+
+	static bool is_program(const ocssd_io *io) {
+		return io->opcode == WRITE_BLOCK_REQUEST ||
+			io->opcode == ERASE_BLOCK_REQUEST;
+	}
+	static bool is_test(const ocssd_io *io) {
+		return io->opcode == TEST_BLOCK_REQUEST;
+	}
+	bool can_program(const ocssd_io *io);
+	bool can_test() const;
+	void start_program(const ocssd_io *io, int delta);
+	int sched_class(const ocssd_io *io) const;
+	int channel_distance(uint64_t mask) const;
+	uint64_t start_tag(const ocssd_io *io) const;
+	void charge(const ocssd_io *io, uint64_t start);
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+
+	/* I/Os submitted and not handed to their port yet */
+	int outstanding_;
+	std::condition_variable idle_;
+
+	/* Waiting I/Os of each target, in submission order */
+	std::map<ocssd_io_target *, std::deque<ocssd_io *>> pending_;
+	std::set<ocssd_io_target *> busy_;
+	std::vector<std::thread> workers_;
+	bool stop_;
+	uint64_t seq_;
+
+	/* Programs in flight, per LUN and in total, and tests */
+	std::map<uint32_t, int> lun_programs_;
+	int programs_;
+	int tests_;
+	int next_channel_;
+
+	/* Fair queuing: virtual time, and the finish time of each tenant */
+	uint64_t vclock_;
+	std::map<uint32_t, uint64_t> finish_;
+
+	/* I/Os submitted and not completed, per channel */
+	void account(ocssd_io *io, int delta);
+	std::atomic<int> depth_[64];
+	std::atomic<uint64_t> channel_mask_;
+};
+
+class ocssd_io_engine {
+public:
+	ocssd_io_engine(int workers_per_device = 4)
+		: workers_per_device_(workers_per_device) {}
+	~ocssd_io_engine();
+
+	int submit(const std::string &device, ocssd_io *io);
+	void dump_stats(std::string &out);
+
+	/* Wait until every I/O submitted so far is in its port */
+	void drain();
+
+private:
+	ocssd_io_engine(const ocssd_io_engine &);
+	ocssd_io_engine & operator=(const ocssd_io_engine &);
+
+	int workers_per_device_;
+	std::mutex mutex_;
+	std::map<std::string, ocssd_io_queue *> queues_;
+};
+
+ocssd_io_queue::ocssd_io_queue(int num_workers, int numa_node)
+	: outstanding_(0), stop_(false), seq_(0), programs_(0), tests_(0),
+	next_channel_(0), vclock_(0), channel_mask_(0)
+{
+	cpu_set_t cpus;
+	bool pin = numa_node_cpus(numa_node, &cpus);
+
+	for (auto &depth : depth_)
+		depth.store(0, std::memory_order_relaxed);
+
+	/* DMA and the copies out of the device buffers stay on the node */
+	for (int i = 0; i < num_workers; i++) {
+		workers_.push_back(std::thread(&ocssd_io_queue::run, this));
+		if (pin && pthread_setaffinity_np(workers_.back().native_handle(),
+						sizeof(cpus), &cpus))
+			printf("%s: failed to pin worker to node %d\n", __func__,
+				numa_node);
+	}
+}
+
+ocssd_io_queue::~ocssd_io_queue()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+
+	cond_.notify_all();
+	for (auto &worker : workers_)
+		worker.join();
+}
+
+void ocssd_io_queue::account(ocssd_io *io, int delta)
+{
+	uint64_t mask = io->target->get_channel_mask();
+
+	if (delta > 0)
+		channel_mask_.fetch_or(mask, std::memory_order_relaxed);
+
+	for (int ch = 0; mask; ch++, mask >>= 1) {
+		if (mask & 1)
+			depth_[ch].fetch_add(delta, std::memory_order_relaxed);
+	}
+}
+
+void ocssd_io_queue::dump_stats(std::string &out, const std::string &device)
+{
+	uint64_t mask = channel_mask_.load(std::memory_order_relaxed);
+	char line[256];
+
+	for (int ch = 0; mask; ch++, mask >>= 1) {
+		if (!(mask & 1))
+			continue;
+
+		snprintf(line, sizeof(line),
+			"ocssd_queue_depth{device=\"%s\",channel=\"%d\"} %d\n",
+			device.c_str(), ch, depth_[ch].load(std::memory_order_relaxed));
+		out += line;
+	}
+}
+
+void ocssd_io_queue::submit(ocssd_io *io)
+{
+	account(io, 1);
+
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		io->seq = seq_++;
+		pending_[io->target].push_back(io);
+		outstanding_++;
+	}
+
+	cond_.notify_one();
+}
+
+void ocssd_io_queue::drain()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (outstanding_)
+		idle_.wait(lock);
+}
+
+/* Called with mutex_ held */
+bool ocssd_io_queue::can_program(const ocssd_io *io)
+{
+	if (workers_.size() > 1 && programs_ + tests_ >= (int)workers_.size() - 1)
+		return false;
+
+	for (uint32_t lun : io->target->get_luns()) {
+		auto it = lun_programs_.find(lun);
+
+		if (it != lun_programs_.end() && it->second >= SCHED_PROGRAMS_PER_LUN)
+			return false;
+	}
+
+	return true;
+}
+
+/* Called with mutex_ held */
+bool ocssd_io_queue::can_test() const
+{
+	int workers = workers_.size();
+
+	if (workers > 1 && programs_ + tests_ >= workers - 1)
+		return false;
+
+	return tests_ < std::max(1, (workers - 1) / 2);
+}
+
+/* Called with mutex_ held */
+void ocssd_io_queue::start_program(const ocssd_io *io, int delta)
+{
+	programs_ += delta;
+	for (uint32_t lun : io->target->get_luns()) {
+		int &count = lun_programs_[lun];
+
+		count += delta;
+		if (count == 0)
+			lun_programs_.erase(lun);
+	}
+}
+
+/* 0 for reads and checks, 1 for programs, 2 for tests, less the waiting */
+int ocssd_io_queue::sched_class(const ocssd_io *io) const
+{
+	int cls = is_test(io) ? 2 : is_program(io) ? 1 : 0;
+	uint64_t moves = (seq_ - io->seq - 1) / SCHED_MAX_BYPASS;
+
+	return moves >= (uint64_t)cls ? 0 : cls - (int)moves;
+}
+
+/* How many channels past next_channel_ the target's first one is */
+int ocssd_io_queue::channel_distance(uint64_t mask) const
+{
+	uint64_t rotated = next_channel_ ?
+		(mask >> next_channel_) | (mask << (64 - next_channel_)) : mask;
+
+	return rotated ? __builtin_ctzll(rotated) : 64;
+}
+
+/* Virtual time the tenant's next I/O starts at. Called with mutex_ held */
+uint64_t ocssd_io_queue::start_tag(const ocssd_io *io) const
+{
+	auto it = finish_.find(io->tenant);
+
+	return it == finish_.end() ? vclock_ : std::max(vclock_, it->second);
+}
+
+/* Advance the tenant past a dispatched I/O. Called with mutex_ held */
+void ocssd_io_queue::charge(const ocssd_io *io, uint64_t start)
+{
+	uint64_t cost = io->opcode == READ_BLOCK_REQUEST ||
+			io->opcode == WRITE_BLOCK_REQUEST ? io->count : SCHED_ERASE_COST;
+
+	finish_[io->tenant] = start + cost / std::max(io->weight, 1U) + 1;
+	vclock_ = std::max(vclock_, start);
+}
+
+/* The I/O to run next, see the class comment. Called with mutex_ held */
+ocssd_io *ocssd_io_queue::next_io()
+{
+	ocssd_io *best = NULL;
+	int best_class = 0;
+	uint64_t best_start = 0;
+	int best_dist = 0;
+
+	for (auto &it : pending_) {
+		if (busy_.count(it.first))
+			continue;
+
+		/* Only the oldest I/O of a target may run */
+		ocssd_io *io = it.second.front();
+		int cls = sched_class(io);
+		uint64_t start = start_tag(io);
+		int dist = channel_distance(io->target->get_channel_mask());
+
+		if (is_program(io) && !can_program(io))
+			continue;
+		if (is_test(io) && !can_test())
+			continue;
+
+		if (best) {
+			if (best_class != cls) {
+				if (cls > best_class)
+					continue;
+			} else if (start != best_start) {
+				if (start > best_start)
+					continue;
+			} else if (dist > best_dist ||
+					(dist == best_dist && io->seq > best->seq)) {
+				continue;
+			}
+		}
+
+		best = io;
+		best_class = cls;
+		best_start = start;
+		best_dist = dist;
+	}
+
+	if (!best)
+		return NULL;
+
+	auto it = pending_.find(best->target);
+	it->second.pop_front();
+	if (it->second.empty())
+		pending_.erase(it);
+
+	busy_.insert(best->target);
+	if (is_program(best))
+		start_program(best, 1);
+	else if (is_test(best))
+		tests_++;
+	charge(best, best_start);
+	next_channel_ = (next_channel_ + best_dist + 1) % 64;
+
+	return best;
+}
+
+void ocssd_io_queue::execute(ocssd_io *io)
+{
+	errno = 0;
+
+	switch (io->opcode) {
+	case READ_BLOCK_REQUEST:
+		if (io->iov.empty()) {
+			io->result = io->target->pread(io->buf, io->count, io->offset);
+			break;
+		}
+
+		io->result = 0;
+		for (const struct iovec &seg : io->iov) {
+			ssize_t ret = io->target->pread(seg.iov_base, seg.iov_len,
+						io->offset + io->result);
+			if (ret < 0) {
+				io->result = ret;
+				break;
+			}
+			io->result += ret;
+		}
+		break;
+	case WRITE_BLOCK_REQUEST:
+		io->result = io->target->write(io->buf, io->count);
+		break;
+	case ERASE_BLOCK_REQUEST:
+		io->result = io->target->erase();
+		break;
+	case TEST_BLOCK_REQUEST:
+		io->result = io->target->test();
+		break;
+	case CHECK_BLOCK_REQUEST:
+		io->result = io->target->find_pos_write();
+		break;
+	default:
+		io->result = -1;
+		errno = EINVAL;
+		break;
+	}
+
+	io->error = io->result < 0 ? (errno ? errno : EIO) : 0;
+}
+
+void ocssd_io_queue::run()
+{
+	while (true) {
+		ocssd_io *io;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			while (!stop_ && !(io = next_io()))
+				cond_.wait(lock);
+
+			if (stop_)
+				return;
+		}
+
+		execute(io);
+		account(io, -1);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			busy_.erase(io->target);
+			if (is_program(io))
+				start_program(io, -1);
+			else if (is_test(io))
+				tests_--;
+		}
+
+		/* The next I/O on this target may be waiting for us */
+		cond_.notify_all();
+		io->port->complete(io);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (--outstanding_ == 0)
+				idle_.notify_all();
+		}
+	}
+}
+
+ocssd_io_engine::~ocssd_io_engine()
+{
+	for (auto &it : queues_)
+		delete it.second;
+}
+
+int ocssd_io_engine::submit(const std::string &device, ocssd_io *io)
+{
+	ocssd_io_queue *queue;
+
+	{
+		MutexLock lock(&mutex_);
+		auto it = queues_.find(device);
+
+		if (it == queues_.end()) {
+			queue = new ocssd_io_queue(workers_per_device_,
+						device_numa_node(device));
+			queues_[device] = queue;
+		} else {
+			queue = it->second;
+		}
+	}
+
+	queue->submit(io);
+	return 0;
+}
+
+void ocssd_io_engine::drain()
+{
+	std::vector<ocssd_io_queue *> queues;
+
+	{
+		MutexLock lock(&mutex_);
+
+		for (auto &it : queues_)
+			queues.push_back(it.second);
+	}
+
+	for (ocssd_io_queue *queue : queues)
+		queue->drain();
+}
+
+void ocssd_io_engine::dump_stats(std::string &out)
+{
+	MutexLock lock(&mutex_);
+
+	for (auto &it : queues_)
+		it.second->dump_stats(out, it.first);
+}
+
+ocssd_io_port::ocssd_io_port(struct event_base *base)
+	: base_(base)
+{
+	efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd_ < 0)
+		throw std::runtime_error("Error: eventfd failed\n");
+
+	event_set(&ev_complete_, efd_, EV_READ|EV_PERSIST, on_complete, this);
+	event_base_set(base_, &ev_complete_);
+	event_add(&ev_complete_, NULL);
+}
+
+ocssd_io_port::~ocssd_io_port()
+{
+	event_del(&ev_complete_);
+	close(efd_);
+}
+
+void ocssd_io_port::complete(ocssd_io *io)
+{
+	uint64_t one = 1;
+
+	{
+		MutexLock lock(&mutex_);
+		completed_.push_back(io);
+	}
+
+	if (write(efd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		printf("%s: eventfd write failed: %s\n", __func__, strerror(errno));
+}
+
+void ocssd_io_port::on_complete(int fd, short ev, void *arg)
+{
+	ocssd_io_port *port = static_cast<ocssd_io_port *>(arg);
+
+	port->reap();
+}
+
+size_t ocssd_io_port::reap()
+{
+	std::deque<ocssd_io *> completed;
+	uint64_t count;
+
+	if (read(efd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		printf("%s: eventfd read failed: %s\n", __func__, strerror(errno));
+
+	{
+		MutexLock lock(&mutex_);
+		completed.swap(completed_);
+	}
+
+	for (ocssd_io *io : completed)
+		io->handler->io_complete(io);
+
+	return completed.size();
+}
+
+#endif
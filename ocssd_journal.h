@@ -0,0 +1,277 @@
+#ifndef OCSSD_JOURNAL_H
+#define OCSSD_JOURNAL_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+
+/*
+ * Metadata journal of the manager.
+ *
+ * State lives in two files: a checkpoint holding a full snapshot, and a
+ * log of the changes made since. Both are a sequence of records:
+ *
+ * JOURNAL_MAGIC		4 bytes
+ * TYPE				4 bytes
+ * LENGTH			4 bytes
+ * CRC32			4 bytes		Over TYPE, LENGTH and the payload
+ * PAYLOAD			LENGTH bytes
+ *
+ * A checkpoint is written to a temporary file and renamed over the old
+ * one, then the log is emptied. Records must be idempotent: a crash
+ * between the two steps replays the log over a checkpoint that already
+ * contains it. Replay stops at the first torn or corrupt record of the
+ * log, and the log is cut there.
+ */
+
+const uint32_t JOURNAL_MAGIC = 0x6603;
+const size_t JOURNAL_RECORD_HEADER_SIZE = 16;
+
+struct journal_crc32_table {
+	journal_crc32_table() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			entries[i] = c;
+		}
+	}
+
+	uint32_t entries[256];
+};
+
+static inline uint32_t journal_crc32(uint32_t crc, const char *data, size_t len)
+{
+	/* Built once, the stage logs and the reactors race to the first call */
+	static const journal_crc32_table table;
+
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++)
+		crc = table.entries[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+class ocssd_journal {
+public:
+	typedef std::function<void(uint32_t type, const char *data, size_t len)> apply_fn;
+
+	ocssd_journal(const std::string &path)
+		: log_path_(path + ".log"), ckpt_path_(path + ".ckpt"), log_size_(0)
+	{
+		log_fd_ = open(log_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (log_fd_ < 0)
+			throw std::runtime_error("Error: open journal failed\n");
+	}
+
+	~ocssd_journal() {
+		close(log_fd_);
+	}
+
+	/* Feed the checkpoint, then the log, to apply */
+	int replay(apply_fn apply);
+
+	int append(uint32_t type, const std::string &payload, bool sync);
+
+	/* Replace all state with records, and empty the log */
+	int checkpoint(const std::vector<std::pair<uint32_t, std::string>> &records);
+
+	size_t get_log_size() const {return log_size_;}
+
+private:
+	ocssd_journal(const ocssd_journal &);
+	ocssd_journal & operator=(const ocssd_journal &);
+
+	static void encode(std::string &out, uint32_t type, const std::string &payload);
+	static size_t replay_file(int fd, apply_fn apply);
+	static int write_full(int fd, const char *buf, size_t count);
+	static int sync_dir(const std::string &path);
+
+	std::string log_path_;
+	std::string ckpt_path_;
+	int log_fd_;
+	size_t log_size_;
+};
+
+void ocssd_journal::encode(std::string &out, uint32_t type, const std::string &payload)
+{
+	char header[JOURNAL_RECORD_HEADER_SIZE];
+	uint32_t len = payload.size();
+	uint32_t crc;
+
+	memcpy(header, &JOURNAL_MAGIC, 4);
+	memcpy(header + 4, &type, 4);
+	memcpy(header + 8, &len, 4);
+	crc = journal_crc32(0, header + 4, 8);
+	crc = journal_crc32(crc, payload.data(), len);
+	memcpy(header + 12, &crc, 4);
+
+	out.append(header, JOURNAL_RECORD_HEADER_SIZE);
+	out.append(payload);
+}
+
+int ocssd_journal::write_full(int fd, const char *buf, size_t count)
+{
+	while (count > 0) {
+		ssize_t ret = write(fd, buf, count);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		count -= ret;
+	}
+
+	return 0;
+}
+
+/* Make a rename into the directory of path durable */
+int ocssd_journal::sync_dir(const std::string &path)
+{
+	size_t slash = path.find_last_of('/');
+	std::string dir = slash == std::string::npos ? "." :
+		slash == 0 ? "/" : path.substr(0, slash);
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int ret = 0;
+
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/* Returns the length of the valid prefix of the file */
+size_t ocssd_journal::replay_file(int fd, apply_fn apply)
+{
+	struct stat st;
+	size_t valid = 0;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		return 0;
+
+	std::vector<char> buf(st.st_size);
+	if (pread(fd, buf.data(), buf.size(), 0) != (ssize_t)buf.size())
+		return 0;
+
+	while (valid + JOURNAL_RECORD_HEADER_SIZE <= buf.size()) {
+		const char *p = buf.data() + valid;
+		uint32_t magic, type, len, crc;
+
+		memcpy(&magic, p, 4);
+		memcpy(&type, p + 4, 4);
+		memcpy(&len, p + 8, 4);
+		memcpy(&crc, p + 12, 4);
+
+		if (magic != JOURNAL_MAGIC ||
+				valid + JOURNAL_RECORD_HEADER_SIZE + len > buf.size())
+			break;
+
+		const char *payload = p + JOURNAL_RECORD_HEADER_SIZE;
+		if (journal_crc32(journal_crc32(0, p + 4, 8), payload, len) != crc)
+			break;
+
+		apply(type, payload, len);
+		valid += JOURNAL_RECORD_HEADER_SIZE + len;
+	}
+
+	return valid;
+}
+
+int ocssd_journal::replay(apply_fn apply)
+{
+	int ckpt_fd = open(ckpt_path_.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (ckpt_fd >= 0) {
+		replay_file(ckpt_fd, apply);
+		close(ckpt_fd);
+	}
+
+	log_size_ = replay_file(log_fd_, apply);
+
+	/* Drop a torn tail, new records go right after the last good one */
+	if (ftruncate(log_fd_, log_size_) < 0 ||
+			lseek(log_fd_, log_size_, SEEK_SET) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int ocssd_journal::append(uint32_t type, const std::string &payload, bool sync)
+{
+	std::string record;
+	int ret;
+
+	encode(record, type, payload);
+	ret = write_full(log_fd_, record.data(), record.size());
+	if (ret < 0) {
+		printf("%s: journal write failed: %s\n", __func__, strerror(-ret));
+		return ret;
+	}
+
+	log_size_ += record.size();
+	if (sync && fdatasync(log_fd_) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int ocssd_journal::checkpoint(const std::vector<std::pair<uint32_t, std::string>> &records)
+{
+	std::string tmp_path = ckpt_path_ + ".tmp";
+	std::string data;
+	int ret = 0;
+
+	for (const auto &record : records)
+		encode(data, record.first, record.second);
+
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	ret = write_full(fd, data.data(), data.size());
+	if (!ret && fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+
+	if (!ret && rename(tmp_path.c_str(), ckpt_path_.c_str()) < 0)
+		ret = -errno;
+
+	if (ret) {
+		printf("%s: checkpoint failed: %s\n", __func__, strerror(-ret));
+		unlink(tmp_path.c_str());
+		return ret;
+	}
+
+	/*
+	 * The rename must reach the disk before the truncation does, or a
+	 * crash could bring the old checkpoint back with an empty log. The
+	 * log is kept if that is not certain, replaying it twice is safe.
+	 */
+	ret = sync_dir(ckpt_path_);
+	if (ret) {
+		printf("%s: directory sync failed: %s\n", __func__, strerror(-ret));
+		return ret;
+	}
+
+	/* The checkpoint holds everything in the log now */
+	if (ftruncate(log_fd_, 0) < 0 || lseek(log_fd_, 0, SEEK_SET) < 0 ||
+			fdatasync(log_fd_) < 0)
+		return -errno;
+
+	log_size_ = 0;
+	return 0;
+}
+
+#endif
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 /* For inet_ntoa. */
@@ -45,9 +46,13 @@
 #include <errno.h>
 #include <signal.h>
 #include <err.h>
+#include <pthread.h>
+#include <sched.h>
 #include <iostream>
 #include <deque>
-#include <boost/filesystem.hpp>
+#include <set>
+#include <vector>
+#include <thread>
 
 /* Libevent. */
 #include <event.h>
@@ -60,12 +65,29 @@
  * of data we try to read per call to read(2). */
 #define BUFLEN 1024
 
-struct event_base *base;
+/*
+ * Each reactor is one event loop thread pinned to a core, with its own
+ * listening socket on the shared port (the kernel spreads new
+ * connections over them with SO_REUSEPORT), its own completion port
+ * and its own set of connections. Reactors only share the OCSSD
+ * manager and the device queues of the I/O engine.
+ */
+struct ocssd_reactor {
+	int id;
+	int cpu;
+	std::thread thread;
+	struct event_base *base;
+	ocssd_io_port *port;
+	ocssd_buffer_pool *pool;
+	int listen_fd;
+	int stop_fd;
+	struct event ev_accept;
+	struct event ev_stop;
+	std::set<ocssd_conn *> conns;
+};
 
-void interrupt(int signum) {
-	printf("%s\n", __func__);
-	event_base_loopbreak(base);
-}
+/* The reactor running on this thread */
+static thread_local ocssd_reactor *this_reactor;
 
 static void addsig(int sig, void (*handler)(int), bool restart)
 {
@@ -79,28 +101,12 @@ static void addsig(int sig, void (*handler)(int), bool restart)
 }
 
 ocssd_manager *manager;
+ocssd_io_engine *engine;
+ocssd_stats *stats;
+ocssd_publisher *publisher;
+ocssd_stage_log *stage_log;
 
-static int publish_resource(ocssd_manager *manager)
-{
-	const std::vector<ocssd_unit *> & ocssds = manager->get_units();
-
-	for (auto unit : ocssds) {
-		size_t shared = 0;
-		size_t exclusive = 0;
-		size_t blocks = 0;
-		int ret;
-
-		ret = unit->get_ocssd_stats(shared, exclusive, blocks);
-
-		if (!ret)
-			ret = azure_insert_entity(unit->get_desc(),
-						shared, exclusive, blocks);
-	}
-
-	return ocssds.size();
-}
-
-static int initialize_ocssd_manager()
+static int initialize_ocssd_manager(const std::string &journal_path)
 {
 	manager = new ocssd_manager();
 	if (!manager)
@@ -112,16 +118,35 @@ static int initialize_ocssd_manager()
 	for (int i = 1; i < 2; i++) {
 		std::string path = "/dev/nvme" + std::to_string(i) + "n1";
 
-		if (!boost::filesystem::exists(path))
+		if (!ocssd_dev_exists(path))
 			continue;
 
 		manager->add_ocssd(path);
 	}
 
-	publish_resource(manager);
+	/* Allocations made before a restart are taken again */
+	if (manager->open_journal(journal_path) < 0)
+		printf("Journal %s unusable, allocations will not persist\n",
+			journal_path.c_str());
+
 	return 0;
 }
 
+/* Writes are staged only if the log can be opened */
+static void initialize_stage_log(const std::string &stage_path)
+{
+	try {
+		stage_log = new ocssd_stage_log(stage_path);
+	} catch (std::runtime_error &e) {
+		printf("Stage log %s unusable, writes must be write unit aligned\n",
+			stage_path.c_str());
+		return;
+	}
+
+	/* The tails of vSSDs released before the restart */
+	stage_log->prune(manager);
+}
+
 /**
  * Set a socket to non-blocking mode.
  */
@@ -140,6 +165,16 @@ setnonblock(int fd)
         return 0;
 }
 
+/**
+ * Forget a client, it is freed once its device I/O has drained.
+ */
+static void
+drop_client(ocssd_conn *client)
+{
+	this_reactor->conns.erase(client);
+	client->release();
+}
+
 /**
  * This function will be called by libevent when the client socket is
  * ready for reading.
@@ -149,7 +184,11 @@ on_read(int fd, short ev, void *arg)
 {
 	ocssd_conn *client = (ocssd_conn *)arg;
 
-	client->process_incoming_requests(fd);
+	/* Zero-copy completions wake us through the error queue */
+	client->reap_zerocopy();
+
+	if (client->process_incoming_requests(fd) < 0)
+		drop_client(client);
 #if 0
 	/* Because we are event based and need to be told when we can
 	 * write, we have to malloc the read buffer and put it on the
@@ -199,6 +238,21 @@ on_read(int fd, short ev, void *arg)
 #endif
 }
 
+/**
+ * Called when a client held back by its QoS limits may go on. The
+ * request that was held is still buffered, so process it right away
+ * rather than wait for more data on the socket.
+ */
+void
+on_throttle(int fd, short ev, void *arg)
+{
+	ocssd_conn *client = (ocssd_conn *)arg;
+
+	client->resume_throttled();
+	if (client->process_incoming_requests(fd) < 0)
+		drop_client(client);
+}
+
 /**
  * This function will be called by libevent when the client socket is
  * ready for writing.
@@ -208,21 +262,37 @@ on_write(int fd, short ev, void *arg)
 {
 	ocssd_conn *client = (ocssd_conn *)arg;
 	struct bufferq *bufferq;
+	struct iovec iov[16];
+	struct msghdr msg;
+	int flags;
 	int len;
 
+	client->reap_zerocopy();
+
 	/* Pull the first item off of the write queue. We probably
 	 * should never see an empty write queue, but make sure the
 	 * item returned is not NULL. */
+	if (client->writeq.empty())
+		return;
+
 	bufferq = client->writeq.front();
 	if (bufferq == NULL)
 		return;
 
 	/* Write the buffer.  A portion of the buffer may have been
 	 * written in a previous write, so only write the remaining
-	 * bytes. */
-        len = bufferq->len - bufferq->offset;
-	len = write(fd, bufferq->buf + bufferq->offset,
-                    bufferq->len - bufferq->offset);
+	 * bytes. Pooled device buffers are sent without copying. */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = bufferq->fill_iov(iov, 16);
+	flags = client->use_zerocopy(bufferq) ? MSG_ZEROCOPY : 0;
+
+	len = sendmsg(fd, &msg, flags);
+	if (len == -1 && errno == ENOBUFS && flags) {
+		/* Out of optmem for pinning pages, copy this time. */
+		flags = 0;
+		len = sendmsg(fd, &msg, flags);
+	}
 
 	if (len == -1) {
 		if (errno == EINTR || errno == EAGAIN) {
@@ -233,11 +303,18 @@ on_write(int fd, short ev, void *arg)
 			return;
 		}
 		else {
-			/* Some other socket error occurred, exit. */
-			err(1, "write");
+			/* Some other socket error occurred, drop the
+			 * client. */
+			warn("write");
+			drop_client(client);
+			return;
 		}
 	}
-	else if ((bufferq->offset + len) < bufferq->len) {
+
+	if (flags)
+		client->zerocopy_sent(bufferq);
+
+	if ((bufferq->offset + len) < bufferq->len) {
 		/* Not all the data was written, update the offset and
 		 * reschedule the write event. */
 		bufferq->offset += len;
@@ -248,7 +325,7 @@ on_write(int fd, short ev, void *arg)
 	/* The data was completely written, remove the buffer from the
 	 * write queue. */
 	client->writeq.pop_front();
-	delete bufferq;
+	client->retire(bufferq);
 
 	if (client->writeq.size() > 0)
 		event_add(&client->ev_write, NULL);
@@ -265,7 +342,7 @@ on_accept(int fd, short ev, void *arg)
 	struct sockaddr_in client_addr;
 	socklen_t client_len = sizeof(client_addr);
 	ocssd_conn *client;
-	ocssd_manager *manager = static_cast<ocssd_manager *>(arg);
+	ocssd_reactor *reactor = static_cast<ocssd_reactor *>(arg);
 
 	/* Accept the new connection. */
 	client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
@@ -280,17 +357,20 @@ on_accept(int fd, short ev, void *arg)
 
 	/* We've accepted a new client, allocate a client object to
 	 * maintain the state of this client. */
-	client = new ocssd_conn(manager, client_fd, client_addr);
+	client = new ocssd_conn(manager, engine, reactor->port, reactor->pool,
+				stats, publisher, stage_log, client_fd, client_addr);
 	if (client == NULL)
 		err(1, "malloc failed");
 
+	reactor->conns.insert(client);
+
 	/* Setup the read event, libevent will call on_read() whenever
 	 * the clients socket becomes read ready.  We also make the
 	 * read event persistent so we don't have to re-add after each
 	 * read. */
 	event_set(&client->ev_read, client_fd, EV_READ|EV_PERSIST, on_read, 
 	    client);
-	event_base_set(base, &client->ev_read);
+	event_base_set(reactor->base, &client->ev_read);
 
 	/* Setting up the event does not activate, add the event so it
 	 * becomes active. */
@@ -299,76 +379,331 @@ on_accept(int fd, short ev, void *arg)
 	/* Create the write event, but don't add it until we have
 	 * something to write. */
 	event_set(&client->ev_write, client_fd, EV_WRITE, on_write, client);
-	event_base_set(base, &client->ev_write);
+	event_base_set(reactor->base, &client->ev_write);
 
-	printf("Accepted connection from %s\n",
+	/* Armed only while the client is over its QoS limits */
+	event_set(&client->ev_throttle, client_fd, 0, on_throttle, client);
+	event_base_set(reactor->base, &client->ev_throttle);
+
+	printf("Reactor %d accepted connection from %s\n", reactor->id,
                inet_ntoa(client_addr.sin_addr));
 }
 
-int
-main(int argc, char **argv)
+/**
+ * Called on the reactor thread when main asks it to stop.
+ */
+void
+on_stop(int fd, short ev, void *arg)
 {
-	int listen_fd;
-	struct sockaddr_in listen_addr;
-	int reuseaddr_on = 1;
-	int ret = 0;
-
-	/* The socket accept event. */
-	struct event ev_accept;
-
-	base = event_base_new();
-	if (!base)
-		return -ENOMEM;
-
-	ret = initialize_ocssd_manager();
-	if (ret) {
-		printf("OCSSD manager init failed\n");
-		event_base_free(base);
-		return ret;
-	}
+	ocssd_reactor *reactor = static_cast<ocssd_reactor *>(arg);
 
-	addsig(SIGINT, interrupt, false);
+	event_base_loopbreak(reactor->base);
+}
 
-	/* Initialize libevent. */
-	event_init();
+static int
+create_listen_socket(int port)
+{
+	int listen_fd;
+	struct sockaddr_in listen_addr;
+	int reuse_on = 1;
 
-	/* Create our listening socket. This is largely boiler plate
-	 * code that I'll abstract away in the future. */
+	/* Every reactor binds its own socket to the same port, the
+	 * kernel balances incoming connections across them. */
 	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0)
 		err(1, "listen failed");
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, 
-		sizeof(reuseaddr_on)) == -1)
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_on,
+		sizeof(reuse_on)) == -1)
 		err(1, "setsockopt failed");
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_on,
+		sizeof(reuse_on)) == -1)
+		err(1, "setsockopt SO_REUSEPORT failed");
 	memset(&listen_addr, 0, sizeof(listen_addr));
 	listen_addr.sin_family = AF_INET;
 	listen_addr.sin_addr.s_addr = INADDR_ANY;
-	listen_addr.sin_port = htons(OCSSD_MESSAGE_PORT);
+	listen_addr.sin_port = htons(port);
 	if (bind(listen_fd, (struct sockaddr *)&listen_addr,
 		sizeof(listen_addr)) < 0)
 		err(1, "bind failed");
-	if (listen(listen_fd, 5) < 0)
+	if (listen(listen_fd, 128) < 0)
 		err(1, "listen failed");
 
-	std::cout << "Listening on port " << OCSSD_MESSAGE_PORT << "..." << std::endl;
-
 	/* Set the socket to non-blocking, this is essential in event
 	 * based programming with libevent. */
 	if (setnonblock(listen_fd) < 0)
 		err(1, "failed to set server socket to non-blocking");
 
+	return listen_fd;
+}
+
+/*
+ * The admin endpoint: every connection to the Unix socket gets one
+ * text dump of the stats, then it is closed.
+ */
+static int
+create_admin_socket(const std::string &path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	unlink(path.c_str());
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+run_admin(int listen_fd)
+{
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		std::string out;
+
+		if (fd < 0) {
+			/* Shut down by main */
+			if (errno == EINVAL || errno == EBADF)
+				break;
+			continue;
+		}
+
+		stats->dump(out);
+		engine->dump_stats(out);
+
+		for (size_t sent = 0; sent < out.size(); ) {
+			ssize_t ret = write(fd, out.data() + sent, out.size() - sent);
+
+			if (ret <= 0)
+				break;
+			sent += ret;
+		}
+
+		close(fd);
+	}
+}
+
+static void
+run_reactor(ocssd_reactor *reactor)
+{
+	cpu_set_t cpuset;
+
+	this_reactor = reactor;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(reactor->cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+		warnx("reactor %d: failed to pin to cpu %d", reactor->id, reactor->cpu);
+
+	/* Populated from here, so the pages land on the reactor's node */
+	reactor->pool = new ocssd_buffer_pool(POOL_CHUNK_SIZE, POOL_NUM_CHUNKS);
+
 	/* We now have a listening socket, we create a read event to
 	 * be notified when a client connects. */
-	event_set(&ev_accept, listen_fd, EV_READ|EV_PERSIST, on_accept, manager);
-	event_base_set(base, &ev_accept);
-	event_add(&ev_accept, NULL);
+	event_set(&reactor->ev_accept, reactor->listen_fd, EV_READ|EV_PERSIST,
+		on_accept, reactor);
+	event_base_set(reactor->base, &reactor->ev_accept);
+	event_add(&reactor->ev_accept, NULL);
+
+	event_set(&reactor->ev_stop, reactor->stop_fd, EV_READ, on_stop, reactor);
+	event_base_set(reactor->base, &reactor->ev_stop);
+	event_add(&reactor->ev_stop, NULL);
 
 	/* Start the libevent event loop. */
-	event_base_dispatch(base);
+	event_base_dispatch(reactor->base);
+
+	event_del(&reactor->ev_accept);
+	close(reactor->listen_fd);
+
+	for (ocssd_conn *client : reactor->conns)
+		client->release();
+	reactor->conns.clear();
+}
+
+static ocssd_reactor *
+start_reactor(int id, int cpu)
+{
+	ocssd_reactor *reactor = new ocssd_reactor;
+
+	reactor->id = id;
+	reactor->cpu = cpu;
+	reactor->base = event_base_new();
+	if (!reactor->base)
+		err(1, "event_base_new failed");
+
+	reactor->port = new ocssd_io_port(reactor->base);
+	reactor->pool = NULL;
+	reactor->listen_fd = create_listen_socket(OCSSD_MESSAGE_PORT);
+	reactor->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->stop_fd < 0)
+		err(1, "eventfd failed");
+
+	reactor->thread = std::thread(run_reactor, reactor);
+	return reactor;
+}
+
+static void
+stop_reactor(ocssd_reactor *reactor)
+{
+	uint64_t one = 1;
+
+	if (write(reactor->stop_fd, &one, sizeof(one)) < 0)
+		warn("failed to stop reactor %d", reactor->id);
+
+	reactor->thread.join();
+}
+
+static void
+free_reactor(ocssd_reactor *reactor)
+{
+	delete reactor->port;
+	delete reactor->pool;
+	event_del(&reactor->ev_stop);
+	close(reactor->stop_fd);
+	event_base_free(reactor->base);
+	delete reactor;
+}
+
+int
+main(int argc, char **argv)
+{
+	int num_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_cpus = num_reactors;
+	std::string journal_path = "ocssd_journal";
+	std::string stage_path;
+	std::string admin_path = "ocssd_admin.sock";
+	std::string publish_spec = "azure";
+	ocssd_publish_backend *backend;
+	std::thread admin;
+	int admin_fd;
+	std::vector<ocssd_reactor *> reactors;
+	sigset_t sigset;
+	int sig;
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "r:j:s:a:p:")) != -1) {
+		switch (opt) {
+		case 'r':
+			num_reactors = atoi(optarg);
+			break;
+		case 'j':
+			journal_path = optarg;
+			break;
+		case 's':
+			stage_path = optarg;
+			break;
+		case 'a':
+			admin_path = optarg;
+			break;
+		case 'p':
+			publish_spec = optarg;
+			break;
+		default:
+			printf("usage: %s [-r reactors] [-j journal] [-s stage log] "
+				"[-a admin socket] [-p azure|file:<path>|none]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_reactors <= 0 || num_cpus <= 0)
+		num_reactors = num_cpus = 1;
+
+	if (stage_path.empty())
+		stage_path = journal_path + "_stage";
+
+	backend = new_publish_backend(publish_spec);
+	if (!backend) {
+		printf("Unknown publish backend %s\n", publish_spec.c_str());
+		return 1;
+	}
+
+	ret = initialize_ocssd_manager(journal_path);
+	if (ret) {
+		printf("OCSSD manager init failed\n");
+		return ret;
+	}
+
+	initialize_stage_log(stage_path);
+	publisher = new ocssd_publisher(manager, backend);
+	engine = new ocssd_io_engine();
+	stats = new ocssd_stats();
+
+	/* Signals are taken by main only, the reactor threads inherit
+	 * the blocked mask. */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	addsig(SIGPIPE, SIG_IGN, false);
+
+	for (int i = 0; i < num_reactors; i++)
+		reactors.push_back(start_reactor(i, i % num_cpus));
+
+	admin_fd = create_admin_socket(admin_path);
+	if (admin_fd < 0)
+		printf("Admin socket %s failed: %s\n", admin_path.c_str(),
+			strerror(errno));
+	else
+		admin = std::thread(run_admin, admin_fd);
+
+	std::cout << "Listening on port " << OCSSD_MESSAGE_PORT << " with "
+		  << num_reactors << " reactors..." << std::endl;
+
+	sigwait(&sigset, &sig);
+	printf("%s: signal %d\n", __func__, sig);
+
+	if (admin_fd >= 0) {
+		shutdown(admin_fd, SHUT_RDWR);
+		admin.join();
+		close(admin_fd);
+		unlink(admin_path.c_str());
+	}
 
-	event_base_free(base);
+	for (ocssd_reactor *reactor : reactors)
+		stop_reactor(reactor);
+
+	/*
+	 * A closed connection with device I/O in flight is only freed by
+	 * the last of its completions, and a completion may submit more
+	 * I/O, as an erase does its stage record. The loops are gone, so
+	 * deliver them from here until none are left.
+	 */
+	size_t delivered;
+	do {
+		engine->drain();
+		delivered = 0;
+		for (ocssd_reactor *reactor : reactors)
+			delivered += reactor->port->reap();
+	} while (delivered);
+
+	/* Device workers complete into the reactor ports, stop them
+	 * before the ports go away. */
+	delete engine;
+
+	for (ocssd_reactor *reactor : reactors)
+		free_reactor(reactor);
+
+	/* Connections are gone, the last changes go out now */
+	delete publisher;
+
+	delete stage_log;
 	manager->persist();
 	delete manager;
+	delete stats;
 	printf("Exit\n");
 	return 0;
 }
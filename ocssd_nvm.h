@@ -0,0 +1,832 @@
+#ifndef OCSSD_NVM_H
+#define OCSSD_NVM_H
+
+#include <unistd.h>
+#include <string>
+
+/*
+ * The device API: liblightnvm against Open-Channel SSDs, or, built with
+ * OCSSD_EMULATOR (make EMULATOR=1), an emulation of the part of
+ * liblightnvm the server and the vblk tools use, so they run on any
+ * Linux box.
+ *
+ * The emulator keeps the nvm_geo hierarchy of channels, LUNs, planes,
+ * blocks, pages and sectors, and the rules of the media: a block is
+ * programmed page by page from its start, a page only once until the
+ * block is erased, and only written pages can be read. Every read,
+ * program and erase holds its LUN for a set time; commands on the same
+ * LUN queue behind each other, commands on different LUNs overlap, and
+ * the caller returns once the last LUN of its command is done. The
+ * timing only depends on the order of the commands, so runs repeat.
+ *
+ * It is set up from the environment, at the first nvm_dev_open():
+ * OCSSD_EMU_DEVICES	Device paths, comma separated (/dev/nvme1n1)
+ * OCSSD_EMU_GEO	channels:luns:planes:blocks:pages:sectors:sector bytes
+ *			(8:4:2:128:64:4:4096)
+ * OCSSD_EMU_LATENCY	read:program:erase in microseconds, per page read,
+ *			page programmed on all planes, and block (0:0:0)
+ * OCSSD_EMU_DIR	Keep the data and block states in sparse files in
+ *			this directory, so they survive a restart. In
+ *			memory if unset, allocated as blocks are written.
+ */
+
+#ifndef OCSSD_EMULATOR
+
+#include <liblightnvm.h>
+
+/* The device at path can be opened */
+static inline bool ocssd_dev_exists(const std::string &path)
+{
+	return access(path.c_str(), F_OK) == 0;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+
+struct nvm_geo {
+	size_t nchannels;
+	size_t nluns;
+	size_t nplanes;
+	size_t nblocks;
+	size_t npages;
+	size_t nsectors;
+	size_t page_nbytes;
+	size_t sector_nbytes;
+	size_t meta_nbytes;
+	size_t tbytes;
+	size_t vblk_nbytes;
+	size_t vpg_nbytes;
+};
+
+struct nvm_addr {
+	union {
+		struct {
+			uint64_t blk	: 16;
+			uint64_t pg	: 16;
+			uint64_t sec	: 8;
+			uint64_t pl	: 8;
+			uint64_t lun	: 8;
+			uint64_t ch	: 7;
+			uint64_t rsvd	: 1;
+		} g;
+
+		uint64_t ppa;
+	};
+};
+
+struct nvm_ret {
+	uint64_t result;
+	uint64_t status;
+};
+
+struct nvm_bbt {
+	struct nvm_dev *dev;
+	struct nvm_addr addr;
+	uint64_t nblks;
+	uint32_t nbad;
+	uint32_t ngbad;
+	uint32_t ndmrk;
+	uint32_t nhmrk;
+	uint8_t *blks;
+};
+
+enum nvm_bbt_state {
+	NVM_BBT_FREE = 0x0,
+	NVM_BBT_BAD = 0x1,
+	NVM_BBT_GBAD = 0x2,
+	NVM_BBT_DMRK = 0x4,
+	NVM_BBT_HMRK = 0x8,
+};
+
+enum nvm_flag_pmode {
+	NVM_FLAG_PMODE_SNGL = 0x0,
+	NVM_FLAG_PMODE_DUAL = 0x1,
+	NVM_FLAG_PMODE_QUAD = 0x2,
+};
+
+struct ocssd_emu_config {
+	std::vector<std::string> devices;
+	struct nvm_geo geo;
+	uint64_t read_ns;
+	uint64_t program_ns;
+	uint64_t erase_ns;
+	std::string dir;
+};
+
+static inline const char *emu_env(const char *name, const char *def)
+{
+	const char *value = getenv(name);
+
+	return value && *value ? value : def;
+}
+
+static inline const ocssd_emu_config &emu_config()
+{
+	static ocssd_emu_config config;
+	static std::once_flag once;
+
+	std::call_once(once, []() {
+		std::string devices = emu_env("OCSSD_EMU_DEVICES", "/dev/nvme1n1");
+		struct nvm_geo &geo = config.geo;
+		unsigned long read_us = 0, program_us = 0, erase_us = 0;
+
+		for (size_t start = 0; start < devices.size(); ) {
+			size_t end = std::min(devices.find(',', start), devices.size());
+
+			if (end > start)
+				config.devices.push_back(devices.substr(start, end - start));
+			start = end + 1;
+		}
+
+		memset(&geo, 0, sizeof(geo));
+		if (sscanf(emu_env("OCSSD_EMU_GEO", ""), "%lu:%lu:%lu:%lu:%lu:%lu:%lu",
+				&geo.nchannels, &geo.nluns, &geo.nplanes, &geo.nblocks,
+				&geo.npages, &geo.nsectors, &geo.sector_nbytes) != 7 ||
+				!geo.nchannels || !geo.nluns || !geo.nplanes ||
+				!geo.nblocks || !geo.npages || !geo.nsectors ||
+				!geo.sector_nbytes) {
+			geo.nchannels = 8;
+			geo.nluns = 4;
+			geo.nplanes = 2;
+			geo.nblocks = 128;
+			geo.npages = 64;
+			geo.nsectors = 4;
+			geo.sector_nbytes = 4096;
+		}
+
+		geo.page_nbytes = geo.nsectors * geo.sector_nbytes;
+		geo.meta_nbytes = 16;
+		geo.vpg_nbytes = geo.page_nbytes * geo.nplanes;
+		geo.vblk_nbytes = geo.vpg_nbytes * geo.npages;
+		geo.tbytes = geo.vblk_nbytes * geo.nblocks * geo.nluns * geo.nchannels;
+
+		sscanf(emu_env("OCSSD_EMU_LATENCY", ""), "%lu:%lu:%lu",
+			&read_us, &program_us, &erase_us);
+		config.read_ns = read_us * 1000;
+		config.program_ns = program_us * 1000;
+		config.erase_ns = erase_us * 1000;
+		config.dir = emu_env("OCSSD_EMU_DIR", "");
+	});
+
+	return config;
+}
+
+static inline bool ocssd_dev_exists(const std::string &path)
+{
+	const std::vector<std::string> &devices = emu_config().devices;
+
+	return std::find(devices.begin(), devices.end(), path) != devices.end();
+}
+
+/*
+ * One emulated drive, shared by every handle opened on its path. Blocks
+ * are numbered (channel, LUN, block) in order; a page of a block covers
+ * all of its planes, like a vblk write unit. The write pointers, in
+ * pages, and the bad block table are kept in one map, the data in
+ * another, each backed by a file or by memory.
+ */
+class ocssd_emu_device {
+public:
+	ocssd_emu_device(const std::string &path, const ocssd_emu_config &config);
+
+	const struct nvm_geo *get_geo() const {return &geo_;}
+
+	/* Block number of addr, -1 if it is out of range */
+	ssize_t block_index(const struct nvm_addr &addr) const;
+	size_t lun_index(const struct nvm_addr &addr) const {
+		return addr.g.ch * geo_.nluns + addr.g.lun;
+	}
+
+	/* Claim pages [first, first + count) for programming, in order */
+	int program(size_t blk, size_t first, size_t count);
+	/* Written pages only */
+	int check_read(size_t blk, size_t first, size_t count);
+	void erase(size_t blk);
+
+	/* Data at off within a block, after program() or check_read() */
+	void put(size_t blk, size_t off, const char *src, size_t len);
+	void get(size_t blk, size_t off, char *dst, size_t len);
+
+	struct nvm_bbt *get_bbt(const struct nvm_addr &addr);
+	void mark(size_t blk, size_t pl, uint8_t state);
+
+	/* Hold each LUN for its time, return once the last one is done */
+	void busy(const std::map<size_t, uint64_t> &lun_ns);
+
+private:
+	ocssd_emu_device(const ocssd_emu_device &);
+	ocssd_emu_device & operator=(const ocssd_emu_device &);
+
+	void *map_file(const std::string &path, size_t size, bool data);
+
+	struct nvm_geo geo_;
+	size_t nblks_;
+	size_t blk_nbytes_;
+
+	std::mutex mutex_;
+	uint32_t *wp_;		/* Pages written, per block */
+	uint8_t *bbt_;		/* Per block and plane */
+	char *data_;		/* NULL in memory, see blocks_ */
+	std::map<size_t, std::unique_ptr<char[]>> blocks_;
+	std::vector<uint64_t> lun_free_ns_;
+	std::vector<struct nvm_bbt> bbts_;
+};
+
+struct nvm_dev {
+	std::string path;
+	ocssd_emu_device *emu;
+};
+
+struct nvm_vblk {
+	struct nvm_dev *dev;
+	std::vector<struct nvm_addr> addrs;
+	size_t nbytes;
+	size_t pos_read;
+	size_t pos_write;
+};
+
+static inline uint64_t emu_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+ocssd_emu_device::ocssd_emu_device(const std::string &path,
+	const ocssd_emu_config &config)
+	: geo_(config.geo), data_(NULL),
+	lun_free_ns_(config.geo.nchannels * config.geo.nluns, 0),
+	bbts_(config.geo.nchannels * config.geo.nluns)
+{
+	size_t meta_nbytes;
+
+	nblks_ = geo_.nchannels * geo_.nluns * geo_.nblocks;
+	blk_nbytes_ = geo_.vblk_nbytes;
+	meta_nbytes = nblks_ * (sizeof(uint32_t) + geo_.nplanes);
+
+	if (config.dir.empty()) {
+		void *meta = mmap(NULL, meta_nbytes, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (meta == MAP_FAILED)
+			throw std::runtime_error("Error: emulator memory failed\n");
+		wp_ = (uint32_t *)meta;
+	} else {
+		std::string base = config.dir + "/" + path.substr(path.rfind('/') + 1);
+
+		wp_ = (uint32_t *)map_file(base + ".meta", meta_nbytes, false);
+		data_ = (char *)map_file(base + ".img", nblks_ * blk_nbytes_, true);
+	}
+	bbt_ = (uint8_t *)(wp_ + nblks_);
+
+	for (size_t i = 0; i < bbts_.size(); i++) {
+		bbts_[i].addr.ppa = 0;
+		bbts_[i].addr.g.ch = i / geo_.nluns;
+		bbts_[i].addr.g.lun = i % geo_.nluns;
+		bbts_[i].nblks = geo_.nblocks * geo_.nplanes;
+		bbts_[i].blks = bbt_ + i * bbts_[i].nblks;
+	}
+}
+
+/* Sparse, and kept across runs as long as the geometry does not change */
+void *ocssd_emu_device::map_file(const std::string &path, size_t size, bool data)
+{
+	struct stat st;
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+		throw std::runtime_error("Error: open emulator file failed\n");
+
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size != size &&
+			(ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0))) {
+		close(fd);
+		throw std::runtime_error("Error: size emulator file failed\n");
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("Error: map emulator file failed\n");
+
+	/* The data is only touched through copies, do not read ahead */
+	if (data)
+		madvise(map, size, MADV_RANDOM);
+	return map;
+}
+
+ssize_t ocssd_emu_device::block_index(const struct nvm_addr &addr) const
+{
+	if (addr.g.ch >= geo_.nchannels || addr.g.lun >= geo_.nluns ||
+			addr.g.blk >= geo_.nblocks)
+		return -1;
+
+	return (lun_index(addr) * geo_.nblocks) + addr.g.blk;
+}
+
+int ocssd_emu_device::program(size_t blk, size_t first, size_t count)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	/* Erase before write, and pages in order */
+	if (first != wp_[blk] || first + count > geo_.npages) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	wp_[blk] += count;
+	if (!data_ && !blocks_.count(blk))
+		blocks_[blk].reset(new char[blk_nbytes_]());
+	return 0;
+}
+
+int ocssd_emu_device::check_read(size_t blk, size_t first, size_t count)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (first + count > wp_[blk]) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+void ocssd_emu_device::erase(size_t blk)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	wp_[blk] = 0;
+	if (data_)
+		madvise(data_ + blk * blk_nbytes_, blk_nbytes_, MADV_REMOVE);
+	else
+		blocks_.erase(blk);
+}
+
+/* The block stays allocated until erased, copy outside the lock */
+void ocssd_emu_device::put(size_t blk, size_t off, const char *src, size_t len)
+{
+	char *base = data_ ? data_ + blk * blk_nbytes_ : NULL;
+
+	if (!base) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		base = blocks_[blk].get();
+	}
+
+	memcpy(base + off, src, len);
+}
+
+void ocssd_emu_device::get(size_t blk, size_t off, char *dst, size_t len)
+{
+	char *base = data_ ? data_ + blk * blk_nbytes_ : NULL;
+
+	if (!base) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		base = blocks_[blk].get();
+	}
+
+	memcpy(dst, base + off, len);
+}
+
+struct nvm_bbt *ocssd_emu_device::get_bbt(const struct nvm_addr &addr)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	struct nvm_bbt &bbt = bbts_[lun_index(addr)];
+
+	bbt.nbad = bbt.ngbad = bbt.ndmrk = bbt.nhmrk = 0;
+	for (size_t i = 0; i < bbt.nblks; i++) {
+		bbt.nbad += !!(bbt.blks[i] & NVM_BBT_BAD);
+		bbt.ngbad += !!(bbt.blks[i] & NVM_BBT_GBAD);
+		bbt.ndmrk += !!(bbt.blks[i] & NVM_BBT_DMRK);
+		bbt.nhmrk += !!(bbt.blks[i] & NVM_BBT_HMRK);
+	}
+
+	return &bbt;
+}
+
+void ocssd_emu_device::mark(size_t blk, size_t pl, uint8_t state)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	bbt_[blk * geo_.nplanes + pl] = state;
+}
+
+void ocssd_emu_device::busy(const std::map<size_t, uint64_t> &lun_ns)
+{
+	uint64_t now = emu_now_ns();
+	uint64_t done = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (auto &it : lun_ns) {
+			uint64_t &free_ns = lun_free_ns_[it.first];
+
+			free_ns = std::max(free_ns, now) + it.second;
+			done = std::max(done, free_ns);
+		}
+	}
+
+	if (done <= now)
+		return;
+
+	struct timespec ts;
+	ts.tv_sec = done / 1000000000;
+	ts.tv_nsec = done % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+struct nvm_dev *nvm_dev_open(const char *dev_path)
+{
+	static std::mutex mutex;
+	static std::map<std::string, ocssd_emu_device *> devices;
+	const ocssd_emu_config &config = emu_config();
+
+	if (!ocssd_dev_exists(dev_path)) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	ocssd_emu_device *&emu = devices[dev_path];
+
+	/* Drives live as long as the process, like the real ones */
+	if (!emu) {
+		try {
+			emu = new ocssd_emu_device(dev_path, config);
+		} catch (std::runtime_error &e) {
+			printf("%s: %s: %s", __func__, dev_path, e.what());
+			devices.erase(dev_path);
+			errno = EIO;
+			return NULL;
+		}
+	}
+
+	struct nvm_dev *dev = new struct nvm_dev;
+	dev->path = dev_path;
+	dev->emu = emu;
+	return dev;
+}
+
+void nvm_dev_close(struct nvm_dev *dev)
+{
+	delete dev;
+}
+
+const struct nvm_geo *nvm_dev_get_geo(const struct nvm_dev *dev)
+{
+	return dev->emu->get_geo();
+}
+
+int nvm_dev_get_pmode(const struct nvm_dev *dev)
+{
+	const struct nvm_geo *geo = dev->emu->get_geo();
+
+	return geo->nplanes >= 4 ? NVM_FLAG_PMODE_QUAD :
+		geo->nplanes == 2 ? NVM_FLAG_PMODE_DUAL : NVM_FLAG_PMODE_SNGL;
+}
+
+void nvm_dev_pr(const struct nvm_dev *dev)
+{
+	const struct nvm_geo *geo = dev->emu->get_geo();
+
+	printf("dev { path: '%s', emulated }\n", dev->path.c_str());
+	printf("geo { nchannels: %lu, nluns: %lu, nplanes: %lu, nblocks: %lu, "
+		"npages: %lu, nsectors: %lu, sector_nbytes: %lu, tbytes: %lu }\n",
+		geo->nchannels, geo->nluns, geo->nplanes, geo->nblocks,
+		geo->npages, geo->nsectors, geo->sector_nbytes, geo->tbytes);
+}
+
+void *nvm_buf_alloc(const struct nvm_geo *geo, size_t nbytes)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, geo->sector_nbytes, nbytes))
+		return NULL;
+	return buf;
+}
+
+struct nvm_vblk *nvm_vblk_alloc(struct nvm_dev *dev, struct nvm_addr addrs[],
+	int naddrs)
+{
+	if (naddrs <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (int i = 0; i < naddrs; i++) {
+		if (dev->emu->block_index(addrs[i]) < 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	struct nvm_vblk *vblk = new struct nvm_vblk;
+	vblk->dev = dev;
+	vblk->addrs.assign(addrs, addrs + naddrs);
+	vblk->nbytes = naddrs * dev->emu->get_geo()->vblk_nbytes;
+	vblk->pos_read = 0;
+	vblk->pos_write = 0;
+	return vblk;
+}
+
+void nvm_vblk_free(struct nvm_vblk *vblk)
+{
+	delete vblk;
+}
+
+ssize_t nvm_vblk_erase(struct nvm_vblk *vblk)
+{
+	ocssd_emu_device *emu = vblk->dev->emu;
+	std::map<size_t, uint64_t> lun_ns;
+
+	for (const struct nvm_addr &addr : vblk->addrs) {
+		emu->erase(emu->block_index(addr));
+		lun_ns[emu->lun_index(addr)] += emu_config().erase_ns;
+	}
+
+	emu->busy(lun_ns);
+	vblk->pos_read = 0;
+	vblk->pos_write = 0;
+	return 0;
+}
+
+/*
+ * The vblk is striped over its blocks a page at a time: page n of the
+ * vblk is page n / naddrs of block n % naddrs, so a write of naddrs
+ * pages programs every LUN once.
+ */
+ssize_t nvm_vblk_pwrite(struct nvm_vblk *vblk, const void *buf, size_t count,
+	size_t offset)
+{
+	ocssd_emu_device *emu = vblk->dev->emu;
+	size_t unit = emu->get_geo()->vpg_nbytes;
+	size_t naddrs = vblk->addrs.size();
+	std::map<size_t, uint64_t> lun_ns;
+	const char *src = (const char *)buf;
+
+	if (offset % unit || count % unit || offset + count > vblk->nbytes) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t pg = offset / unit; pg < (offset + count) / unit; pg++) {
+		const struct nvm_addr &addr = vblk->addrs[pg % naddrs];
+		size_t blk = emu->block_index(addr);
+
+		if (emu->program(blk, pg / naddrs, 1) < 0)
+			return -1;
+
+		emu->put(blk, pg / naddrs * unit, src, unit);
+		lun_ns[emu->lun_index(addr)] += emu_config().program_ns;
+		src += unit;
+	}
+
+	emu->busy(lun_ns);
+	return count;
+}
+
+ssize_t nvm_vblk_write(struct nvm_vblk *vblk, const void *buf, size_t count)
+{
+	ssize_t ret = nvm_vblk_pwrite(vblk, buf, count, vblk->pos_write);
+
+	if (ret > 0)
+		vblk->pos_write += ret;
+	return ret;
+}
+
+/* Sector aligned, any number of sectors */
+ssize_t nvm_vblk_pread(struct nvm_vblk *vblk, void *buf, size_t count,
+	size_t offset)
+{
+	ocssd_emu_device *emu = vblk->dev->emu;
+	const struct nvm_geo *geo = emu->get_geo();
+	size_t unit = geo->vpg_nbytes;
+	size_t naddrs = vblk->addrs.size();
+	std::map<size_t, uint64_t> lun_ns;
+	char *dst = (char *)buf;
+
+	if (offset % geo->sector_nbytes || count % geo->sector_nbytes ||
+			offset + count > vblk->nbytes) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t off = offset; off < offset + count; ) {
+		size_t pg = off / unit;
+		size_t len = std::min(unit - off % unit, offset + count - off);
+		const struct nvm_addr &addr = vblk->addrs[pg % naddrs];
+		size_t blk = emu->block_index(addr);
+
+		if (emu->check_read(blk, pg / naddrs, 1) < 0)
+			return -1;
+
+		emu->get(blk, pg / naddrs * unit + off % unit, dst, len);
+		lun_ns[emu->lun_index(addr)] += emu_config().read_ns;
+		dst += len;
+		off += len;
+	}
+
+	emu->busy(lun_ns);
+	return count;
+}
+
+ssize_t nvm_vblk_read(struct nvm_vblk *vblk, void *buf, size_t count)
+{
+	ssize_t ret = nvm_vblk_pread(vblk, buf, count, vblk->pos_read);
+
+	if (ret > 0)
+		vblk->pos_read += ret;
+	return ret;
+}
+
+size_t nvm_vblk_get_nbytes(const struct nvm_vblk *vblk) {return vblk->nbytes;}
+size_t nvm_vblk_get_pos_read(const struct nvm_vblk *vblk) {return vblk->pos_read;}
+size_t nvm_vblk_get_pos_write(const struct nvm_vblk *vblk) {return vblk->pos_write;}
+
+int nvm_vblk_set_pos_read(struct nvm_vblk *vblk, size_t pos)
+{
+	vblk->pos_read = pos;
+	return 0;
+}
+
+int nvm_vblk_set_pos_write(struct nvm_vblk *vblk, size_t pos)
+{
+	vblk->pos_write = pos;
+	return 0;
+}
+
+struct nvm_addr *nvm_vblk_get_addrs(const struct nvm_vblk *vblk)
+{
+	return const_cast<struct nvm_addr *>(vblk->addrs.data());
+}
+
+int nvm_vblk_get_naddrs(const struct nvm_vblk *vblk)
+{
+	return vblk->addrs.size();
+}
+
+void nvm_vblk_pr(const struct nvm_vblk *vblk)
+{
+	printf("vblk { naddrs: %lu, nbytes: %lu, pos_read: %lu, pos_write: %lu }\n",
+		vblk->addrs.size(), vblk->nbytes, vblk->pos_read, vblk->pos_write);
+	for (const struct nvm_addr &addr : vblk->addrs)
+		printf("  { ch: %u, lun: %u, blk: %u }\n", (unsigned)addr.g.ch,
+			(unsigned)addr.g.lun, (unsigned)addr.g.blk);
+}
+
+ssize_t nvm_addr_erase(struct nvm_dev *dev, struct nvm_addr addrs[], int naddrs,
+	uint16_t flags, struct nvm_ret *ret)
+{
+	std::map<size_t, uint64_t> lun_ns;
+	std::set<size_t> erased;
+
+	for (int i = 0; i < naddrs; i++) {
+		ssize_t blk = dev->emu->block_index(addrs[i]);
+
+		if (blk < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* The planes of a block go together */
+		if (erased.insert(blk).second) {
+			dev->emu->erase(blk);
+			lun_ns[dev->emu->lun_index(addrs[i])] += emu_config().erase_ns;
+		}
+	}
+
+	dev->emu->busy(lun_ns);
+	return 0;
+}
+
+/* Byte offset of a sector within its block */
+static inline size_t emu_sector_offset(const struct nvm_geo *geo,
+	const struct nvm_addr &addr)
+{
+	return ((addr.g.pg * geo->nplanes + addr.g.pl) * geo->nsectors +
+		addr.g.sec) * geo->sector_nbytes;
+}
+
+/*
+ * Sector addressed I/O. The pages a write touches in a block must be
+ * the next ones to program; the sectors may come in any order.
+ */
+ssize_t nvm_addr_write(struct nvm_dev *dev, struct nvm_addr addrs[], int naddrs,
+	const void *buf, const void *meta, uint16_t flags, struct nvm_ret *ret)
+{
+	ocssd_emu_device *emu = dev->emu;
+	const struct nvm_geo *geo = emu->get_geo();
+	std::map<size_t, std::set<size_t>> pages;
+	std::map<size_t, uint64_t> lun_ns;
+
+	for (int i = 0; i < naddrs; i++) {
+		ssize_t blk = emu->block_index(addrs[i]);
+
+		if (blk < 0 || addrs[i].g.pg >= geo->npages ||
+				addrs[i].g.pl >= geo->nplanes ||
+				addrs[i].g.sec >= geo->nsectors) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (pages[blk].insert(addrs[i].g.pg).second)
+			lun_ns[emu->lun_index(addrs[i])] += emu_config().program_ns;
+	}
+
+	for (auto &it : pages) {
+		size_t first = *it.second.begin();
+
+		if (*it.second.rbegin() - first + 1 != it.second.size() ||
+				emu->program(it.first, first, it.second.size()) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < naddrs; i++)
+		emu->put(emu->block_index(addrs[i]), emu_sector_offset(geo, addrs[i]),
+			(const char *)buf + i * geo->sector_nbytes, geo->sector_nbytes);
+
+	emu->busy(lun_ns);
+	return 0;
+}
+
+ssize_t nvm_addr_read(struct nvm_dev *dev, struct nvm_addr addrs[], int naddrs,
+	void *buf, void *meta, uint16_t flags, struct nvm_ret *ret)
+{
+	ocssd_emu_device *emu = dev->emu;
+	const struct nvm_geo *geo = emu->get_geo();
+	std::map<size_t, uint64_t> lun_ns;
+	std::set<std::pair<size_t, size_t>> pages;
+
+	for (int i = 0; i < naddrs; i++) {
+		ssize_t blk = emu->block_index(addrs[i]);
+
+		if (blk < 0 || addrs[i].g.pg >= geo->npages ||
+				addrs[i].g.pl >= geo->nplanes ||
+				addrs[i].g.sec >= geo->nsectors) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (emu->check_read(blk, addrs[i].g.pg, 1) < 0)
+			return -1;
+
+		emu->get(blk, emu_sector_offset(geo, addrs[i]),
+			(char *)buf + i * geo->sector_nbytes, geo->sector_nbytes);
+		if (pages.insert(std::make_pair((size_t)blk, (size_t)addrs[i].g.pg)).second)
+			lun_ns[emu->lun_index(addrs[i])] += emu_config().read_ns;
+	}
+
+	emu->busy(lun_ns);
+	return 0;
+}
+
+const struct nvm_bbt *nvm_bbt_get(struct nvm_dev *dev, struct nvm_addr addr,
+	struct nvm_ret *ret)
+{
+	if (dev->emu->block_index(addr) < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct nvm_bbt *bbt = dev->emu->get_bbt(addr);
+	bbt->dev = dev;
+	return bbt;
+}
+
+int nvm_bbt_mark(struct nvm_dev *dev, struct nvm_addr addrs[], int naddrs,
+	uint16_t flags, struct nvm_ret *ret)
+{
+	for (int i = 0; i < naddrs; i++) {
+		ssize_t blk = dev->emu->block_index(addrs[i]);
+
+		if (blk < 0 || addrs[i].g.pl >= dev->emu->get_geo()->nplanes) {
+			errno = EINVAL;
+			return -1;
+		}
+		dev->emu->mark(blk, addrs[i].g.pl, flags);
+	}
+
+	return 0;
+}
+
+#endif
+
+#endif
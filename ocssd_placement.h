@@ -0,0 +1,272 @@
+#ifndef OCSSD_PLACEMENT_H
+#define OCSSD_PLACEMENT_H
+
+#include <time.h>
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+#include "azure_config.h"
+#include "ocssd_server.h"
+
+/*
+ * Placement of vSSDs over the nodes of a cluster, from the free capacity
+ * every server publishes (see ocssd_publisher.h).
+ *
+ * The device rows are read from a source and cached; they are refreshed
+ * once older than PLACEMENT_REFRESH_MS, or after a placed allocation
+ * failed. A node can take a request if its devices together have enough
+ * free channels of the requested kind. Nodes whose devices on the
+ * requested NUMA node could hold the request alone come first, then the
+ * nodes with all the blocks asked for (a server hands out fewer when
+ * short), then the nodes with the most room. The first node picked is
+ * charged for the request in the cache, so callers placing between two
+ * refreshes spread over the fleet.
+ */
+
+#define PLACEMENT_REFRESH_MS 5000
+
+/* Where the device rows come from */
+class ocssd_placement_source {
+public:
+	virtual ~ocssd_placement_source() {}
+
+	/* Every device row known, 0 or a negative errno */
+	virtual int fetch(std::vector<azure_resource_row> &rows) = 0;
+};
+
+/* The OCSSDResource table */
+class ocssd_azure_source : public ocssd_placement_source {
+public:
+	int fetch(std::vector<azure_resource_row> &rows) {
+		return azure_query_entities(rows);
+	}
+};
+
+/* Rows kept in the process, for tests and single node setups */
+class ocssd_memory_source : public ocssd_placement_source {
+public:
+	/* Insert or replace, by device */
+	void publish(const azure_resource_row &row) {
+		MutexLock lock(&mutex_);
+		rows_[row.device] = row;
+	}
+
+	void remove(const std::string &device) {
+		MutexLock lock(&mutex_);
+		rows_.erase(device);
+	}
+
+	int fetch(std::vector<azure_resource_row> &rows) {
+		MutexLock lock(&mutex_);
+
+		rows.clear();
+		for (auto &it : rows_)
+			rows.push_back(it.second);
+		return 0;
+	}
+
+private:
+	std::mutex mutex_;
+	std::map<std::string, azure_resource_row> rows_;
+};
+
+class ocssd_placement {
+public:
+	/* Takes the source */
+	ocssd_placement(ocssd_placement_source *source,
+			uint64_t refresh_ms = PLACEMENT_REFRESH_MS)
+		: source_(source), refresh_ns_(refresh_ms * 1000000ULL),
+		fetched_ns_(0), stale_(true) {}
+
+	~ocssd_placement() {
+		delete source_;
+	}
+
+	/* Read the rows again, 0 or a negative errno */
+	int refresh();
+
+	/* The cache no longer matches the servers, refresh on next use */
+	void invalidate() {
+		MutexLock lock(&mutex_);
+		stale_ = true;
+	}
+
+	/*
+	 * The IPs of at most max_nodes nodes that can take request, best
+	 * first. Returns how many; none if the whole fleet is short.
+	 */
+	size_t place(ocssd_alloc_request request, std::vector<std::string> &nodes,
+			size_t max_nodes = 1);
+
+private:
+	ocssd_placement(const ocssd_placement &);
+	ocssd_placement & operator=(const ocssd_placement &);
+
+	struct candidate {
+		std::string ip;
+		bool numa_local;
+		bool has_blocks;
+		size_t channels;
+		size_t free_blocks;
+	};
+
+	static uint64_t now_ns() {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	/* Free channels of the requested kind on a device */
+	static size_t free_channels(const azure_resource_row &row, bool shared) {
+		return shared ? row.numShared : row.numExclusive;
+	}
+
+	void charge(const std::string &ip, ocssd_alloc_request &request);
+
+	ocssd_placement_source *source_;
+	uint64_t refresh_ns_;
+
+	std::mutex mutex_;
+	uint64_t fetched_ns_;
+	bool stale_;
+
+	/* Device rows by node IP */
+	std::map<std::string, std::vector<azure_resource_row>> nodes_;
+};
+
+int ocssd_placement::refresh()
+{
+	std::vector<azure_resource_row> rows;
+	int ret;
+
+	/* Not under mutex_, the source may be a network round trip */
+	ret = source_->fetch(rows);
+	if (ret < 0) {
+		printf("%s: fetch failed: %d\n", __func__, ret);
+		return ret;
+	}
+
+	std::map<std::string, std::vector<azure_resource_row>> nodes;
+	for (const azure_resource_row &row : rows) {
+		if (!row.nodeIp.empty())
+			nodes[row.nodeIp].push_back(row);
+	}
+
+	MutexLock lock(&mutex_);
+	nodes_.swap(nodes);
+	fetched_ns_ = now_ns();
+	stale_ = false;
+	return 0;
+}
+
+/*
+ * Take the request off the cached rows of a node, NUMA local devices
+ * first. Called with mutex_ held
+ */
+void ocssd_placement::charge(const std::string &ip, ocssd_alloc_request &request)
+{
+	std::vector<azure_resource_row> &devices = nodes_[ip];
+	bool shared = request.get_shared() == 1;
+	size_t channels = request.get_channels();
+	size_t blocks = request.get_blocks();
+
+	std::stable_sort(devices.begin(), devices.end(),
+		[&request](const azure_resource_row &a, const azure_resource_row &b) {
+			return (a.numaNode == (int)request.get_numa_id()) >
+				(b.numaNode == (int)request.get_numa_id());
+		});
+
+	for (azure_resource_row &row : devices) {
+		if (shared) {
+			size_t taken = std::min(blocks, row.freeBlocks);
+
+			row.freeBlocks -= taken;
+			blocks -= taken;
+			if (row.freeBlocks == 0)
+				row.numShared = 0;
+		} else {
+			size_t taken = std::min(channels, row.numExclusive);
+
+			if (taken == 0)
+				continue;
+
+			/* An exclusive channel takes its share of the free blocks */
+			row.freeBlocks -= row.freeBlocks * taken /
+				(row.numShared + row.numExclusive);
+			row.numExclusive -= taken;
+			channels -= taken;
+		}
+	}
+}
+
+size_t ocssd_placement::place(ocssd_alloc_request request,
+	std::vector<std::string> &nodes, size_t max_nodes)
+{
+	bool shared = request.get_shared() == 1;
+	int numa = request.get_numa_id();
+	std::vector<candidate> candidates;
+	bool refresh_needed;
+
+	nodes.clear();
+
+	{
+		MutexLock lock(&mutex_);
+		refresh_needed = stale_ || now_ns() - fetched_ns_ > refresh_ns_;
+	}
+
+	/* A failed refresh leaves the old rows, better than nothing */
+	if (refresh_needed)
+		refresh();
+
+	MutexLock lock(&mutex_);
+
+	for (auto &it : nodes_) {
+		candidate c = {it.first, false, false, 0, 0};
+		size_t local = 0;
+
+		for (const azure_resource_row &row : it.second) {
+			size_t channels = free_channels(row, shared);
+
+			c.channels += channels;
+			c.free_blocks += row.freeBlocks;
+			if (row.numaNode == numa)
+				local += channels;
+		}
+
+		if (c.channels < request.get_channels())
+			continue;
+
+		c.numa_local = local >= request.get_channels();
+		c.has_blocks = !shared || c.free_blocks >= request.get_blocks();
+		candidates.push_back(c);
+	}
+
+	std::sort(candidates.begin(), candidates.end(),
+		[](const candidate &a, const candidate &b) {
+			if (a.numa_local != b.numa_local)
+				return a.numa_local;
+			if (a.has_blocks != b.has_blocks)
+				return a.has_blocks;
+			if (a.channels != b.channels)
+				return a.channels > b.channels;
+			if (a.free_blocks != b.free_blocks)
+				return a.free_blocks > b.free_blocks;
+			return a.ip < b.ip;
+		});
+
+	for (size_t i = 0; i < candidates.size() && nodes.size() < max_nodes; i++)
+		nodes.push_back(candidates[i].ip);
+
+	if (!nodes.empty())
+		charge(nodes[0], request);
+
+	return nodes.size();
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef OCSSD_PUBLISHER_H
+#define OCSSD_PUBLISHER_H
+
+#include <time.h>
+#include <errno.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+#include "azure_config.h"
+#include "ocssd_server.h"
+
+/*
+ * Publication of the free capacity of every unit, for the clients that
+ * pick a server.
+ *
+ * Connections only note that something changed, which never blocks.
+ * A publisher thread reads the units on a timer, or as soon as enough
+ * changes are pending, and hands the rows that differ from the last
+ * published ones to a backend in one batch. However many allocations
+ * and releases happen in between, a unit costs one upsert per round.
+ */
+
+/* Longest a change waits to be published */
+#define PUBLISH_INTERVAL_MS 1000
+
+/* Changes that start a round before the interval is up */
+#define PUBLISH_BATCH_CHANGES 32
+
+/* Where the rows go. publish() runs on the publisher thread only */
+class ocssd_publish_backend {
+public:
+	virtual ~ocssd_publish_backend() {}
+
+	/* 0, or a negative errno, in which case the rows are sent again */
+	virtual int publish(const std::vector<azure_resource_row> &rows) = 0;
+};
+
+/* The OCSSDResource table */
+class ocssd_azure_backend : public ocssd_publish_backend {
+public:
+	int publish(const std::vector<azure_resource_row> &rows) {
+		return azure_upsert_entities(rows);
+	}
+};
+
+/* One line per row, appended to a file, for tests and machines without an account */
+class ocssd_file_backend : public ocssd_publish_backend {
+public:
+	ocssd_file_backend(const std::string &path) {
+		file_ = fopen(path.c_str(), "a");
+		if (!file_)
+			throw std::runtime_error("Error: open publish file failed\n");
+	}
+
+	~ocssd_file_backend() {
+		fclose(file_);
+	}
+
+	int publish(const std::vector<azure_resource_row> &rows) {
+		time_t now = time(NULL);
+
+		for (const azure_resource_row &row : rows)
+			fprintf(file_, "%ld %s node %s numa %d shared %lu exclusive %lu "
+				"free_blocks %lu\n", (long)now, row.device.c_str(),
+				row.nodeIp.c_str(), row.numaNode, row.numShared,
+				row.numExclusive, row.freeBlocks);
+
+		return fflush(file_) ? -errno : 0;
+	}
+
+private:
+	FILE *file_;
+};
+
+/* Nothing is published */
+class ocssd_null_backend : public ocssd_publish_backend {
+public:
+	int publish(const std::vector<azure_resource_row> &rows) {
+		return 0;
+	}
+};
+
+/*
+ * "azure", "file:<path>" or "none". Returns NULL for anything else, or
+ * if the backend cannot be set up.
+ */
+static ocssd_publish_backend *new_publish_backend(const std::string &spec)
+{
+	try {
+		if (spec == "azure")
+			return new ocssd_azure_backend();
+		if (spec == "none")
+			return new ocssd_null_backend();
+		if (spec.compare(0, 5, "file:") == 0 && spec.size() > 5)
+			return new ocssd_file_backend(spec.substr(5));
+	} catch (std::runtime_error &e) {
+		printf("%s: %s: %s", __func__, spec.c_str(), e.what());
+	}
+
+	return NULL;
+}
+
+class ocssd_publisher {
+public:
+	/* Takes the backend. Every unit is published once right away */
+	ocssd_publisher(ocssd_manager *manager, ocssd_publish_backend *backend);
+
+	/* Publishes what is still pending first */
+	~ocssd_publisher();
+
+	/* The free capacity of some unit changed */
+	void notify();
+
+private:
+	ocssd_publisher(const ocssd_publisher &);
+	ocssd_publisher & operator=(const ocssd_publisher &);
+
+	void run();
+	int publish_changes();
+
+	ocssd_manager *manager_;
+	ocssd_publish_backend *backend_;
+	std::thread thread_;
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	size_t changes_;
+	bool stop_;
+
+	/* Publisher thread only: what the backend has, by unit */
+	std::map<std::string, azure_resource_row> published_;
+};
+
+ocssd_publisher::ocssd_publisher(ocssd_manager *manager, ocssd_publish_backend *backend)
+	: manager_(manager), backend_(backend), changes_(1), stop_(false)
+{
+	thread_ = std::thread(&ocssd_publisher::run, this);
+}
+
+ocssd_publisher::~ocssd_publisher()
+{
+	{
+		MutexLock lock(&mutex_);
+		stop_ = true;
+	}
+
+	wake_.notify_one();
+	thread_.join();
+	delete backend_;
+}
+
+void ocssd_publisher::notify()
+{
+	MutexLock lock(&mutex_);
+
+	if (++changes_ == PUBLISH_BATCH_CHANGES)
+		wake_.notify_one();
+}
+
+/* Send the units whose stats moved since the last success */
+int ocssd_publisher::publish_changes()
+{
+	std::vector<azure_resource_row> rows;
+	int ret;
+
+	for (ocssd_unit *unit : manager_->get_units()) {
+		azure_resource_row row;
+
+		row.device = unit->get_desc();
+		row.nodeIp = unit->get_ip();
+		row.numaNode = unit->get_numa_node();
+		if (unit->get_ocssd_stats(row.numShared, row.numExclusive, row.freeBlocks))
+			continue;
+
+		auto it = published_.find(row.device);
+		if (it != published_.end() &&
+				it->second.numShared == row.numShared &&
+				it->second.numExclusive == row.numExclusive &&
+				it->second.freeBlocks == row.freeBlocks)
+			continue;
+
+		rows.push_back(row);
+	}
+
+	if (rows.empty())
+		return 0;
+
+	ret = backend_->publish(rows);
+	if (ret < 0) {
+		printf("%s: %lu rows failed: %d\n", __func__, rows.size(), ret);
+		return ret;
+	}
+
+	for (const azure_resource_row &row : rows)
+		published_[row.device] = row;
+
+	return 0;
+}
+
+void ocssd_publisher::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (true) {
+		bool stopping = stop_;
+
+		if (changes_ > 0 || stopping) {
+			changes_ = 0;
+			lock.unlock();
+
+			/* Retried on the next round, even if nothing else changes */
+			int ret = publish_changes();
+
+			lock.lock();
+			if (ret < 0)
+				changes_++;
+		}
+
+		if (stopping)
+			break;
+
+		wake_.wait_for(lock, std::chrono::milliseconds(PUBLISH_INTERVAL_MS),
+			[this]() {return stop_ || changes_ >= PUBLISH_BATCH_CHANGES;});
+	}
+}
+
+#endif
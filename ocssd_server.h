@@ -1,22 +1,31 @@
 #pragma once
 
-#include <liblightnvm.h>
+#include "ocssd_nvm.h"
 #include <ifaddrs.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <iostream>
 #include <algorithm>
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
 #include <mutex>
+#include <memory>
+#include <functional>
+
+#include "ocssd_journal.h"
+#include "ocssd_codec.h"
 
 #define OCSSD_MESSAGE_PORT	50001
 #define OCSSD_DATA_PORT		50002
 
-#define MESSAGE_BUFFER_SIZE 24
+/* Frame header plus the largest request body, a full extent list */
+#define MESSAGE_BUFFER_SIZE 2048
 
 static int setnonblocking(int fd)
 {
@@ -130,6 +139,58 @@ out:
 	return ret;
 }
 
+/*
+ * Set the write pointer of a vblk to where the media has it. Pages are
+ * programmed in order, and written ones read back while erased ones do
+ * not, so it is the first page that fails to read. One sector of each
+ * page probed is read.
+ */
+ssize_t nvm_vblk_find_pos_write(const struct nvm_geo *geo, struct nvm_vblk *blk)
+{
+	size_t page = geo->nplanes * geo->nsectors * geo->sector_nbytes;
+	size_t lo = 0, hi = nvm_vblk_get_nbytes(blk) / page;
+	void *buf;
+
+	buf = nvm_buf_alloc(geo, geo->sector_nbytes);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Pages before lo read back, page hi does not or is past the end */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (nvm_vblk_pread(blk, buf, geo->sector_nbytes, mid * page) < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	free(buf);
+	return nvm_vblk_set_pos_write(blk, lo * page);
+}
+
+/* Mark every plane of every block in the vblk as bad on the device */
+int nvm_vblk_mark_bad(struct nvm_dev *dev, const struct nvm_geo *geo,
+	struct nvm_vblk *blk)
+{
+	struct nvm_addr *blk_addrs = nvm_vblk_get_addrs(blk);
+	std::vector<struct nvm_addr> addrs;
+	struct nvm_ret ret;
+
+	for (int i = 0; i < nvm_vblk_get_naddrs(blk); i++) {
+		for (size_t pl = 0; pl < geo->nplanes; pl++) {
+			struct nvm_addr addr = blk_addrs[i];
+
+			addr.g.pl = pl;
+			addrs.push_back(addr);
+		}
+	}
+
+	return nvm_bbt_mark(dev, addrs.data(), addrs.size(), NVM_BBT_HMRK, &ret);
+}
+
 class MutexLock {
 public:
 	explicit MutexLock(std::mutex *mutex)
@@ -147,37 +208,37 @@ private:
 };
 
 
-static inline uint32_t get_header(const char *buffer) {
-	uint32_t data;
-	data = *(uint32_t *)buffer;
+/* Fixed size fields into buffers sized at compile time, see ocssd_codec.h */
+static inline void serialize_data2(char *&buffer, uint16_t data) {
+	wire_put(buffer, data);
+	buffer += sizeof(uint16_t);
+}
+
+static inline uint16_t deserialize_data2(const char *&buffer) {
+	uint16_t data = wire_get<uint16_t>(buffer);
+	buffer += sizeof(uint16_t);
 	return data;
 }
 
 static inline void serialize_data4(char *&buffer, uint32_t data) {
-	char *&p = buffer;
-	*(uint32_t *)p = data;
-	p += sizeof(uint32_t);
+	wire_put(buffer, data);
+	buffer += sizeof(uint32_t);
 }
 
 static inline uint32_t deserialize_data4(const char *&buffer) {
-	uint32_t data;
-	const char *&p = buffer;
-	data = *(uint32_t *)p;
-	p += sizeof(uint32_t);
+	uint32_t data = wire_get<uint32_t>(buffer);
+	buffer += sizeof(uint32_t);
 	return data;
 }
 
 static inline void serialize_data8(char *&buffer, uint64_t data) {
-	char *&p = buffer;
-	*(uint64_t *)p = data;
-	p += sizeof(uint64_t);
+	wire_put(buffer, data);
+	buffer += sizeof(uint64_t);
 }
 
 static inline uint64_t deserialize_data8(const char *&buffer) {
-	uint64_t data;
-	const char *&p = buffer;
-	data = *(uint64_t *)p;
-	p += sizeof(uint64_t);
+	uint64_t data = wire_get<uint64_t>(buffer);
+	buffer += sizeof(uint64_t);
 	return data;
 }
 
@@ -190,53 +251,151 @@ enum REQUEST_CODE {
 	READ_BLOCK_REQUEST,
 	WRITE_BLOCK_REQUEST,
 	ERASE_BLOCK_REQUEST,
+	READV_BLOCK_REQUEST,
+	WRITEV_BLOCK_REQUEST,
+	ATTACH_VSSD_REQUEST,
+	RELEASE_VSSD_REQUEST,
+
+	/* Internal to the server, never accepted from a client */
+	TEST_BLOCK_REQUEST,
+	CHECK_BLOCK_REQUEST,
+};
+
+/* How the blocks of a remote vSSD are checked before use */
+enum VSSD_INIT_MODE {
+	/* Erase, write and read every vblk, in the background */
+	VSSD_INIT_TEST = 0,
+	/* Trust the bad block table on the device, nothing is written */
+	VSSD_INIT_BBT,
+	/* Take the states saved in the journal, internal to attach */
+	VSSD_INIT_RESTORE,
+};
+
+const uint32_t FRAME_MAGIC = 0x6601;
+const uint16_t FRAME_VERSION = 1;
+const ssize_t FRAME_HEADER_SIZE = wire_size<uint32_t, uint16_t, uint16_t,
+	uint64_t, int32_t, uint32_t, uint64_t>::value;
+static_assert(FRAME_HEADER_SIZE == 32, "frame header format changed");
+
+/*
+ * Every request and every reply starts with a frame header. The tag is
+ * chosen by the client and echoed back in the reply, so a client can
+ * keep many requests in flight on one connection and match replies
+ * that complete out of order.
+ *
+ * Frame header format (version 1):
+ * FRAME_MAGIC		4 bytes
+ * VERSION		2 bytes
+ * OPCODE		2 bytes
+ * TAG			8 bytes
+ * STATUS		4 bytes		0 or errno, set in replies only
+ * BODY_LEN		4 bytes		Request parameters after the header
+ * DATA_LEN		8 bytes		Payload after the parameters
+ */
+class ocssd_frame_header {
+public:
+
+	ocssd_frame_header(REQUEST_CODE opcode = NO_REQUEST, uint64_t tag = 0,
+		uint32_t body_len = 0, uint64_t data_len = 0, int32_t status = 0)
+		: opcode_(opcode),
+		tag_(tag),
+		status_(status),
+		body_len_(body_len),
+		data_len_(data_len) {}
+
+	ocssd_frame_header(const char *buffer) {
+		uint32_t magic = deserialize_data4(buffer);
+		if (magic != FRAME_MAGIC) {
+			printf("Incorrect MAGIC: %x\n", magic);
+			throw std::runtime_error("Error: init frame failed\n");
+		}
+
+		uint16_t version = deserialize_data2(buffer);
+		if (version != FRAME_VERSION) {
+			printf("Unsupported frame version: %u\n", version);
+			throw std::runtime_error("Error: init frame failed\n");
+		}
+
+		opcode_		= (REQUEST_CODE)deserialize_data2(buffer);
+		tag_		= deserialize_data8(buffer);
+		status_		= (int32_t)deserialize_data4(buffer);
+		body_len_	= deserialize_data4(buffer);
+		data_len_	= deserialize_data8(buffer);
+	}
+
+	size_t serialize(char *buffer) const {
+		char *start = buffer;
+
+		serialize_data4(buffer, FRAME_MAGIC);
+		serialize_data2(buffer, FRAME_VERSION);
+		serialize_data2(buffer, opcode_);
+		serialize_data8(buffer, tag_);
+		serialize_data4(buffer, (uint32_t)status_);
+		serialize_data4(buffer, body_len_);
+		serialize_data8(buffer, data_len_);
+		return buffer - start;
+	}
+
+	REQUEST_CODE get_opcode() const {return opcode_;}
+	uint64_t get_tag() const {return tag_;}
+	int32_t get_status() const {return status_;}
+	uint32_t get_body_len() const {return body_len_;}
+	uint64_t get_data_len() const {return data_len_;}
+
+	void set_status(int32_t status) {status_ = status;}
+	void set_data_len(uint64_t data_len) {data_len_ = data_len;}
+
+private:
+
+	REQUEST_CODE opcode_;
+	uint64_t tag_;
+	int32_t status_;
+	uint32_t body_len_;
+	uint64_t data_len_;
 };
 
-const uint32_t READ_BLOCK_MAGIC = 0x6401;
-const uint32_t WRITE_BLOCK_MAGIC = 0x6402;
-const uint32_t ERASE_BLOCK_MAGIC = 0x6403;
-const ssize_t REQUEST_IO_SIZE = 24;
+const ssize_t REQUEST_IO_SIZE = wire_size<uint32_t, uint32_t, uint64_t,
+	uint64_t>::value;
+static_assert(REQUEST_IO_SIZE == 24, "I/O request format changed");
+static_assert(FRAME_HEADER_SIZE + REQUEST_IO_SIZE <= MESSAGE_BUFFER_SIZE,
+	"I/O request too large");
 
 /*
  * Request serialize format:
- * BLOCK_MAGIC		4 bytes
+ * FRAME_HEADER		32 bytes	DATA_LEN = COUNT for writes
  * BLOCK_INDEX		4 bytes
+ * RESERVED		4 bytes
  * COUNT		8 bytes
  * OFFSET		8 bytes
  */
 class ocssd_io_request {
 public:
 
-	ocssd_io_request(REQUEST_CODE command, uint32_t block_index, size_t count, size_t offset)
+	ocssd_io_request(REQUEST_CODE command, uint32_t block_index,
+			size_t count, size_t offset, uint64_t tag = 0)
 		: command_(command),
+		tag_(tag),
 		block_index_(block_index),
 		count_(count),
 		offset_(offset) {}
 
-	ocssd_io_request(const char *buffer) {
-		uint32_t magic = deserialize_data4(buffer);
-		if (magic != READ_BLOCK_MAGIC &&
-				magic != WRITE_BLOCK_MAGIC &&
-				magic != ERASE_BLOCK_MAGIC) {
-			printf("Incorrect MAGIC: %x\n", magic);
+	ocssd_io_request(const ocssd_frame_header &header, const char *buffer) {
+		command_ = header.get_opcode();
+		if (command_ != READ_BLOCK_REQUEST &&
+				command_ != WRITE_BLOCK_REQUEST &&
+				command_ != ERASE_BLOCK_REQUEST) {
+			printf("Incorrect opcode: %x\n", command_);
 			throw std::runtime_error("Error: init request failed\n");
 		}
 
-		switch (magic) {
-		case (READ_BLOCK_MAGIC):
-			command_ = READ_BLOCK_REQUEST;
-			break;
-		case (WRITE_BLOCK_MAGIC):
-			command_ = WRITE_BLOCK_REQUEST;
-			break;
-		case (ERASE_BLOCK_MAGIC):
-			command_ = ERASE_BLOCK_REQUEST;
-			break;
-		default:
-			break;
+		if (header.get_body_len() != REQUEST_IO_SIZE) {
+			printf("Incorrect body length: %u\n", header.get_body_len());
+			throw std::runtime_error("Error: init request failed\n");
 		}
 
+		tag_		= header.get_tag();
 		block_index_	= deserialize_data4(buffer);
+		deserialize_data4(buffer);
 		count_		= deserialize_data8(buffer);
 		offset_		= deserialize_data8(buffer);
 
@@ -246,28 +405,31 @@ public:
 
 	size_t serialize(char *buffer) {
 		char *start = buffer;
+		uint64_t data_len = 0;
 
 		switch (command_) {
-		case (READ_BLOCK_REQUEST):
-			serialize_data4(buffer, READ_BLOCK_MAGIC);
-			break;
 		case (WRITE_BLOCK_REQUEST):
-			serialize_data4(buffer, WRITE_BLOCK_MAGIC);
+			data_len = count_;
 			break;
+		case (READ_BLOCK_REQUEST):
 		case (ERASE_BLOCK_REQUEST):
-			serialize_data4(buffer, ERASE_BLOCK_MAGIC);
 			break;
 		default:
 			return 0;
 		}
 
+		ocssd_frame_header header(command_, tag_, REQUEST_IO_SIZE, data_len);
+		buffer += header.serialize(buffer);
+
 		serialize_data4(buffer, block_index_);
+		serialize_data4(buffer, 0);
 		serialize_data8(buffer, count_);
 		serialize_data8(buffer, offset_);
 		return buffer - start;
 	}
 
 	REQUEST_CODE get_command() {return command_;}
+	uint64_t get_tag() {return tag_;}
 	uint32_t get_block_index() {return block_index_;}
 	size_t get_count() {return count_;}
 	size_t get_offset() {return offset_;}
@@ -275,82 +437,349 @@ public:
 private:
 
 	REQUEST_CODE command_;
+	uint64_t tag_;
 	uint32_t block_index_;
 	size_t count_;
 	size_t offset_;
 };
 
-const uint32_t REQUEST_MAGIC = 0x6501;
-const ssize_t REQUEST_ALLOC_SIZE = 24;
+const uint32_t MAX_VECTOR_EXTENTS = 64;
+const ssize_t VECTOR_HEADER_SIZE = wire_size<uint32_t, uint32_t>::value;
+const ssize_t VECTOR_EXTENT_SIZE = wire_size<uint32_t, uint32_t, uint64_t,
+	uint64_t>::value;
+static_assert(VECTOR_HEADER_SIZE == 8 && VECTOR_EXTENT_SIZE == 24,
+	"vector request format changed");
+static_assert(FRAME_HEADER_SIZE + VECTOR_HEADER_SIZE +
+	MAX_VECTOR_EXTENTS * VECTOR_EXTENT_SIZE <= MESSAGE_BUFFER_SIZE,
+	"vector request too large");
+
+struct ocssd_extent {
+	uint32_t block_index;
+	size_t offset;		/* Ignored by writes, they append */
+	size_t length;
+};
 
 /*
+ * Vectored request, one request for many vblks. The extents run in
+ * parallel and the reply carries the data of all of them, in order.
+ * The payload of a write is the data of all extents, in order.
+ *
  * Request serialize format:
- * REQUEST_MAGIC	4 bytes
+ * FRAME_HEADER		32 bytes	DATA_LEN = total LENGTH for writes
+ * NUM_EXTENTS		4 bytes
+ * RESERVED		4 bytes
+ *	BLOCK_INDEX	4 bytes
+ *	RESERVED	4 bytes
+ *	OFFSET		8 bytes
+ *	LENGTH		8 bytes
+ *	...
+ */
+class ocssd_vector_request {
+public:
+
+	ocssd_vector_request(REQUEST_CODE command, uint64_t tag = 0)
+		: command_(command),
+		tag_(tag) {}
+
+	ocssd_vector_request(const ocssd_frame_header &header, const char *buffer) {
+		command_ = header.get_opcode();
+		if (command_ != READV_BLOCK_REQUEST &&
+				command_ != WRITEV_BLOCK_REQUEST) {
+			printf("Incorrect opcode: %x\n", command_);
+			throw std::runtime_error("Error: init request failed\n");
+		}
+
+		tag_ = header.get_tag();
+
+		uint32_t num_extents = deserialize_data4(buffer);
+		deserialize_data4(buffer);
+
+		if (num_extents > MAX_VECTOR_EXTENTS ||
+				header.get_body_len() !=
+				VECTOR_HEADER_SIZE + num_extents * VECTOR_EXTENT_SIZE) {
+			printf("Incorrect extent list: %u extents, length %u\n",
+				num_extents, header.get_body_len());
+			throw std::runtime_error("Error: init request failed\n");
+		}
+
+		for (uint32_t i = 0; i < num_extents; i++) {
+			ocssd_extent extent;
+
+			extent.block_index = deserialize_data4(buffer);
+			deserialize_data4(buffer);
+			extent.offset = deserialize_data8(buffer);
+			extent.length = deserialize_data8(buffer);
+			extents_.push_back(extent);
+		}
+	}
+
+	void add(uint32_t block_index, size_t offset, size_t length) {
+		ocssd_extent extent = {block_index, offset, length};
+		extents_.push_back(extent);
+	}
+
+	size_t serialize(char *buffer) {
+		char *start = buffer;
+		uint32_t body_len = VECTOR_HEADER_SIZE +
+			extents_.size() * VECTOR_EXTENT_SIZE;
+		uint64_t data_len = 0;
+
+		if (extents_.size() > MAX_VECTOR_EXTENTS)
+			return 0;
+
+		if (command_ == WRITEV_BLOCK_REQUEST)
+			data_len = get_total_length();
+
+		ocssd_frame_header header(command_, tag_, body_len, data_len);
+		buffer += header.serialize(buffer);
+
+		serialize_data4(buffer, extents_.size());
+		serialize_data4(buffer, 0);
+		for (const ocssd_extent &extent : extents_) {
+			serialize_data4(buffer, extent.block_index);
+			serialize_data4(buffer, 0);
+			serialize_data8(buffer, extent.offset);
+			serialize_data8(buffer, extent.length);
+		}
+
+		return buffer - start;
+	}
+
+	size_t get_total_length() const {
+		size_t total = 0;
+
+		for (const ocssd_extent &extent : extents_)
+			total += extent.length;
+		return total;
+	}
+
+	REQUEST_CODE get_command() {return command_;}
+	uint64_t get_tag() {return tag_;}
+	const std::vector<ocssd_extent> & get_extents() const {return extents_;}
+
+private:
+
+	REQUEST_CODE command_;
+	uint64_t tag_;
+	std::vector<ocssd_extent> extents_;
+};
+
+/*
+ * Runtime limits of a vSSD, a zero limit is unlimited. The weight is
+ * its share of a device against the other vSSDs when both are queued.
+ */
+struct ocssd_qos {
+	ocssd_qos() : iops(0), weight(1), bandwidth(0) {}
+
+	uint32_t iops;
+	uint32_t weight;
+	uint64_t bandwidth;		/* Bytes per second */
+};
+
+const ssize_t REQUEST_ALLOC_SIZE = wire_size<uint32_t, uint32_t, uint32_t,
+	uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint64_t>::value;
+static_assert(REQUEST_ALLOC_SIZE == 40, "alloc request format changed");
+static_assert(FRAME_HEADER_SIZE + REQUEST_ALLOC_SIZE <= MESSAGE_BUFFER_SIZE,
+	"alloc request too large");
+
+/*
+ * Request serialize format:
+ * FRAME_HEADER		32 bytes
  * NUM_CHANNELS		4 bytes
  * NUM_BLOCKS		4 bytes
  * SHARED		4 bytes
  * NUMA_ID		4 bytes
  * REMOTE		4 bytes
+ * INIT_MODE		4 bytes
+ * QOS_IOPS		4 bytes
+ * QOS_WEIGHT		4 bytes
+ * QOS_BANDWIDTH	8 bytes
  */
 class ocssd_alloc_request {
 public:
 
-	ocssd_alloc_request(size_t num_channels, size_t num_blocks, int shared, int numa_id, int remote)
-		: num_channels_(num_channels),
+	ocssd_alloc_request(size_t num_channels, size_t num_blocks, int shared, int numa_id, int remote,
+			int init_mode = VSSD_INIT_TEST)
+		: tag_(0),
+		num_channels_(num_channels),
 		num_blocks_(num_blocks),
 		shared_(shared),
 		numa_id_(numa_id),
-		remote_(remote) {}
+		remote_(remote),
+		init_mode_(init_mode) {}
 
-	ocssd_alloc_request(size_t num_channels, int numa_id, int remote)
-		: num_channels_(num_channels),
+	ocssd_alloc_request(size_t num_channels, int numa_id, int remote,
+			int init_mode = VSSD_INIT_TEST)
+		: tag_(0),
+		num_channels_(num_channels),
 		num_blocks_(0),
 		shared_(0),
 		numa_id_(numa_id),
-		remote_(remote) {}
-
-	ocssd_alloc_request(const char *buffer) {
-		uint32_t magic = deserialize_data4(buffer);
-		if (magic != REQUEST_MAGIC) {
-			printf("Incorrect MAGIC: %x\n", magic);
+		remote_(remote),
+		init_mode_(init_mode) {}
+
+	ocssd_alloc_request(const ocssd_frame_header &header, const char *buffer) {
+		if (header.get_opcode() != ALLOC_VSSD_REQUEST ||
+				header.get_body_len() != REQUEST_ALLOC_SIZE) {
+			printf("Incorrect alloc request: opcode %x, length %u\n",
+				header.get_opcode(), header.get_body_len());
 			throw std::runtime_error("Error: init request failed\n");
 		}
 
+		tag_		= header.get_tag();
 		num_channels_	= deserialize_data4(buffer);
 		num_blocks_	= deserialize_data4(buffer);
 		shared_		= deserialize_data4(buffer);
 		numa_id_	= deserialize_data4(buffer);
 		remote_		= deserialize_data4(buffer);
+		init_mode_	= deserialize_data4(buffer);
+		qos_.iops	= deserialize_data4(buffer);
+		qos_.weight	= deserialize_data4(buffer);
+		qos_.bandwidth	= deserialize_data8(buffer);
 
-		printf("Request %u channels, %u blocks, shared %u, NUMA %u, remote %u\n",
-			num_channels_, num_blocks_, shared_, numa_id_, remote_);
+		if (qos_.weight == 0)
+			qos_.weight = 1;
+	}
+
+	void print() const {
+		printf("Request %u channels, %u blocks, shared %u, NUMA %u, remote %u, init %u\n",
+			num_channels_, num_blocks_, shared_, numa_id_, remote_, init_mode_);
+		printf("QoS: %u IOPS, %lu bytes/s, weight %u\n",
+			qos_.iops, qos_.bandwidth, qos_.weight);
 	}
 
 	size_t serialize(char *buffer) {
 		char *start = buffer;
-		serialize_data4(buffer, REQUEST_MAGIC);
+		ocssd_frame_header header(ALLOC_VSSD_REQUEST, tag_, REQUEST_ALLOC_SIZE);
+
+		buffer += header.serialize(buffer);
 		serialize_data4(buffer, num_channels_);
 		serialize_data4(buffer, num_blocks_);
 		serialize_data4(buffer, shared_);
 		serialize_data4(buffer, numa_id_);
 		serialize_data4(buffer, remote_);
+		serialize_data4(buffer, init_mode_);
+		serialize_data4(buffer, qos_.iops);
+		serialize_data4(buffer, qos_.weight);
+		serialize_data8(buffer, qos_.bandwidth);
 		return buffer - start;
 	}
 
+	void set_tag(uint64_t tag) {tag_ = tag;}
+	void set_qos(const ocssd_qos &qos) {qos_ = qos;}
+	uint64_t get_tag() {return tag_;}
 	uint32_t get_channels() {return num_channels_;}
 	uint32_t get_blocks() {return num_blocks_;}
 	void dec_channels(size_t channels) {num_channels_ -= channels;}
 	uint32_t get_shared() {return shared_;}
 	uint32_t get_numa_id() {return numa_id_;}
 	uint32_t get_remote() {return remote_;}
+	uint32_t get_init_mode() {return init_mode_;}
+	const ocssd_qos & get_qos() const {return qos_;}
 
 private:
 
+	uint64_t tag_;
 	uint32_t num_channels_;
 	uint32_t num_blocks_;
 	uint32_t shared_;
 	uint32_t numa_id_;
 	uint32_t remote_;
+	uint32_t init_mode_;
+	ocssd_qos qos_;
+};
+
+/*
+ * Attach to a remote vSSD allocated earlier, possibly before a server
+ * restart. The vblk states come from the journal, nothing is retested.
+ *
+ * Attach request format:
+ * VSSD_ID		4 bytes
+ * RESERVED		4 bytes
+ */
+const ssize_t REQUEST_ATTACH_SIZE = wire_size<uint32_t, uint32_t>::value;
+
+class ocssd_attach_request {
+public:
+	ocssd_attach_request(uint32_t vssd_id, uint64_t tag = 0)
+		: tag_(tag), vssd_id_(vssd_id) {}
+
+	ocssd_attach_request(const ocssd_frame_header &header, const char *buffer) {
+		if (header.get_opcode() != ATTACH_VSSD_REQUEST ||
+				header.get_body_len() != REQUEST_ATTACH_SIZE) {
+			printf("Incorrect attach request: opcode %x, length %u\n",
+				header.get_opcode(), header.get_body_len());
+			throw std::runtime_error("Error: attach request failed\n");
+		}
+
+		tag_		= header.get_tag();
+		vssd_id_	= deserialize_data4(buffer);
+	}
+
+	size_t serialize(char *buffer) {
+		char *start = buffer;
+		ocssd_frame_header header(ATTACH_VSSD_REQUEST, tag_, REQUEST_ATTACH_SIZE);
+
+		buffer += header.serialize(buffer);
+		serialize_data4(buffer, vssd_id_);
+		serialize_data4(buffer, 0);
+		return buffer - start;
+	}
+
+	uint64_t get_tag() {return tag_;}
+	uint32_t get_vssd_id() {return vssd_id_;}
+
+private:
+
+	uint64_t tag_;
+	uint32_t vssd_id_;
+};
+
+/*
+ * Give a vSSD back. The reply is a status; the capacity is reused once
+ * the last connection attached to the vSSD, the sender's included, is
+ * closed.
+ *
+ * Release request format:
+ * VSSD_ID		4 bytes
+ * RESERVED		4 bytes
+ */
+const ssize_t REQUEST_RELEASE_SIZE = wire_size<uint32_t, uint32_t>::value;
+
+class ocssd_release_request {
+public:
+	ocssd_release_request(uint32_t vssd_id, uint64_t tag = 0)
+		: tag_(tag), vssd_id_(vssd_id) {}
+
+	ocssd_release_request(const ocssd_frame_header &header, const char *buffer) {
+		if (header.get_opcode() != RELEASE_VSSD_REQUEST ||
+				header.get_body_len() != REQUEST_RELEASE_SIZE) {
+			printf("Incorrect release request: opcode %x, length %u\n",
+				header.get_opcode(), header.get_body_len());
+			throw std::runtime_error("Error: release request failed\n");
+		}
+
+		tag_		= header.get_tag();
+		vssd_id_	= deserialize_data4(buffer);
+	}
+
+	size_t serialize(char *buffer) {
+		char *start = buffer;
+		ocssd_frame_header header(RELEASE_VSSD_REQUEST, tag_, REQUEST_RELEASE_SIZE);
+
+		buffer += header.serialize(buffer);
+		serialize_data4(buffer, vssd_id_);
+		serialize_data4(buffer, 0);
+		return buffer - start;
+	}
+
+	uint64_t get_tag() {return tag_;}
+	uint32_t get_vssd_id() {return vssd_id_;}
+
+private:
+
+	uint64_t tag_;
+	uint32_t vssd_id_;
 };
 
 /*
@@ -379,6 +808,9 @@ private:
  *		BLOCKS_NUM	4 bytes
  *		LUN_ID		4 bytes		if SHARED == 1
  *		...
+ * QOS_IOPS			4 bytes
+ * QOS_WEIGHT			4 bytes
+ * QOS_BANDWIDTH		8 bytes
  */
 
 class virtual_ocssd_lun {
@@ -390,13 +822,13 @@ public:
 		block_start_(block_start),
 		num_blocks_(num_blocks) {}
 
-	virtual_ocssd_lun(const char *&buffer);
+	virtual_ocssd_lun(ocssd_reader &reader);
 
 	uint32_t get_lun_id() const { return lun_id_;}
 	uint32_t get_block_start() const { return block_start_;}
 	uint32_t get_num_blocks() const { return num_blocks_;}
 
-	size_t serialize(char *&buffer) const;
+	void serialize(ocssd_writer &writer) const;
 	void print() const;
 
 private:
@@ -405,27 +837,16 @@ private:
 	uint32_t num_blocks_;
 };
 
-size_t virtual_ocssd_lun::serialize(char *&buffer) const {
-	char *start = buffer;
-	char *&p = buffer;
-
-	serialize_data4(p, lun_id_);
-	serialize_data4(p, block_start_);
-	serialize_data4(p, num_blocks_);
-
-	return p - start;
+void virtual_ocssd_lun::serialize(ocssd_writer &writer) const {
+	writer.put(lun_id_);
+	writer.put(block_start_);
+	writer.put(num_blocks_);
 }
 
-virtual_ocssd_lun::virtual_ocssd_lun(const char *&buffer) {
-	const char *&p = buffer;
-
-	lun_id_ = deserialize_data4(p);
-	block_start_ = deserialize_data4(p);
-	num_blocks_ = deserialize_data4(p);
-
-	std::cout << "LUN " << lun_id_ << ": "
-		  << "block start " << block_start_ << ", "
-		  << num_blocks_ << " blocks" << std::endl;
+virtual_ocssd_lun::virtual_ocssd_lun(ocssd_reader &reader) {
+	lun_id_ = reader.get<uint32_t>();
+	block_start_ = reader.get<uint32_t>();
+	num_blocks_ = reader.get<uint32_t>();
 }
 
 void virtual_ocssd_lun::print() const {
@@ -470,8 +891,8 @@ public:
 	}
 
 	void generate_units(std::vector<uint32_t> &units);
-	size_t serialize(char *&buffer) const;
-	size_t deserialize(const char *&buffer);
+	void serialize(ocssd_writer &writer) const;
+	bool deserialize(ocssd_reader &reader);
 
 	void add(virtual_ocssd_lun * lun) {
 		luns_.push_back(lun);
@@ -504,43 +925,31 @@ void virtual_ocssd_channel::generate_units(std::vector<uint32_t> &units)
 	}
 }
 
-size_t virtual_ocssd_channel::serialize(char *&buffer) const {
-	char *start = buffer;
-	char *&p = buffer;
-
-	serialize_data4(p, channel_id_);
-	serialize_data4(p, shared_);
-	serialize_data4(p, total_blocks_);
-	serialize_data4(p, num_luns_);
+void virtual_ocssd_channel::serialize(ocssd_writer &writer) const {
+	writer.put(channel_id_);
+	writer.put(shared_);
+	writer.put(total_blocks_);
+	writer.put(num_luns_);
 
 	if (shared_ == 1) {
 		for (const virtual_ocssd_lun * lun : luns_)
-			lun->serialize(p);
+			lun->serialize(writer);
 	}
-
-	return p - start;
 }
 
-size_t virtual_ocssd_channel::deserialize(const char *&buffer) {
-	const char *start = buffer;
-	const char *&p = buffer;
-
-	channel_id_ = deserialize_data4(p);
-	shared_ = deserialize_data4(p);
-	total_blocks_ = deserialize_data4(p);
-	num_luns_ = deserialize_data4(p);
-
-	std::cout << "Channel " << channel_id_ << ": "
-		  << "shared " << shared_ << ", "
-		  << num_luns_ << " LUNs, "
-		  << total_blocks_ << " blocks" << std::endl;
+bool virtual_ocssd_channel::deserialize(ocssd_reader &reader) {
+	channel_id_ = reader.get<uint32_t>();
+	shared_ = reader.get<uint32_t>();
+	total_blocks_ = reader.get<uint32_t>();
+	num_luns_ = reader.get<uint32_t>();
 
+	/* The counts are only trusted as far as the buffer goes */
 	if (shared_ == 1) {
-		for (uint32_t i = 0; i < num_luns_; i++)
-			luns_.push_back(new virtual_ocssd_lun(p));
+		for (uint32_t i = 0; i < num_luns_ && reader.ok(); i++)
+			luns_.push_back(new virtual_ocssd_lun(reader));
 	}
 
-	return p - start;
+	return reader.ok();
 }
 
 void virtual_ocssd_channel::print() const {
@@ -570,10 +979,10 @@ public:
 	}
 
 	void generate_units(std::vector<uint32_t> &units) const;
-	size_t serialize(char *&buffer) const;
-	size_t serialize_geo(char *&buffer) const;
-	size_t deserialize(const char *&buffer);
-	size_t deserialize_geo(const char *&buffer);
+	void serialize(ocssd_writer &writer) const;
+	void serialize_geo(ocssd_writer &writer) const;
+	bool deserialize(ocssd_reader &reader);
+	void deserialize_geo(ocssd_reader &reader);
 	void add(virtual_ocssd_channel *channel) {channels_.push_back(channel);}
 
 	const std::string& get_dev_name() const {return dev_name_;}
@@ -593,87 +1002,69 @@ void virtual_ocssd_unit::generate_units(std::vector<uint32_t> &units) const
 		channel->generate_units(units);
 }
 
-size_t virtual_ocssd_unit::serialize_geo(char *&buffer) const
+void virtual_ocssd_unit::serialize_geo(ocssd_writer &writer) const
 {
-	char *start = buffer;
-	char *&p = buffer;
-
-	serialize_data8(p, geo_->nchannels);
-	serialize_data8(p, geo_->nluns);
-	serialize_data8(p, geo_->nplanes);
-	serialize_data8(p, geo_->nblocks);
-	serialize_data8(p, geo_->npages);
-	serialize_data8(p, geo_->nsectors);
-	serialize_data8(p, geo_->page_nbytes);
-	serialize_data8(p, geo_->sector_nbytes);
-	serialize_data8(p, geo_->meta_nbytes);
-
-	return p - start;
+	writer.put((uint64_t)geo_->nchannels);
+	writer.put((uint64_t)geo_->nluns);
+	writer.put((uint64_t)geo_->nplanes);
+	writer.put((uint64_t)geo_->nblocks);
+	writer.put((uint64_t)geo_->npages);
+	writer.put((uint64_t)geo_->nsectors);
+	writer.put((uint64_t)geo_->page_nbytes);
+	writer.put((uint64_t)geo_->sector_nbytes);
+	writer.put((uint64_t)geo_->meta_nbytes);
 }
 
-size_t virtual_ocssd_unit::serialize(char *&buffer) const
+void virtual_ocssd_unit::serialize(ocssd_writer &writer) const
 {
-	char *start = buffer;
-	char *&p = buffer;
-	size_t len = dev_name_.length() + 1;
+	uint32_t len = dev_name_.length() + 1;
 
-	serialize_data4(p, len);
-	memcpy(p, dev_name_.c_str(), len);
-	len = (len + 3) / 4 * 4;
-	p += len;
+	/* The name with its NUL, padded to 4 bytes */
+	writer.put(len);
+	writer.put_bytes(dev_name_.c_str(), len);
+	writer.put_zeros((len + 3) / 4 * 4 - len);
 
-	serialize_geo(p);
+	serialize_geo(writer);
 
-	serialize_data4(p, channels_.size());
+	writer.put((uint32_t)channels_.size());
 
 	for (const virtual_ocssd_channel *channel : channels_)
-		channel->serialize(p);
-
-	return p - start;
+		channel->serialize(writer);
 }
 
-size_t virtual_ocssd_unit::deserialize_geo(const char *&buffer)
+void virtual_ocssd_unit::deserialize_geo(ocssd_reader &reader)
 {
-	const char *start = buffer;
-	const char *&p = buffer;
-
-	geo_->nchannels		= deserialize_data8(p);
-	geo_->nluns		= deserialize_data8(p);
-	geo_->nplanes		= deserialize_data8(p);
-	geo_->nblocks		= deserialize_data8(p);
-	geo_->npages		= deserialize_data8(p);
-	geo_->nsectors		= deserialize_data8(p);
-	geo_->page_nbytes	= deserialize_data8(p);
-	geo_->sector_nbytes	= deserialize_data8(p);
-	geo_->meta_nbytes	= deserialize_data8(p);
-
-	return p - start;
+	geo_->nchannels		= reader.get<uint64_t>();
+	geo_->nluns		= reader.get<uint64_t>();
+	geo_->nplanes		= reader.get<uint64_t>();
+	geo_->nblocks		= reader.get<uint64_t>();
+	geo_->npages		= reader.get<uint64_t>();
+	geo_->nsectors		= reader.get<uint64_t>();
+	geo_->page_nbytes	= reader.get<uint64_t>();
+	geo_->sector_nbytes	= reader.get<uint64_t>();
+	geo_->meta_nbytes	= reader.get<uint64_t>();
 }
 
-size_t virtual_ocssd_unit::deserialize(const char *&buffer)
+bool virtual_ocssd_unit::deserialize(ocssd_reader &reader)
 {
-	const char *start = buffer;
-	const char *&p = buffer;
-	uint32_t name_len = deserialize_data4(p);
-	const char *temp = p;
+	uint32_t name_len = reader.get<uint32_t>();
+	const char *name = reader.get_bytes(((size_t)name_len + 3) / 4 * 4);
 
-	dev_name_ = temp;
-	name_len = (name_len + 3) / 4 * 4;
-	p += name_len;
+	if (!name)
+		return false;
+	dev_name_.assign(name, strnlen(name, name_len));
 
-	deserialize_geo(p);
+	deserialize_geo(reader);
 
-	uint32_t num_channel = deserialize_data4(p);
-	std::cout<< "Device " << dev_name_ << ": "
-		 << num_channel << " channels" << std::endl;
+	uint32_t num_channel = reader.get<uint32_t>();
 
-	for (uint32_t i = 0; i < num_channel; i++) {
+	for (uint32_t i = 0; i < num_channel && reader.ok(); i++) {
 		virtual_ocssd_channel *channel = new virtual_ocssd_channel();
-		channel->deserialize(p);
+		channel->deserialize(reader);
 		channels_.push_back(channel);
 	}
 
-	return p - start;
+	return reader.ok();
 }
 
 void virtual_ocssd_unit::print() const
@@ -692,58 +1083,83 @@ public:
 			delete p;
 	}
 
-	size_t serialize(char *buffer) const;
-	size_t deserialize(const char *buffer);
+	/* The bytes serialize() takes */
+	size_t get_serialized_size() const;
+	/* The length written, 0 if it does not fit in size */
+	size_t serialize(char *buffer, size_t size) const;
+	/* The length read, 0 unless buffer holds a whole vSSD */
+	size_t deserialize(const char *buffer, size_t size);
 	void add(virtual_ocssd_unit *unit) {units_.push_back(unit);}
 	void set_id(uint32_t id) {id_ = id;}
 	uint32_t get_id() const { return id_;}
+	void set_qos(const ocssd_qos &qos) {qos_ = qos;}
+	const ocssd_qos & get_qos() const {return qos_;}
 
 	size_t get_num_units() const {return units_.size();}
 	const virtual_ocssd_unit *get_unit(int i) const {return units_[i];}
 	void print() const;
 
 private:
+	void serialize(ocssd_writer &writer) const;
+
 	uint32_t id_;
 	std::vector<virtual_ocssd_unit *> units_;
+	ocssd_qos qos_;
 };
 
 const uint32_t SERIALIZE_MAGIC = 0x6502;
 
-size_t virtual_ocssd::serialize(char *buffer) const {
-	char *p = buffer;
-
-	serialize_data4(p, SERIALIZE_MAGIC);
-	serialize_data4(p, id_);
-	serialize_data4(p, units_.size());
+void virtual_ocssd::serialize(ocssd_writer &writer) const {
+	writer.put(SERIALIZE_MAGIC);
+	writer.put(id_);
+	writer.put((uint32_t)units_.size());
 
 	for (const virtual_ocssd_unit *unit : units_)
-		unit->serialize(p);
+		unit->serialize(writer);
+
+	writer.put(qos_.iops);
+	writer.put(qos_.weight);
+	writer.put(qos_.bandwidth);
+}
+
+size_t virtual_ocssd::get_serialized_size() const {
+	ocssd_writer counter;
 
-	return p - buffer;
+	serialize(counter);
+	return counter.length();
 }
 
-size_t virtual_ocssd::deserialize(const char *buffer) {
-	const char *p = buffer;
+size_t virtual_ocssd::serialize(char *buffer, size_t size) const {
+	ocssd_writer writer(buffer, size);
+
+	serialize(writer);
+	return writer.ok() ? writer.length() : 0;
+}
+
+size_t virtual_ocssd::deserialize(const char *buffer, size_t size) {
+	ocssd_reader reader(buffer, size);
 	uint32_t magic;
 	uint32_t num_unit = 0;
 
-	magic = deserialize_data4(p);
-	if (magic != SERIALIZE_MAGIC) {
-		printf("Incorrect MAGIC: %x\n", magic);
+	/* Silent, the buffer may come off the network; callers report it */
+	magic = reader.get<uint32_t>();
+	if (magic != SERIALIZE_MAGIC)
 		return 0;
-	}
 
-	id_ = deserialize_data4(p);
-	num_unit = deserialize_data4(p);
-	printf("ID %u, %u Devices\n", id_, num_unit);
+	id_ = reader.get<uint32_t>();
+	num_unit = reader.get<uint32_t>();
 
-	for (uint32_t i = 0; i < num_unit; i++) {
+	for (uint32_t i = 0; i < num_unit && reader.ok(); i++) {
 		virtual_ocssd_unit *unit = new virtual_ocssd_unit();
-		unit->deserialize(p);
+		unit->deserialize(reader);
 		units_.push_back(unit);
 	}
 
-	return p - buffer;
+	qos_.iops = reader.get<uint32_t>();
+	qos_.weight = reader.get<uint32_t>();
+	qos_.bandwidth = reader.get<uint64_t>();
+
+	return reader.ok() ? reader.length() : 0;
 }
 
 void virtual_ocssd::print() const {
@@ -754,14 +1170,24 @@ void virtual_ocssd::print() const {
 
 /* ====================== Physical resource ======================== */
 
-/* OCSSD LUN(Die) */
+/*
+ * OCSSD LUN(Die)
+ *
+ * Free blocks are kept as extents, start -> length, merged with their
+ * neighbours when blocks come back, so a LUN churned by short lived
+ * vSSDs still hands out long runs.
+ */
 class ocssd_lun {
 
 public:
 	ocssd_lun(size_t lun_id, size_t num_blocks)
 		:lun_id_(lun_id),
 		num_used_(0),
-		num_blocks_(num_blocks) {}
+		num_blocks_(num_blocks)
+	{
+		if (num_blocks > 0)
+			free_[0] = num_blocks;
+	}
 
 	~ocssd_lun() {}
 
@@ -777,24 +1203,118 @@ public:
 		return num_used_;
 	}
 
+	/* The first extent that fits, or the longest one if none does */
 	size_t alloc_blocks(std::pair<size_t, size_t> & block_unit, size_t request_blocks) {
-		if (num_used_ == num_blocks_ || request_blocks == 0)
+		if (free_.empty() || request_blocks == 0)
 			return 0;
 
-		size_t allocated = std::min(request_blocks, num_blocks_ - num_used_);
+		auto best = free_.begin();
+		for (auto it = free_.begin(); it != free_.end(); ++it) {
+			if (it->second >= request_blocks) {
+				best = it;
+				break;
+			}
+			if (it->second > best->second)
+				best = it;
+		}
+
+		size_t start = best->first;
+		size_t len = best->second;
+		size_t allocated = std::min(request_blocks, len);
 
-		block_unit.first = num_used_;
+		free_.erase(best);
+		if (len > allocated)
+			free_[start + allocated] = len - allocated;
+
+		block_unit.first = start;
 		block_unit.second = allocated;
 		num_used_ += allocated;
 
 		return allocated;
 	}
 
+	/* Take blocks handed out before a restart, returns the newly used */
+	size_t reserve_blocks(size_t block_start, size_t num_blocks) {
+		size_t end = std::min(block_start + num_blocks, num_blocks_);
+		size_t reserved = 0;
+
+		if (block_start >= end)
+			return 0;
+
+		auto it = free_.upper_bound(block_start);
+		if (it != free_.begin())
+			--it;
+
+		while (it != free_.end() && it->first < end) {
+			size_t start = it->first;
+			size_t stop = start + it->second;
+
+			if (stop <= block_start) {
+				++it;
+				continue;
+			}
+
+			it = free_.erase(it);
+			if (start < block_start)
+				free_[start] = block_start - start;
+			if (stop > end)
+				free_[end] = stop - end;
+			reserved += std::min(stop, end) - std::max(start, block_start);
+		}
+
+		num_used_ += reserved;
+		return reserved;
+	}
+
+	/* Give blocks back, returns how many were in use */
+	size_t release_blocks(size_t block_start, size_t num_blocks) {
+		size_t end = std::min(block_start + num_blocks, num_blocks_);
+
+		if (block_start >= end)
+			return 0;
+
+		size_t released = end - block_start;
+		size_t merged_start = block_start;
+		size_t merged_end = end;
+
+		/* Swallow the extents that touch or overlap the range */
+		auto it = free_.lower_bound(block_start);
+		if (it != free_.begin()) {
+			auto prev = std::prev(it);
+			if (prev->first + prev->second >= block_start)
+				it = prev;
+		}
+
+		while (it != free_.end() && it->first <= end) {
+			size_t start = it->first;
+			size_t stop = start + it->second;
+
+			if (stop > block_start && start < end)
+				released -= std::min(stop, end) - std::max(start, block_start);
+			merged_start = std::min(merged_start, start);
+			merged_end = std::max(merged_end, stop);
+			it = free_.erase(it);
+		}
+
+		free_[merged_start] = merged_end - merged_start;
+		num_used_ -= released;
+		return released;
+	}
+
 private:
 
 	size_t lun_id_;
 	size_t num_used_;
 	size_t num_blocks_;
+	std::map<size_t, size_t> free_;
+};
+
+/* Orders (free, index) keys by most free first, then lowest index */
+struct ocssd_more_free {
+	bool operator()(const std::pair<size_t, size_t> &a,
+			const std::pair<size_t, size_t> &b) const {
+		return a.first != b.first ? a.first > b.first : a.second < b.second;
+	}
 };
 
 /* OCSSD channel */
@@ -826,6 +1346,10 @@ public:
 		shared_ = 1;
 	}
 
+	int is_shared() {
+		return shared_;
+	}
+
 	size_t used() {
 		return used_;
 	}
@@ -834,6 +1358,10 @@ public:
 		used_ = 1;
 	}
 
+	void clear_used() {
+		used_ = 0;
+	}
+
 	size_t get_channel_id() {
 		return channel_id_;
 	}
@@ -869,6 +1397,9 @@ public:
 			std::pair<size_t, size_t> block_units;
 			size_t ret = lun->alloc_blocks(block_units, request_per_lun);
 
+			if (ret == 0)
+				continue;
+
 			alloc_units.push_back(std::pair<size_t, std::pair<size_t, size_t>>
 						(lun->get_lun_id(), block_units));
 
@@ -882,6 +1413,18 @@ public:
 		return allocated;
 	}
 
+	void reserve_blocks(size_t lun_id, size_t block_start, size_t num_blocks) {
+		if (lun_id < num_luns_)
+			num_used_blocks_ += luns_[lun_id]->reserve_blocks(block_start,
+								num_blocks);
+	}
+
+	void release_blocks(size_t lun_id, size_t block_start, size_t num_blocks) {
+		if (lun_id < num_luns_)
+			num_used_blocks_ -= luns_[lun_id]->release_blocks(block_start,
+								num_blocks);
+	}
+
 private:
 
 	size_t channel_id_;
@@ -927,16 +1470,33 @@ public:
 		return desc_;
 	}
 
+	const std::string & get_ip() {
+		return ip_;
+	}
+
+	/* -1 if the platform does not tell */
+	int get_numa_node() {
+		return numa_node_;
+	}
+
 	size_t alloc_channels(virtual_ocssd *vssd, ocssd_alloc_request *request);
+	int restore_channels(const virtual_ocssd_unit *vunit);
+	int release_channels(const virtual_ocssd_unit *vunit);
 	int get_ocssd_stats(
 		size_t &numSharedChannels,
 		size_t &numExclusiveChannels,
 		size_t &freeBlocks);
 
+	/* Channels with room left, of each kind */
+	size_t get_free_channels(int shared);
+
 private:
 
 	int initialize_dev();
 	int assign_to_shared(ocssd_channel *channel);
+	ocssd_channel *find_channel(uint32_t channel_id, int shared, size_t &idx);
+	void update_shared(size_t idx);
+	void set_exclusive_free(size_t idx, bool free);
 
 	size_t alloc_shared_channels(virtual_ocssd_unit *vunit,
 		virtual_ocssd *vssd, ocssd_alloc_request *request);
@@ -946,12 +1506,29 @@ private:
 	std::string ip_;
 	std::string name_;
 	std::string desc_;
+	int numa_node_ = -1;
 	struct nvm_dev *dev_;
 	const struct nvm_geo *geo_;
 	std::mutex mutex_;
 	int channel_count_ = 0;
 	std::vector<ocssd_channel *> shared_channels_;
 	std::vector<ocssd_channel *> exclusive_channels_;
+
+	/* Index of each channel ID in the shared or exclusive list */
+	std::vector<size_t> channel_slots_;
+
+	/*
+	 * Free capacity, updated as blocks and channels are handed out so
+	 * that allocation and stats never walk every channel: the shared
+	 * channels with free blocks ordered by how many, as (free blocks,
+	 * index), and a bitmap of the free exclusive channels.
+	 */
+	std::set<std::pair<size_t, size_t>, ocssd_more_free> shared_by_free_;
+	std::vector<size_t> shared_free_;
+	size_t shared_free_blocks_ = 0;
+	std::vector<uint64_t> exclusive_free_;
+	size_t num_exclusive_free_ = 0;
+	size_t exclusive_free_blocks_ = 0;
 };
 
 int ocssd_unit::assign_to_shared(ocssd_channel *channel)
@@ -962,12 +1539,72 @@ int ocssd_unit::assign_to_shared(ocssd_channel *channel)
 	return 0;
 }
 
+/* The NUMA node of the PCI device behind a block device path, or -1 */
+static int device_numa_node(const std::string &name)
+{
+	std::string dev = name.substr(name.rfind('/') + 1);
+	const std::string paths[] = {
+		"/sys/class/block/" + dev + "/device/device/numa_node",
+		"/sys/class/block/" + dev + "/device/numa_node",
+	};
+
+	for (const std::string &path : paths) {
+		FILE *file = fopen(path.c_str(), "r");
+		int node;
+
+		if (!file)
+			continue;
+
+		int ret = fscanf(file, "%d", &node);
+		fclose(file);
+		if (ret == 1)
+			return node;
+	}
+
+	return -1;
+}
+
+/* The CPUs of a NUMA node, from its sysfs cpulist; false if unknown */
+static inline bool numa_node_cpus(int node, cpu_set_t *cpus)
+{
+	std::string path = "/sys/devices/system/node/node" +
+				std::to_string(node) + "/cpulist";
+	FILE *file;
+	int first, last;
+	bool found = false;
+
+	CPU_ZERO(cpus);
+	if (node < 0 || !(file = fopen(path.c_str(), "r")))
+		return false;
+
+	/* Ranges like 0-15,32-47 */
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		if (fscanf(file, "-%d", &last) < 0)
+			last = first;
+
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, cpus);
+			found = true;
+		}
+
+		if (fgetc(file) != ',')
+			break;
+	}
+
+	fclose(file);
+	return found;
+}
+
 int ocssd_unit::initialize_dev()
 {
 	geo_ = nvm_dev_get_geo(dev_);
 	printf("geo: %lu channels, %lu LUNs per channel, %lu blocks per LUN\n",
 		geo_->nchannels, geo_->nluns, geo_->nblocks);
 
+	numa_node_ = device_numa_node(name_);
+	printf("%s: NUMA node %d\n", name_.c_str(), numa_node_);
+
 	for (size_t channel_id = 0; channel_id < geo_->nchannels; channel_id++) {
 		ocssd_channel *channel = new ocssd_channel(channel_id,
 							geo_->nluns,
@@ -975,9 +1612,15 @@ int ocssd_unit::initialize_dev()
 
 		if (assign_to_shared(channel)) {
 			channel->set_shared();
+			channel_slots_.push_back(shared_channels_.size());
 			shared_channels_.push_back(channel);
+			shared_free_.push_back(0);
+			update_shared(shared_channels_.size() - 1);
 		} else {
+			channel_slots_.push_back(exclusive_channels_.size());
 			exclusive_channels_.push_back(channel);
+			exclusive_free_.resize((exclusive_channels_.size() + 63) / 64, 0);
+			set_exclusive_free(exclusive_channels_.size() - 1, true);
 		}
 
 		channel_count_++;
@@ -990,24 +1633,65 @@ int ocssd_unit::initialize_dev()
 	return 0;
 }
 
+/*
+ * Re-key shared channel idx after its free blocks changed. Called with
+ * mutex_ held
+ */
+void ocssd_unit::update_shared(size_t idx)
+{
+	size_t free_blocks = shared_channels_[idx]->get_free_blocks();
+
+	shared_by_free_.erase(std::make_pair(shared_free_[idx], idx));
+	shared_free_blocks_ = shared_free_blocks_ - shared_free_[idx] + free_blocks;
+	shared_free_[idx] = free_blocks;
+	if (free_blocks > 0)
+		shared_by_free_.insert(std::make_pair(free_blocks, idx));
+}
+
+/* Called with mutex_ held */
+void ocssd_unit::set_exclusive_free(size_t idx, bool free)
+{
+	uint64_t bit = 1ULL << (idx % 64);
+	uint64_t &word = exclusive_free_[idx / 64];
+
+	/* A free exclusive channel has all of its blocks free */
+	if (free && !(word & bit)) {
+		num_exclusive_free_++;
+		exclusive_free_blocks_ += exclusive_channels_[idx]->get_total_blocks();
+	} else if (!free && (word & bit)) {
+		num_exclusive_free_--;
+		exclusive_free_blocks_ -= exclusive_channels_[idx]->get_total_blocks();
+	}
+
+	word = free ? word | bit : word & ~bit;
+}
+
+/* The channels with the most free blocks first, which keeps the shared
+ * channels evenly used */
 size_t ocssd_unit::alloc_shared_channels(virtual_ocssd_unit *vunit,
 	virtual_ocssd *vssd, ocssd_alloc_request *request)
 {
 	size_t channels = 0;
 	/* FIXME: Distribute the request among channels */
 	size_t blocks_per_channel = request->get_blocks() / request->get_channels();
+	std::vector<size_t> picked;
+
+	for (auto it = shared_by_free_.begin(); it != shared_by_free_.end() &&
+			picked.size() < request->get_channels(); ++it)
+		picked.push_back(it->second);
 
-	for (ocssd_channel *channel : shared_channels_) {
+	for (size_t idx : picked) {
+		ocssd_channel *channel = shared_channels_[idx];
 		std::vector<std::pair<size_t, std::pair<size_t, size_t>>> alloc_units;
 		size_t allocated = channel->alloc_blocks(alloc_units, blocks_per_channel);
+
+		update_shared(idx);
 		if (allocated > 0) {
 			virtual_ocssd_channel *vchannel =
 				new virtual_ocssd_channel(channel->get_channel_id(), 1, alloc_units);
 
 			vunit->add(vchannel);
 			channels++;
-			if (channels == request->get_channels())
-				break;
 		}
 	}
 
@@ -1019,21 +1703,23 @@ size_t ocssd_unit::alloc_exclusive_channels(virtual_ocssd_unit *vunit,
 {
 	size_t channels = 0;
 
-	for (ocssd_channel *channel : exclusive_channels_) {
-		if (channel->used())
-			continue;
+	for (size_t w = 0; w < exclusive_free_.size() &&
+			channels < request->get_channels(); w++) {
+		while (exclusive_free_[w] && channels < request->get_channels()) {
+			size_t idx = w * 64 + __builtin_ctzll(exclusive_free_[w]);
+			ocssd_channel *channel = exclusive_channels_[idx];
 
-		channel->set_used();
-		virtual_ocssd_channel *vchannel =
-			new virtual_ocssd_channel(channel->get_channel_id(), 0,
-						channel->get_total_blocks(),
-						channel->get_num_luns());
+			channel->set_used();
+			set_exclusive_free(idx, false);
 
-		vunit->add(vchannel);
+			virtual_ocssd_channel *vchannel =
+				new virtual_ocssd_channel(channel->get_channel_id(), 0,
+							channel->get_total_blocks(),
+							channel->get_num_luns());
 
-		channels++;
-		if (channels == request->get_channels())
-			break;
+			vunit->add(vchannel);
+			channels++;
+		}
 	}
 
 	return channels;
@@ -1063,46 +1749,145 @@ size_t ocssd_unit::alloc_channels(virtual_ocssd *vssd, ocssd_alloc_request *requ
 	return channels;
 }
 
-int ocssd_unit::get_ocssd_stats(
-	size_t &numSharedChannels,
-	size_t &numExclusiveChannels,
-	size_t &freeBlocks)
+/*
+ * The channel of a vSSD, and its index in the shared or exclusive list.
+ * Called with mutex_ held
+ */
+ocssd_channel *ocssd_unit::find_channel(uint32_t channel_id, int shared, size_t &idx)
 {
-	size_t shared = 0;
-	size_t exclusive = 0;
-	size_t blocks = 0;
-	size_t free_blocks = 0;
+	if (channel_id >= channel_slots_.size()) {
+		printf("%s: no channel %u on %s\n", __func__,
+			channel_id, name_.c_str());
+		return NULL;
+	}
+
+	std::vector<ocssd_channel *> &channels =
+		shared ? shared_channels_ : exclusive_channels_;
+
+	idx = channel_slots_[channel_id];
+	if (idx >= channels.size() || channels[idx]->get_channel_id() != channel_id)
+		return NULL;
 
+	return channels[idx];
+}
+
+/* Mark the channels and blocks of a journaled vSSD as allocated */
+int ocssd_unit::restore_channels(const virtual_ocssd_unit *vunit)
+{
 	MutexLock lock(&mutex_);
 
-	for (ocssd_channel *channel : shared_channels_) {
-		free_blocks = channel->get_free_blocks();
-		if (free_blocks > 0) {
-			blocks += free_blocks;
-			shared++;
+	for (const virtual_ocssd_channel *vchannel : vunit->get_channels()) {
+		size_t idx;
+		ocssd_channel *channel = find_channel(vchannel->get_channel_id(),
+						vchannel->is_shared(), idx);
+
+		if (!channel)
+			continue;
+
+		if (!vchannel->is_shared()) {
+			channel->set_used();
+			set_exclusive_free(idx, false);
+			continue;
 		}
+
+		for (const virtual_ocssd_lun *vlun : vchannel->get_luns())
+			channel->reserve_blocks(vlun->get_lun_id(),
+						vlun->get_block_start(),
+						vlun->get_num_blocks());
+		update_shared(idx);
 	}
 
-	for (ocssd_channel *channel : exclusive_channels_) {
-		free_blocks = channel->get_free_blocks();
-		if (free_blocks > 0) {
-			blocks += free_blocks;
-			exclusive++;
+	return 0;
+}
+
+/* Give the channels and blocks of a vSSD back */
+int ocssd_unit::release_channels(const virtual_ocssd_unit *vunit)
+{
+	MutexLock lock(&mutex_);
+
+	for (const virtual_ocssd_channel *vchannel : vunit->get_channels()) {
+		size_t idx;
+		ocssd_channel *channel = find_channel(vchannel->get_channel_id(),
+						vchannel->is_shared(), idx);
+
+		if (!channel)
+			continue;
+
+		if (!vchannel->is_shared()) {
+			channel->clear_used();
+			set_exclusive_free(idx, true);
+			continue;
 		}
+
+		for (const virtual_ocssd_lun *vlun : vchannel->get_luns())
+			channel->release_blocks(vlun->get_lun_id(),
+						vlun->get_block_start(),
+						vlun->get_num_blocks());
+		update_shared(idx);
 	}
 
-	numSharedChannels = shared;
-	numExclusiveChannels = exclusive;
-	freeBlocks = blocks;
+	return 0;
+}
+
+int ocssd_unit::get_ocssd_stats(
+	size_t &numSharedChannels,
+	size_t &numExclusiveChannels,
+	size_t &freeBlocks)
+{
+	MutexLock lock(&mutex_);
+
+	numSharedChannels = shared_by_free_.size();
+	numExclusiveChannels = num_exclusive_free_;
+	freeBlocks = shared_free_blocks_ + exclusive_free_blocks_;
 
 	return 0;
 }
 
+size_t ocssd_unit::get_free_channels(int shared)
+{
+	MutexLock lock(&mutex_);
+
+	return shared == 1 ? shared_by_free_.size() : num_exclusive_free_;
+}
+
+/* Block states kept in the journal, as in the vblk tools */
+enum BlkState {
+	kFree		= 0x1,
+	kOpen		= 0x2,
+	kReserved	= 0x4,
+	kBad		= 0x8,
+};
+
+/*
+ * Journal record types:
+ * JOURNAL_ALLOC_VSSD		A serialized virtual OCSSD
+ * JOURNAL_VBLK_STATE		VSSD_ID 4 bytes, FIRST_VBLK 4 bytes,
+ *				NUM_VBLKS 4 bytes, then per vblk:
+ *				STATE 4 bytes, POS_WRITE 8 bytes
+ * JOURNAL_RELEASE_VSSD		VSSD_ID 4 bytes
+ */
+enum JOURNAL_RECORD {
+	JOURNAL_ALLOC_VSSD = 1,
+	JOURNAL_VBLK_STATE,
+	JOURNAL_RELEASE_VSSD,
+};
+
+/* Checkpoint once the log grows past this */
+#define JOURNAL_CHECKPOINT_SIZE (16 * 1024 * 1024)
+
+struct ocssd_vblk_record {
+	uint32_t state;
+	uint64_t pos_write;
+};
+
+/* The vblks of a remote vSSD, see ocssd_conn.h */
+struct ocssd_vssd_blocks;
+
 /* Represents all the OCSSDs on a single node */
 class ocssd_manager {
 public:
 
-	ocssd_manager() : count_(0), vssd_id_(0) {
+	ocssd_manager() : count_(0), vssd_id_(0), journal_(NULL) {
 		ip_ = get_ip();
 		std::cout << ip_ << std::endl;
 	}
@@ -1110,20 +1895,85 @@ public:
 	~ocssd_manager() {
 		for (auto unit : ocssds_)
 			delete unit;
+		delete journal_;
 	}
 
 	int add_ocssd(const std::string &name);
 	size_t alloc_ocssd_resource(virtual_ocssd *vssd, ocssd_alloc_request *request);
 	const std::vector<ocssd_unit *> & get_units();
-	int persist() { return 0;}
+
+	/* Restore the allocations in the journal at path, and keep it */
+	int open_journal(const std::string &path);
+
+	/* Journal the state of vblks [first, first + blks.size()) */
+	void record_vblks(uint32_t vssd_id, uint32_t first,
+		const std::vector<ocssd_vblk_record> &blks);
+	void get_vblks(uint32_t vssd_id, std::vector<ocssd_vblk_record> &blks);
+
+	/* A copy of an allocated vSSD, NULL if there is none */
+	virtual_ocssd *get_vssd(uint32_t vssd_id);
+
+	/*
+	 * Connections count themselves on the vSSD they use. A released
+	 * vSSD cannot be held any more, and its capacity goes back to the
+	 * units once the last holder puts it. freed then runs, with the
+	 * manager locked, on the thread of that holder.
+	 */
+	int hold_vssd(uint32_t vssd_id);
+	void put_vssd(uint32_t vssd_id);
+	int release_vssd(uint32_t vssd_id,
+		std::function<void()> freed = std::function<void()>());
+
+	/*
+	 * The vblks of a held vSSD, one set for all its connections: the
+	 * set already in use, else fresh, which is the one in use from now.
+	 */
+	std::shared_ptr<ocssd_vssd_blocks> share_blocks(uint32_t vssd_id,
+		const std::shared_ptr<ocssd_vssd_blocks> &fresh);
+
+	int persist();
 
 private:
 
+	struct vssd_record {
+		vssd_record() : refs(0), released(false) {}
+
+		std::string desc;
+		std::vector<ocssd_vblk_record> blks;
+		int refs;
+		bool released;
+		std::function<void()> freed;	/* See release_vssd() */
+
+		/* Owned by the connections, gone with the last of them */
+		std::weak_ptr<ocssd_vssd_blocks> blocks;
+	};
+
+	void apply_record(uint32_t type, const char *data, size_t len);
+	int restore_vssd(const virtual_ocssd *vssd);
+	void free_vssd(uint32_t vssd_id);
+	void reindex(size_t idx);
+	std::string encode_vblks(uint32_t vssd_id, uint32_t first,
+		const std::vector<ocssd_vblk_record> &blks);
+	int checkpoint();
+
 	std::string ip_;
 	std::mutex mutex_;
 	std::vector<ocssd_unit *> ocssds_;
 	int count_;
 	uint32_t vssd_id_;
+
+	/*
+	 * Units by free channels, exclusive [0] and shared [1], as (free
+	 * channels, index in ocssds_). Guarded by alloc_mutex_, which is
+	 * never held while waiting for mutex_, so journal syncs do not
+	 * stall allocations.
+	 */
+	std::mutex alloc_mutex_;
+	std::set<std::pair<size_t, size_t>, ocssd_more_free> units_by_free_[2];
+	std::vector<std::pair<size_t, size_t>> unit_keys_;
+
+	ocssd_journal *journal_;
+	std::map<uint32_t, vssd_record> vssds_;
 };
 
 int ocssd_manager::add_ocssd(const std::string &name)
@@ -1132,31 +1982,412 @@ int ocssd_manager::add_ocssd(const std::string &name)
 	ocssd_unit *unit = new ocssd_unit(ip_, name);
 	ocssds_.push_back(unit);
 	count_++;
+
+	MutexLock alloc_lock(&alloc_mutex_);
+	unit_keys_.push_back(std::make_pair(0, 0));
+	reindex(ocssds_.size() - 1);
 	return 0;
 }
 
+/*
+ * Re-key unit idx after its free channels changed. Called with
+ * alloc_mutex_ held
+ */
+void ocssd_manager::reindex(size_t idx)
+{
+	std::pair<size_t, size_t> &keys = unit_keys_[idx];
+
+	units_by_free_[0].erase(std::make_pair(keys.first, idx));
+	units_by_free_[1].erase(std::make_pair(keys.second, idx));
+
+	keys.first = ocssds_[idx]->get_free_channels(0);
+	keys.second = ocssds_[idx]->get_free_channels(1);
+
+	if (keys.first)
+		units_by_free_[0].insert(std::make_pair(keys.first, idx));
+	if (keys.second)
+		units_by_free_[1].insert(std::make_pair(keys.second, idx));
+}
+
 size_t ocssd_manager::alloc_ocssd_resource(virtual_ocssd *vssd, ocssd_alloc_request *request)
 {
 	size_t channels = 0;
 
-	MutexLock lock(&mutex_);
-
-	for (auto unit : ocssds_) {
-		size_t ret = unit->alloc_channels(vssd, request);
+	{
+		MutexLock lock(&alloc_mutex_);
+		auto &index = units_by_free_[request->get_shared() == 1];
+		int numa = request->get_numa_id();
+		std::vector<size_t> picked;
+		size_t room = 0;
+
+		/*
+		 * The units with the most free channels, enough to cover the
+		 * request, those on the requested NUMA node first
+		 */
+		for (int local = 1; local >= 0; local--) {
+			for (auto it = index.begin(); it != index.end() &&
+					room < request->get_channels(); ++it) {
+				if ((ocssds_[it->second]->get_numa_node() == numa) != (local == 1))
+					continue;
+
+				picked.push_back(it->second);
+				room += it->first;
+			}
+		}
 
-		channels += ret;
+		for (size_t idx : picked) {
+			size_t ret = ocssds_[idx]->alloc_channels(vssd, request);
 
-		request->dec_channels(ret);
+			channels += ret;
+			request->dec_channels(ret);
+			reindex(idx);
 
-		if (request->get_channels() == 0)
-			break;
+			if (request->get_channels() == 0)
+				break;
+		}
 	}
 
+	MutexLock lock(&mutex_);
+
 	vssd->set_id(vssd_id_);
+	vssd->set_qos(request->get_qos());
 	vssd_id_++;
+
+	/* Kept with or without a journal, a release needs the layout */
+	if (channels > 0) {
+		std::vector<char> buffer(vssd->get_serialized_size());
+		vssd_record &record = vssds_[vssd->get_id()];
+
+		record.desc.assign(buffer.data(),
+			vssd->serialize(buffer.data(), buffer.size()));
+		if (journal_)
+			journal_->append(JOURNAL_ALLOC_VSSD, record.desc, true);
+	}
+
 	return channels;
 }
 
+int ocssd_manager::restore_vssd(const virtual_ocssd *vssd)
+{
+	for (size_t i = 0; i < vssd->get_num_units(); i++) {
+		const virtual_ocssd_unit *vunit = vssd->get_unit(i);
+		bool found = false;
+
+		for (auto unit : ocssds_) {
+			if (unit->get_name() == vunit->get_dev_name()) {
+				unit->restore_channels(vunit);
+				found = true;
+			}
+		}
+
+		if (!found)
+			printf("%s: vSSD %u: device %s is gone\n", __func__,
+				vssd->get_id(), vunit->get_dev_name().c_str());
+	}
+
+	return 0;
+}
+
+/* Hand the capacity of a vSSD back and forget it. Called with mutex_ held */
+void ocssd_manager::free_vssd(uint32_t vssd_id)
+{
+	auto it = vssds_.find(vssd_id);
+	virtual_ocssd vssd;
+
+	if (it == vssds_.end())
+		return;
+
+	if (vssd.deserialize(it->second.desc.data(), it->second.desc.size())) {
+		for (size_t i = 0; i < vssd.get_num_units(); i++) {
+			const virtual_ocssd_unit *vunit = vssd.get_unit(i);
+
+			for (size_t idx = 0; idx < ocssds_.size(); idx++) {
+				if (ocssds_[idx]->get_name() != vunit->get_dev_name())
+					continue;
+
+				ocssds_[idx]->release_channels(vunit);
+
+				MutexLock alloc_lock(&alloc_mutex_);
+				reindex(idx);
+			}
+		}
+	}
+
+	std::function<void()> freed = it->second.freed;
+
+	vssds_.erase(it);
+	if (freed)
+		freed();
+}
+
+void ocssd_manager::apply_record(uint32_t type, const char *data, size_t len)
+{
+	switch (type) {
+	case JOURNAL_ALLOC_VSSD: {
+		virtual_ocssd vssd;
+
+		if (!vssd.deserialize(data, len)) {
+			printf("%s: bad vSSD record of %lu bytes, skipped\n",
+				__func__, len);
+			break;
+		}
+
+		restore_vssd(&vssd);
+		vssds_[vssd.get_id()].desc.assign(data, len);
+		vssd_id_ = std::max(vssd_id_, vssd.get_id() + 1);
+		break;
+	}
+	case JOURNAL_VBLK_STATE: {
+		const char *p = data;
+		uint32_t vssd_id = deserialize_data4(p);
+		uint32_t first = deserialize_data4(p);
+		uint32_t count = deserialize_data4(p);
+
+		if (len != 12 + count * 12UL)
+			break;
+
+		std::vector<ocssd_vblk_record> &blks = vssds_[vssd_id].blks;
+		if (blks.size() < first + count)
+			blks.resize(first + count);
+
+		for (uint32_t i = first; i < first + count; i++) {
+			blks[i].state = deserialize_data4(p);
+			blks[i].pos_write = deserialize_data8(p);
+		}
+		break;
+	}
+	case JOURNAL_RELEASE_VSSD: {
+		const char *p = data;
+
+		if (len != 4)
+			break;
+
+		free_vssd(deserialize_data4(p));
+		break;
+	}
+	default:
+		printf("%s: unknown record %u\n", __func__, type);
+		break;
+	}
+}
+
+int ocssd_manager::open_journal(const std::string &path)
+{
+	MutexLock lock(&mutex_);
+
+	try {
+		journal_ = new ocssd_journal(path);
+	} catch (std::runtime_error &e) {
+		printf("%s: %s: %s", __func__, path.c_str(), e.what());
+		return -EIO;
+	}
+
+	int ret = journal_->replay([this](uint32_t type, const char *data, size_t len) {
+		apply_record(type, data, len);
+	});
+
+	MutexLock alloc_lock(&alloc_mutex_);
+	for (size_t idx = 0; idx < ocssds_.size(); idx++)
+		reindex(idx);
+
+	std::cout << __func__ << ": " << vssds_.size() << " vSSDs restored from "
+		  << path << std::endl;
+	return ret;
+}
+
+std::string ocssd_manager::encode_vblks(uint32_t vssd_id, uint32_t first,
+	const std::vector<ocssd_vblk_record> &blks)
+{
+	size_t count = blks.size();
+	std::string payload(12 + count * 12, 0);
+	char *p = &payload[0];
+
+	serialize_data4(p, vssd_id);
+	serialize_data4(p, first);
+	serialize_data4(p, count);
+	for (size_t i = 0; i < count; i++) {
+		serialize_data4(p, blks[i].state);
+		serialize_data8(p, blks[i].pos_write);
+	}
+
+	return payload;
+}
+
+void ocssd_manager::record_vblks(uint32_t vssd_id, uint32_t first,
+	const std::vector<ocssd_vblk_record> &blks)
+{
+	MutexLock lock(&mutex_);
+
+	if (!journal_ || blks.empty())
+		return;
+
+	/* Nothing of a released vSSD outlives it */
+	auto it = vssds_.find(vssd_id);
+	if (it != vssds_.end() && it->second.released)
+		return;
+
+	std::vector<ocssd_vblk_record> &saved = vssds_[vssd_id].blks;
+
+	/*
+	 * A lost write pointer update is found again on the media when the
+	 * vSSD is restored, a lost state is not: a vblk restored as still
+	 * under test would be tested, and erased, again. So only writes
+	 * and erases, which move a vblk between free and open, do not
+	 * wait for the disk.
+	 */
+	bool sync = false;
+	for (size_t i = 0; i < blks.size(); i++) {
+		uint32_t state = blks[i].state;
+
+		if (first + i >= saved.size() || (saved[first + i].state != state &&
+				((saved[first + i].state | state) & ~(kFree | kOpen))))
+			sync = true;
+	}
+
+	if (saved.size() < first + blks.size())
+		saved.resize(first + blks.size());
+	std::copy(blks.begin(), blks.end(), saved.begin() + first);
+
+	journal_->append(JOURNAL_VBLK_STATE,
+			encode_vblks(vssd_id, first, blks), sync);
+
+	if (journal_->get_log_size() > JOURNAL_CHECKPOINT_SIZE)
+		checkpoint();
+}
+
+void ocssd_manager::get_vblks(uint32_t vssd_id, std::vector<ocssd_vblk_record> &blks)
+{
+	MutexLock lock(&mutex_);
+	auto it = vssds_.find(vssd_id);
+
+	blks.clear();
+	if (it != vssds_.end())
+		blks = it->second.blks;
+}
+
+virtual_ocssd *ocssd_manager::get_vssd(uint32_t vssd_id)
+{
+	MutexLock lock(&mutex_);
+	auto it = vssds_.find(vssd_id);
+
+	if (it == vssds_.end() || it->second.desc.empty() || it->second.released)
+		return NULL;
+
+	virtual_ocssd *vssd = new virtual_ocssd();
+	if (!vssd->deserialize(it->second.desc.data(), it->second.desc.size())) {
+		delete vssd;
+		return NULL;
+	}
+
+	return vssd;
+}
+
+int ocssd_manager::hold_vssd(uint32_t vssd_id)
+{
+	MutexLock lock(&mutex_);
+	auto it = vssds_.find(vssd_id);
+
+	if (it == vssds_.end() || it->second.desc.empty() || it->second.released)
+		return -ENOENT;
+
+	it->second.refs++;
+	return 0;
+}
+
+void ocssd_manager::put_vssd(uint32_t vssd_id)
+{
+	MutexLock lock(&mutex_);
+	auto it = vssds_.find(vssd_id);
+
+	if (it == vssds_.end() || it->second.refs == 0)
+		return;
+
+	if (--it->second.refs == 0 && it->second.released)
+		free_vssd(vssd_id);
+}
+
+std::shared_ptr<ocssd_vssd_blocks> ocssd_manager::share_blocks(uint32_t vssd_id,
+	const std::shared_ptr<ocssd_vssd_blocks> &fresh)
+{
+	MutexLock lock(&mutex_);
+	auto it = vssds_.find(vssd_id);
+
+	if (it == vssds_.end())
+		return fresh;
+
+	std::shared_ptr<ocssd_vssd_blocks> blocks = it->second.blocks.lock();
+	if (!blocks) {
+		blocks = fresh;
+		it->second.blocks = blocks;
+	}
+
+	return blocks;
+}
+
+/*
+ * The release is journaled before anything is freed: after a crash the
+ * vSSD is gone, and no connection is left to hold its blocks.
+ */
+int ocssd_manager::release_vssd(uint32_t vssd_id, std::function<void()> freed)
+{
+	MutexLock lock(&mutex_);
+	auto it = vssds_.find(vssd_id);
+
+	if (it == vssds_.end() || it->second.desc.empty() || it->second.released)
+		return -ENOENT;
+
+	if (journal_) {
+		std::string payload(4, 0);
+		char *p = &payload[0];
+		int ret;
+
+		serialize_data4(p, vssd_id);
+		ret = journal_->append(JOURNAL_RELEASE_VSSD, payload, true);
+		if (ret < 0)
+			return ret;
+	}
+
+	it->second.released = true;
+	it->second.freed = freed;
+	if (it->second.refs == 0)
+		free_vssd(vssd_id);
+
+	return 0;
+}
+
+/* Called with mutex_ held */
+int ocssd_manager::checkpoint()
+{
+	std::vector<std::pair<uint32_t, std::string>> records;
+
+	for (auto &it : vssds_) {
+		const vssd_record &record = it.second;
+
+		/* Released, only waiting for its connections to close */
+		if (record.released)
+			continue;
+
+		if (!record.desc.empty())
+			records.push_back(std::make_pair((uint32_t)JOURNAL_ALLOC_VSSD,
+							record.desc));
+		if (!record.blks.empty())
+			records.push_back(std::make_pair((uint32_t)JOURNAL_VBLK_STATE,
+					encode_vblks(it.first, 0, record.blks)));
+	}
+
+	return journal_->checkpoint(records);
+}
+
+int ocssd_manager::persist()
+{
+	MutexLock lock(&mutex_);
+
+	if (!journal_)
+		return 0;
+
+	return checkpoint();
+}
+
 const std::vector<ocssd_unit *> & ocssd_manager::get_units()
 {
 	return ocssds_;
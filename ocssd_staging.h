@@ -0,0 +1,247 @@
+#ifndef OCSSD_STAGING_H
+#define OCSSD_STAGING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "ocssd_server.h"
+#include "ocssd_journal.h"
+#include "ocssd_io_engine.h"
+
+/*
+ * Write staging for appends that do not fill a device write unit.
+ *
+ * A vblk only takes writes of whole write units. The bytes of a write
+ * past the last full unit are its tail: they stay in memory with the
+ * vblk, and are made durable in this log before the write is
+ * acknowledged. The next write to the vblk goes to flash behind the
+ * tail, so flash is programmed in full units only and no padding is
+ * ever written. Reads of the tail are served from memory.
+ *
+ * Each record holds the whole tail of a vblk and the flash offset it
+ * starts at; a later record at the same offset replaces it. After a
+ * restart the tail of a vblk is the record at its write pointer as read
+ * back from flash, see nvm_vblk_find_pos_write(): the journaled one may
+ * be behind, and a record at a stale pointer is a tail that was written
+ * to flash since. An empty record at offset 0 drops every tail of the
+ * vblk, for erases; the erase is only acknowledged once that record is
+ * durable, so no tail from before it comes back. Records are appended
+ * by the device workers, through the I/O engine, so the syncs never
+ * stall an event loop. Put the log on battery backed or NVRAM storage
+ * for the lowest write latency.
+ *
+ * Record payload:
+ * VSSD_ID			4 bytes
+ * VBLK				4 bytes
+ * POS				8 bytes
+ * DATA				the rest
+ */
+enum STAGE_RECORD {
+	STAGE_TAIL = 1,
+};
+
+const size_t STAGE_RECORD_HEADER_SIZE = 16;
+
+/* Rewrite the live tails once the log grows past this */
+#define STAGE_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
+class ocssd_stage_log : public ocssd_io_target {
+public:
+	/* Replays what path holds, throws if it cannot be opened */
+	ocssd_stage_log(const std::string &path);
+
+	/* The engine queue the records are appended on */
+	const std::string & get_name() const {return name_;}
+
+	static std::string encode(uint32_t vssd_id, uint32_t vblk, uint64_t pos,
+		const std::string &data);
+
+	/* The tail of a vblk that starts at pos, false if there is none */
+	bool get_tail(uint32_t vssd_id, uint32_t vblk, uint64_t pos,
+		std::string &data);
+
+	/* The tails before pos are on flash */
+	void trim(uint32_t vssd_id, uint32_t vblk, uint64_t pos);
+
+	/* Forget a vSSD, or every vSSD the manager no longer has */
+	void drop(uint32_t vssd_id);
+	void prune(ocssd_manager *manager);
+
+	/* Device workers: buf is an encoded record, synced before we return */
+	ssize_t write(const void *buf, size_t count);
+
+	ssize_t pread(void *buf, size_t count, size_t offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ssize_t erase() {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ssize_t test() {return 0;}
+	ssize_t find_pos_write() {return 0;}
+
+	size_t get_nbytes() const {return 0;}
+	uint64_t get_channel_mask() const {return 0;}
+	const std::vector<uint32_t> & get_luns() const {return luns_;}
+	size_t get_pos_write() const {return 0;}
+	void set_pos_write(size_t pos) {}
+
+	void print() const {
+		printf("stage log %s\n", name_.c_str());
+	}
+
+private:
+	ocssd_stage_log(const ocssd_stage_log &);
+	ocssd_stage_log & operator=(const ocssd_stage_log &);
+
+	typedef std::pair<uint32_t, uint32_t> vblk_key;
+
+	/* Called with mutex_ held */
+	void apply(const char *data, size_t len);
+
+	std::string name_;
+	ocssd_journal journal_;
+	std::vector<uint32_t> luns_;
+
+	std::mutex mutex_;
+	/* Tails by (vSSD, vblk), by the offset they start at */
+	std::map<vblk_key, std::map<uint64_t, std::string>> tails_;
+};
+
+ocssd_stage_log::ocssd_stage_log(const std::string &path)
+	: name_("stage:" + path), journal_(path)
+{
+	MutexLock lock(&mutex_);
+
+	journal_.replay([this](uint32_t type, const char *data, size_t len) {
+		if (type == STAGE_TAIL)
+			apply(data, len);
+	});
+}
+
+std::string ocssd_stage_log::encode(uint32_t vssd_id, uint32_t vblk,
+	uint64_t pos, const std::string &data)
+{
+	std::string payload(STAGE_RECORD_HEADER_SIZE, 0);
+	char *p = &payload[0];
+
+	serialize_data4(p, vssd_id);
+	serialize_data4(p, vblk);
+	serialize_data8(p, pos);
+	payload.append(data);
+
+	return payload;
+}
+
+void ocssd_stage_log::apply(const char *data, size_t len)
+{
+	const char *p = data;
+
+	if (len < STAGE_RECORD_HEADER_SIZE)
+		return;
+
+	uint32_t vssd_id = deserialize_data4(p);
+	uint32_t vblk = deserialize_data4(p);
+	uint64_t pos = deserialize_data8(p);
+	vblk_key key(vssd_id, vblk);
+
+	if (len == STAGE_RECORD_HEADER_SIZE)
+		tails_.erase(key);
+	else
+		tails_[key][pos].assign(p, len - STAGE_RECORD_HEADER_SIZE);
+}
+
+bool ocssd_stage_log::get_tail(uint32_t vssd_id, uint32_t vblk, uint64_t pos,
+	std::string &data)
+{
+	MutexLock lock(&mutex_);
+	auto it = tails_.find(vblk_key(vssd_id, vblk));
+
+	data.clear();
+	if (it == tails_.end())
+		return false;
+
+	auto tail = it->second.find(pos);
+	if (tail == it->second.end())
+		return false;
+
+	data = tail->second;
+	return true;
+}
+
+void ocssd_stage_log::trim(uint32_t vssd_id, uint32_t vblk, uint64_t pos)
+{
+	MutexLock lock(&mutex_);
+	auto it = tails_.find(vblk_key(vssd_id, vblk));
+
+	if (it == tails_.end())
+		return;
+
+	it->second.erase(it->second.begin(), it->second.lower_bound(pos));
+	if (it->second.empty())
+		tails_.erase(it);
+}
+
+void ocssd_stage_log::drop(uint32_t vssd_id)
+{
+	MutexLock lock(&mutex_);
+
+	tails_.erase(tails_.lower_bound(vblk_key(vssd_id, 0)),
+		tails_.upper_bound(vblk_key(vssd_id, UINT32_MAX)));
+}
+
+void ocssd_stage_log::prune(ocssd_manager *manager)
+{
+	MutexLock lock(&mutex_);
+
+	for (auto it = tails_.begin(); it != tails_.end(); ) {
+		virtual_ocssd *vssd = manager->get_vssd(it->first.first);
+
+		if (vssd) {
+			delete vssd;
+			it = tails_.upper_bound(vblk_key(it->first.first, UINT32_MAX));
+		} else {
+			it = tails_.erase(it);
+		}
+	}
+}
+
+ssize_t ocssd_stage_log::write(const void *buf, size_t count)
+{
+	MutexLock lock(&mutex_);
+	int ret;
+
+	ret = journal_.append(STAGE_TAIL, std::string((const char *)buf, count), true);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	apply((const char *)buf, count);
+
+	if (journal_.get_log_size() > STAGE_CHECKPOINT_SIZE) {
+		std::vector<std::pair<uint32_t, std::string>> records;
+
+		for (auto &it : tails_)
+			for (auto &tail : it.second)
+				records.push_back(std::make_pair((uint32_t)STAGE_TAIL,
+					encode(it.first.first, it.first.second,
+						tail.first, tail.second)));
+
+		/* The log is still whole if this fails, try again next time */
+		journal_.checkpoint(records);
+	}
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef OCSSD_STATS_H
+#define OCSSD_STATS_H
+
+#include <time.h>
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "ocssd_server.h"
+
+/*
+ * Latency histograms and counters, scraped as text from the admin
+ * socket.
+ *
+ * Each event loop thread records into its own set, which has a single
+ * writer. A vSSD may be attached on several connections, on different
+ * event loops, so its set has as many writers. Updates are relaxed
+ * atomic adds, and a compare and swap for the maximum, so recording
+ * never takes a lock and a scrape can read while the writers run.
+ */
+
+enum STATS_OP {
+	STATS_ALLOC = 0,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_ERASE,
+	STATS_NUM_OPS,
+};
+
+static const char *stats_op_names[STATS_NUM_OPS] = {
+	"alloc", "read", "write", "erase",
+};
+
+static inline uint64_t stats_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Log-linear buckets as in HdrHistogram: every power of two is split
+ * into HIST_SUB_BUCKETS linear buckets, which keeps the error of any
+ * percentile within 1 / HIST_SUB_BUCKETS of the value, from nanoseconds
+ * to hours, in a fixed array.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS (HIST_SUB_BUCKETS * (64 - HIST_SUB_BITS + 1))
+
+class ocssd_histogram {
+public:
+	ocssd_histogram() : count_(0), sum_(0), max_(0) {
+		for (auto &count : counts_)
+			count.store(0, std::memory_order_relaxed);
+	}
+
+	void record(uint64_t value) {
+		counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(value, std::memory_order_relaxed);
+
+		uint64_t max = max_.load(std::memory_order_relaxed);
+		while (value > max && !max_.compare_exchange_weak(max, value,
+						std::memory_order_relaxed))
+			;
+	}
+
+	/* Add the bucket counts to counts, which has HIST_NUM_BUCKETS */
+	void snapshot(std::vector<uint64_t> &counts) const {
+		for (int i = 0; i < HIST_NUM_BUCKETS; i++)
+			counts[i] += counts_[i].load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_count() const {return count_.load(std::memory_order_relaxed);}
+	uint64_t get_sum() const {return sum_.load(std::memory_order_relaxed);}
+	uint64_t get_max() const {return max_.load(std::memory_order_relaxed);}
+
+	static int index(uint64_t value) {
+		if (value < HIST_SUB_BUCKETS)
+			return value;
+
+		int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+		return HIST_SUB_BUCKETS * (shift + 1) +
+			((value >> shift) - HIST_SUB_BUCKETS);
+	}
+
+	/* The largest value that falls in bucket i */
+	static uint64_t upper_bound(int i) {
+		if (i < HIST_SUB_BUCKETS)
+			return i;
+
+		int shift = i / HIST_SUB_BUCKETS - 1;
+		uint64_t sub = i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+		return ((sub + 1) << shift) - 1;
+	}
+
+	/* Value at quantile q of a snapshot */
+	static uint64_t percentile(const std::vector<uint64_t> &counts, double q) {
+		uint64_t total = 0;
+		uint64_t seen = 0;
+
+		for (uint64_t count : counts)
+			total += count;
+		if (total == 0)
+			return 0;
+
+		uint64_t rank = q * total;
+		if (rank >= total)
+			rank = total - 1;
+
+		for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+			seen += counts[i];
+			if (seen > rank)
+				return upper_bound(i);
+		}
+
+		return upper_bound(HIST_NUM_BUCKETS - 1);
+	}
+
+private:
+	ocssd_histogram(const ocssd_histogram &);
+	ocssd_histogram & operator=(const ocssd_histogram &);
+
+	std::atomic<uint64_t> counts_[HIST_NUM_BUCKETS];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+};
+
+/* Latency in nanoseconds, bytes and errors of each opcode */
+struct ocssd_op_stats {
+	ocssd_op_stats() {
+		for (int op = 0; op < STATS_NUM_OPS; op++) {
+			bytes[op].store(0, std::memory_order_relaxed);
+			errors[op].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void record(STATS_OP op, uint64_t latency, size_t nbytes, bool error) {
+		latency_ns[op].record(latency);
+		if (nbytes)
+			bytes[op].fetch_add(nbytes, std::memory_order_relaxed);
+		if (error)
+			errors[op].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void dump(std::string &out, const std::string &labels) const;
+
+	ocssd_histogram latency_ns[STATS_NUM_OPS];
+	std::atomic<uint64_t> bytes[STATS_NUM_OPS];
+	std::atomic<uint64_t> errors[STATS_NUM_OPS];
+};
+
+void ocssd_op_stats::dump(std::string &out, const std::string &labels) const
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	char line[256];
+
+	for (int op = 0; op < STATS_NUM_OPS; op++) {
+		const ocssd_histogram &hist = latency_ns[op];
+		std::vector<uint64_t> counts(HIST_NUM_BUCKETS, 0);
+
+		if (hist.get_count() == 0)
+			continue;
+
+		hist.snapshot(counts);
+		for (double q : quantiles) {
+			/* Buckets report their upper bound, never above the max */
+			snprintf(line, sizeof(line),
+				"ocssd_latency_ns{%s,op=\"%s\",quantile=\"%g\"} %lu\n",
+				labels.c_str(), stats_op_names[op], q,
+				std::min(ocssd_histogram::percentile(counts, q),
+					hist.get_max()));
+			out += line;
+		}
+
+		snprintf(line, sizeof(line),
+			"ocssd_latency_ns_max{%s,op=\"%s\"} %lu\n"
+			"ocssd_latency_ns_sum{%s,op=\"%s\"} %lu\n"
+			"ocssd_ops_total{%s,op=\"%s\"} %lu\n"
+			"ocssd_errors_total{%s,op=\"%s\"} %lu\n"
+			"ocssd_bytes_total{%s,op=\"%s\"} %lu\n",
+			labels.c_str(), stats_op_names[op], hist.get_max(),
+			labels.c_str(), stats_op_names[op], hist.get_sum(),
+			labels.c_str(), stats_op_names[op], hist.get_count(),
+			labels.c_str(), stats_op_names[op],
+			errors[op].load(std::memory_order_relaxed),
+			labels.c_str(), stats_op_names[op],
+			bytes[op].load(std::memory_order_relaxed));
+		out += line;
+	}
+}
+
+/* All the stats of the server, one per process */
+class ocssd_stats {
+public:
+	ocssd_stats() {}
+
+	~ocssd_stats() {
+		for (ocssd_op_stats *stats : threads_)
+			delete stats;
+		for (auto &it : vssds_)
+			delete it.second;
+	}
+
+	/* The set of the calling thread, created on first use */
+	ocssd_op_stats *thread_stats() {
+		static thread_local ocssd_op_stats *stats = NULL;
+
+		if (!stats) {
+			MutexLock lock(&mutex_);
+			stats = new ocssd_op_stats();
+			threads_.push_back(stats);
+		}
+
+		return stats;
+	}
+
+	ocssd_op_stats *vssd_stats(uint32_t vssd_id) {
+		MutexLock lock(&mutex_);
+		ocssd_op_stats *&stats = vssds_[vssd_id];
+
+		if (!stats)
+			stats = new ocssd_op_stats();
+		return stats;
+	}
+
+	void dump(std::string &out) {
+		MutexLock lock(&mutex_);
+
+		for (size_t i = 0; i < threads_.size(); i++)
+			threads_[i]->dump(out, "thread=\"" + std::to_string(i) + "\"");
+
+		for (auto &it : vssds_)
+			it.second->dump(out, "vssd=\"" + std::to_string(it.first) + "\"");
+	}
+
+private:
+	ocssd_stats(const ocssd_stats &);
+	ocssd_stats & operator=(const ocssd_stats &);
+
+	std::mutex mutex_;
+	std::vector<ocssd_op_stats *> threads_;
+	std::map<uint32_t, ocssd_op_stats *> vssds_;
+};
+
+#endif
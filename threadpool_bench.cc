@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+
+#include "threadpool.h"
+#include "ws_threadpool.h"
+
+/*
+ * Throughput of threadpool<T> against ws_threadpool<T>: producer
+ * threads submit small requests as fast as the pool takes them.
+ *
+ * Usage: threadpool_bench [workers] [producers] [requests] [work_ns]
+ */
+
+static std::atomic<long> done(0);
+static long work_ns = 0;
+
+struct bench_request {
+	void process() {
+		if (work_ns) {
+			struct timespec start, now;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			do {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+			} while ((now.tv_sec - start.tv_sec) * 1000000000L +
+					now.tv_nsec - start.tv_nsec < work_ns);
+		}
+		done.fetch_add(1, std::memory_order_relaxed);
+	}
+};
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Submit requests from producers threads, return requests per second */
+template<typename Submit>
+static double run(int producers, long requests, Submit submit)
+{
+	std::vector<std::thread> threads;
+	long per_producer = requests / producers;
+	double start = now_sec();
+
+	done = 0;
+	for (int i = 0; i < producers; i++) {
+		threads.push_back(std::thread([&]() {
+			for (long n = 0; n < per_producer; n++)
+				submit(std::make_shared<bench_request>());
+		}));
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+	while (done.load() < per_producer * producers)
+		usleep(100);
+
+	return per_producer * producers / (now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+	int workers = argc > 1 ? atoi(argv[1]) : 8;
+	int producers = argc > 2 ? atoi(argv[2]) : 4;
+	long requests = argc > 3 ? atol(argv[3]) : 2000000;
+	work_ns = argc > 4 ? atol(argv[4]) : 0;
+
+	printf("%d workers, %d producers, %ld requests, %ld ns each\n",
+		workers, producers, requests, work_ns);
+
+	/* threadpool<T> never joins its detached workers, which go on using
+	 * it after the destructor, so it is left alive here. */
+	threadpool<bench_request> *old_pool =
+		new threadpool<bench_request>(workers, 10000);
+	double old_rate = run(producers, requests,
+		[&](const std::shared_ptr<bench_request> &request) {
+			/* append() fails when full, the caller has to spin */
+			while (!old_pool->append(request))
+				sched_yield();
+		});
+	printf("threadpool:     %10.0f requests/s\n", old_rate);
+
+	double new_rate;
+	{
+		ws_threadpool<bench_request> pool(workers, 10000);
+
+		new_rate = run(producers, requests,
+			[&](const std::shared_ptr<bench_request> &request) {
+				pool.append(request);
+			});
+	}
+	printf("ws_threadpool:  %10.0f requests/s\n", new_rate);
+
+	double batch_rate;
+	{
+		ws_threadpool<bench_request> pool(workers, 10000);
+		const size_t batch_size = 32;
+
+		batch_rate = run(producers, requests / batch_size,
+			[&](const std::shared_ptr<bench_request> &) {
+				std::vector<std::shared_ptr<bench_request>> batch;
+
+				for (size_t i = 0; i < batch_size; i++)
+					batch.push_back(std::make_shared<bench_request>());
+				pool.append_batch(batch);
+			}) * batch_size;
+	}
+	printf("  batched (32): %10.0f requests/s\n", batch_rate);
+
+	printf("speedup: %.2fx, %.2fx batched\n", new_rate / old_rate,
+		batch_rate / old_rate);
+	return 0;
+}
@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <mutex>
+
+#include "ocssd_nvm.h"
+#include "ocssd_stats.h"
+
+/*
+ * Benchmark of vblks on a device, from one request pattern to a whole
+ * sweep. Runs against an Open-Channel SSD, or against the emulator
+ * when built with make EMULATOR=1 (see ocssd_nvm.h for its settings).
+ *
+ * The units of the chosen channels and LUNs are split in order over
+ * the jobs, so as many jobs as channels give one channel each, and as
+ * many as units one LUN each. Every job is a vblk over its units at
+ * the same block index, driven by iodepth threads.
+ *
+ * Reads are sequential or random, any number of sectors. Writes are
+ * always appends, in whole write units: a block is programmed from its
+ * start, so a job issues its writes one at a time and in order, and
+ * erases its vblk when full. The depth only overlaps reads, with each
+ * other and with the append. Read runs fill the vblks first; mixed
+ * runs start erased, and read what has been written so far.
+ *
+ * Every combination of request size and depth is run for the set time,
+ * one row each in the CSV and JSON reports. The blocks used are erased:
+ * do not point it at blocks that hold data.
+ */
+
+struct bench_workload {
+	const char *name;
+	bool reads;
+	bool writes;
+	bool random;
+};
+
+static const bench_workload workloads[] = {
+	{"read",	true,	false,	false},
+	{"randread",	true,	false,	true},
+	{"write",	false,	true,	false},
+	{"rw",		true,	true,	false},
+	{"randrw",	true,	true,	true},
+};
+
+struct bench_config {
+	std::string device;
+	std::vector<int> channels;
+	std::vector<int> luns;
+	const bench_workload *workload;
+	int read_pct;
+	std::vector<size_t> sizes;
+	std::vector<int> depths;
+	int threads;
+	double seconds;
+	int blk;
+	bool sweep;
+	std::string csv;
+	std::string json;
+};
+
+/* A vblk and the threads that drive it */
+struct bench_job {
+	bench_job() : vblk(NULL), pos_write(0), written(0), pos_read(0),
+		filled(false) {
+		pthread_rwlockattr_t attr;
+
+		/* Erases must not starve behind a stream of reads */
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&erase_lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	}
+
+	~bench_job() {
+		if (vblk)
+			nvm_vblk_free(vblk);
+		pthread_rwlock_destroy(&erase_lock);
+	}
+
+	std::vector<struct nvm_addr> units;
+	struct nvm_vblk *vblk;
+	size_t nbytes;
+
+	/* Held shared by reads, exclusive by erases */
+	pthread_rwlock_t erase_lock;
+	/* Appends, in order */
+	std::mutex write_mutex;
+	size_t pos_write;
+	/* Bytes that can be read */
+	std::atomic<size_t> written;
+	std::atomic<size_t> pos_read;
+	bool filled;
+};
+
+/* What a run measured */
+struct bench_result {
+	size_t size;
+	int depth;
+	size_t nchannels;
+	size_t nunits;
+	double seconds;
+	std::vector<uint64_t> counts[STATS_NUM_OPS];
+	uint64_t ops[STATS_NUM_OPS];
+	uint64_t bytes[STATS_NUM_OPS];
+	uint64_t errors[STATS_NUM_OPS];
+	uint64_t max[STATS_NUM_OPS];
+};
+
+static void usage()
+{
+	printf("usage: ./vblk_bench -d DEVICE [options]\n"
+		"  -c CHANNELS   channels, as 0-3,8 (all)\n"
+		"  -l LUNS       LUNs of every channel (all)\n"
+		"  -w WORKLOAD   read, randread, write, rw, randrw (write)\n"
+		"  -M PERCENT    reads in rw and randrw (50)\n"
+		"  -b SIZES      request sizes in bytes, as 65536,1048576\n"
+		"                (the write unit, doubled up to 8 times)\n"
+		"  -q DEPTHS     threads per job, as 1,4,16 (1)\n"
+		"  -t JOBS       vblks driven in parallel (1)\n"
+		"  -T SECONDS    length of every run (5)\n"
+		"  -B BLOCK      block index on every unit (0), erased\n"
+		"  -S            sweep the channels: the first 1, 2, ... of -c\n"
+		"  -o FILE       CSV report\n"
+		"  -j FILE       JSON report\n");
+}
+
+/* "0-3,8" */
+static bool parse_list(const char *arg, std::vector<int> &list)
+{
+	std::string s(arg);
+	size_t start = 0;
+
+	list.clear();
+	while (start <= s.size()) {
+		size_t end = s.find(',', start);
+		std::string item = s.substr(start, end == std::string::npos ?
+			std::string::npos : end - start);
+		int first, last;
+		char c;
+
+		if (sscanf(item.c_str(), "%d-%d%c", &first, &last, &c) == 2) {
+			if (first < 0 || last < first)
+				return false;
+			for (int i = first; i <= last; i++)
+				list.push_back(i);
+		} else if (sscanf(item.c_str(), "%d%c", &first, &c) == 1 && first >= 0) {
+			list.push_back(first);
+		} else {
+			return false;
+		}
+
+		if (end == std::string::npos)
+			break;
+		start = end + 1;
+	}
+
+	return !list.empty();
+}
+
+static uint64_t percentile_us(const bench_result &result, int op, double q)
+{
+	return std::min(ocssd_histogram::percentile(result.counts[op], q),
+		result.max[op]) / 1000;
+}
+
+static void report_csv_header(FILE *out)
+{
+	fprintf(out, "workload,channels,units,jobs,iodepth,request_size,seconds");
+	for (int op = STATS_READ; op <= STATS_ERASE; op++)
+		fprintf(out, ",%s_mbps,%s_iops,%s_p50_us,%s_p99_us,%s_p999_us,"
+			"%s_max_us,%s_errors", stats_op_names[op], stats_op_names[op],
+			stats_op_names[op], stats_op_names[op], stats_op_names[op],
+			stats_op_names[op], stats_op_names[op]);
+	fprintf(out, "\n");
+}
+
+static void report_csv(FILE *out, const bench_config &config,
+	const bench_result &result)
+{
+	fprintf(out, "%s,%lu,%lu,%d,%d,%lu,%.3f", config.workload->name,
+		result.nchannels, result.nunits, config.threads, result.depth,
+		result.size, result.seconds);
+	for (int op = STATS_READ; op <= STATS_ERASE; op++)
+		fprintf(out, ",%.2f,%.0f,%lu,%lu,%lu,%lu,%lu",
+			result.bytes[op] / result.seconds / 1e6,
+			result.ops[op] / result.seconds,
+			percentile_us(result, op, 0.5),
+			percentile_us(result, op, 0.99),
+			percentile_us(result, op, 0.999),
+			result.max[op] / 1000, result.errors[op]);
+	fprintf(out, "\n");
+}
+
+static void report_json(FILE *out, const bench_config &config,
+	const bench_result &result, bool first)
+{
+	fprintf(out, "%s  {\"workload\": \"%s\", \"channels\": %lu, \"units\": %lu, "
+		"\"jobs\": %d, \"iodepth\": %d, \"request_size\": %lu, "
+		"\"seconds\": %.3f", first ? "" : ",\n", config.workload->name,
+		result.nchannels, result.nunits, config.threads, result.depth,
+		result.size, result.seconds);
+	for (int op = STATS_READ; op <= STATS_ERASE; op++)
+		fprintf(out, ",\n    \"%s\": {\"mbps\": %.2f, \"iops\": %.0f, "
+			"\"p50_us\": %lu, \"p99_us\": %lu, \"p999_us\": %lu, "
+			"\"max_us\": %lu, \"errors\": %lu}", stats_op_names[op],
+			result.bytes[op] / result.seconds / 1e6,
+			result.ops[op] / result.seconds,
+			percentile_us(result, op, 0.5),
+			percentile_us(result, op, 0.99),
+			percentile_us(result, op, 0.999),
+			result.max[op] / 1000, result.errors[op]);
+	fprintf(out, "}");
+}
+
+static void timed_erase(bench_job *job, ocssd_op_stats *stats)
+{
+	uint64_t start = stats_now_ns();
+	ssize_t res;
+
+	pthread_rwlock_wrlock(&job->erase_lock);
+	res = nvm_vblk_erase(job->vblk);
+	job->pos_write = 0;
+	job->written = 0;
+	job->pos_read = 0;
+	pthread_rwlock_unlock(&job->erase_lock);
+
+	stats->record(STATS_ERASE, stats_now_ns() - start, 0, res < 0);
+}
+
+/* Append size bytes, erasing the vblk first if it is full */
+static void timed_write(bench_job *job, const void *buf, size_t size,
+	ocssd_op_stats *stats)
+{
+	MutexLock lock(&job->write_mutex);
+	uint64_t start;
+	ssize_t res;
+
+	if (job->pos_write + size > job->nbytes)
+		timed_erase(job, stats);
+
+	start = stats_now_ns();
+	res = nvm_vblk_pwrite(job->vblk, buf, size, job->pos_write);
+	stats->record(STATS_WRITE, stats_now_ns() - start, res < 0 ? 0 : size,
+		res < 0);
+
+	/* A failed write may have programmed part of the range, skip it */
+	job->pos_write += size;
+	if (res >= 0)
+		job->written = job->pos_write;
+}
+
+/* Read size bytes of what was written, false if there is not enough */
+static bool timed_read(bench_job *job, void *buf, size_t size, bool random,
+	std::mt19937_64 &rng, ocssd_op_stats *stats)
+{
+	size_t slots, offset;
+	uint64_t start;
+	ssize_t res;
+
+	pthread_rwlock_rdlock(&job->erase_lock);
+
+	slots = job->written / size;
+	if (slots == 0) {
+		pthread_rwlock_unlock(&job->erase_lock);
+		return false;
+	}
+
+	if (random)
+		offset = rng() % slots * size;
+	else
+		offset = job->pos_read.fetch_add(size) / size % slots * size;
+
+	start = stats_now_ns();
+	res = nvm_vblk_pread(job->vblk, buf, size, offset);
+	stats->record(STATS_READ, stats_now_ns() - start, res < 0 ? 0 : size,
+		res < 0);
+
+	pthread_rwlock_unlock(&job->erase_lock);
+	return true;
+}
+
+/* Erase the vblk and write it whole, untimed */
+static int fill_job(bench_job *job, const struct nvm_geo *geo)
+{
+	size_t unit = geo->vpg_nbytes * job->units.size();
+	void *buf = nvm_buf_alloc(geo, unit);
+	int ret = 0;
+
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0x5a, unit);
+
+	if (nvm_vblk_erase(job->vblk) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	for (size_t pos = 0; pos + unit <= job->nbytes; pos += unit) {
+		if (nvm_vblk_pwrite(job->vblk, buf, unit, pos) < 0) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	job->pos_write = job->nbytes;
+	job->written = job->nbytes;
+	job->pos_read = 0;
+	job->filled = true;
+out:
+	free(buf);
+	return ret;
+}
+
+static int run(const bench_config &config, const struct nvm_geo *geo,
+	std::vector<std::unique_ptr<bench_job>> &jobs, size_t size, int depth,
+	bench_result &result)
+{
+	const bench_workload *workload = config.workload;
+	std::vector<std::unique_ptr<ocssd_op_stats>> stats;
+	std::vector<std::thread> threads;
+	uint64_t deadline, start;
+
+	for (auto &job : jobs) {
+		if (!workload->writes) {
+			if (!job->filled && fill_job(job.get(), geo) < 0) {
+				printf("fill of a vblk failed: %s\n", strerror(errno));
+				return -1;
+			}
+			continue;
+		}
+
+		job->filled = false;
+		if (nvm_vblk_erase(job->vblk) < 0) {
+			printf("erase failed: %s\n", strerror(errno));
+			return -1;
+		}
+		job->pos_write = 0;
+		job->written = 0;
+		job->pos_read = 0;
+	}
+
+	start = stats_now_ns();
+	deadline = start + config.seconds * 1e9;
+
+	for (size_t j = 0; j < jobs.size(); j++) {
+		for (int d = 0; d < depth; d++) {
+			bench_job *job = jobs[j].get();
+			ocssd_op_stats *thread_stats = new ocssd_op_stats();
+			unsigned seed = j * depth + d;
+
+			stats.push_back(std::unique_ptr<ocssd_op_stats>(thread_stats));
+			threads.push_back(std::thread([=, &config]() {
+				std::mt19937_64 rng(seed);
+				std::uniform_int_distribution<int> pct(0, 99);
+				void *buf = nvm_buf_alloc(geo, size);
+
+				if (!buf)
+					return;
+				memset(buf, seed & 0xff, size);
+
+				while (stats_now_ns() < deadline) {
+					bool read = workload->reads && (!workload->writes ||
+						pct(rng) < config.read_pct);
+
+					if (read && timed_read(job, buf, size,
+							workload->random, rng, thread_stats))
+						continue;
+					if (workload->writes)
+						timed_write(job, buf, size, thread_stats);
+				}
+
+				free(buf);
+			}));
+		}
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	result.size = size;
+	result.depth = depth;
+	result.seconds = (stats_now_ns() - start) / 1e9;
+	for (int op = 0; op < STATS_NUM_OPS; op++) {
+		result.counts[op].assign(HIST_NUM_BUCKETS, 0);
+		result.ops[op] = 0;
+		result.bytes[op] = 0;
+		result.errors[op] = 0;
+		result.max[op] = 0;
+
+		for (auto &s : stats) {
+			s->latency_ns[op].snapshot(result.counts[op]);
+			result.ops[op] += s->latency_ns[op].get_count();
+			result.bytes[op] += s->bytes[op].load();
+			result.errors[op] += s->errors[op].load();
+			result.max[op] = std::max(result.max[op],
+				s->latency_ns[op].get_max());
+		}
+	}
+
+	return 0;
+}
+
+/* Every size and depth on the units of channels */
+static int bench_channels(const bench_config &config, struct nvm_dev *dev,
+	const std::vector<int> &channels, FILE *csv, FILE *json, bool &first)
+{
+	const struct nvm_geo *geo = nvm_dev_get_geo(dev);
+	std::vector<struct nvm_addr> units;
+	std::vector<std::unique_ptr<bench_job>> jobs;
+	int ret = 0;
+
+	for (int channel : channels) {
+		for (int lun : config.luns) {
+			struct nvm_addr addr;
+
+			addr.ppa = 0;
+			addr.g.ch = channel;
+			addr.g.lun = lun;
+			addr.g.blk = config.blk;
+			units.push_back(addr);
+		}
+	}
+
+	if ((size_t)config.threads > units.size()) {
+		printf("%d jobs for %lu units\n", config.threads, units.size());
+		return -1;
+	}
+
+	for (int j = 0; j < config.threads; j++) {
+		std::unique_ptr<bench_job> job(new bench_job());
+
+		job->units.assign(units.begin() + j * units.size() / config.threads,
+			units.begin() + (j + 1) * units.size() / config.threads);
+		job->vblk = nvm_vblk_alloc(dev, job->units.data(), job->units.size());
+		if (!job->vblk) {
+			printf("nvm_vblk_alloc failed: %s\n", strerror(errno));
+			return -1;
+		}
+		job->nbytes = nvm_vblk_get_nbytes(job->vblk);
+		jobs.push_back(std::move(job));
+	}
+
+	for (size_t size : config.sizes) {
+		if (size % geo->sector_nbytes ||
+				(config.workload->writes && size % geo->vpg_nbytes)) {
+			printf("size %lu is not a multiple of the %s, skipped\n", size,
+				config.workload->writes ? "write unit" : "sector");
+			continue;
+		}
+
+		for (int depth : config.depths) {
+			bench_result result;
+
+			result.nchannels = channels.size();
+			result.nunits = units.size();
+			if (run(config, geo, jobs, size, depth, result) < 0)
+				return -1;
+
+			printf("%s channels %lu units %lu jobs %d depth %d size %lu: "
+				"read %.2f MB/s p50 %lu us p99 %lu us p999 %lu us, "
+				"write %.2f MB/s p50 %lu us p99 %lu us p999 %lu us, "
+				"%lu erases\n", config.workload->name, result.nchannels,
+				result.nunits, config.threads, depth, size,
+				result.bytes[STATS_READ] / result.seconds / 1e6,
+				percentile_us(result, STATS_READ, 0.5),
+				percentile_us(result, STATS_READ, 0.99),
+				percentile_us(result, STATS_READ, 0.999),
+				result.bytes[STATS_WRITE] / result.seconds / 1e6,
+				percentile_us(result, STATS_WRITE, 0.5),
+				percentile_us(result, STATS_WRITE, 0.99),
+				percentile_us(result, STATS_WRITE, 0.999),
+				result.ops[STATS_ERASE]);
+
+			for (int op = STATS_READ; op <= STATS_ERASE; op++) {
+				if (result.errors[op]) {
+					printf("  %lu %s errors\n", result.errors[op],
+						stats_op_names[op]);
+					ret = 1;
+				}
+			}
+
+			if (csv)
+				report_csv(csv, config, result);
+			if (json) {
+				report_json(json, config, result, first);
+				first = false;
+			}
+		}
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	bench_config config;
+	struct nvm_dev *dev;
+	const struct nvm_geo *geo;
+	FILE *csv = NULL, *json = NULL;
+	bool first = true;
+	int ret = 0;
+	int opt;
+
+	config.workload = &workloads[2];
+	config.read_pct = 50;
+	config.depths.push_back(1);
+	config.threads = 1;
+	config.seconds = 5;
+	config.blk = 0;
+	config.sweep = false;
+
+	while ((opt = getopt(argc, argv, "d:c:l:w:M:b:q:t:T:B:So:j:h")) != -1) {
+		std::vector<int> list;
+		size_t i;
+
+		switch (opt) {
+		case 'd':
+			config.device = optarg;
+			break;
+		case 'c':
+			if (!parse_list(optarg, config.channels)) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'l':
+			if (!parse_list(optarg, config.luns)) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'w':
+			for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+				if (strcmp(optarg, workloads[i].name) == 0)
+					break;
+			if (i == sizeof(workloads) / sizeof(workloads[0])) {
+				usage();
+				return 1;
+			}
+			config.workload = &workloads[i];
+			break;
+		case 'M':
+			config.read_pct = atoi(optarg);
+			break;
+		case 'b':
+			if (!parse_list(optarg, list)) {
+				usage();
+				return 1;
+			}
+			config.sizes.assign(list.begin(), list.end());
+			break;
+		case 'q':
+			if (!parse_list(optarg, config.depths)) {
+				usage();
+				return 1;
+			}
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			break;
+		case 'T':
+			config.seconds = atof(optarg);
+			break;
+		case 'B':
+			config.blk = atoi(optarg);
+			break;
+		case 'S':
+			config.sweep = true;
+			break;
+		case 'o':
+			config.csv = optarg;
+			break;
+		case 'j':
+			config.json = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (config.device.empty() || config.threads < 1 || config.seconds <= 0 ||
+			config.read_pct < 0 || config.read_pct > 100) {
+		usage();
+		return 1;
+	}
+
+	for (int depth : config.depths) {
+		if (depth < 1) {
+			usage();
+			return 1;
+		}
+	}
+
+	dev = nvm_dev_open(config.device.c_str());
+	if (!dev) {
+		perror("nvm_dev_open");
+		return 1;
+	}
+
+	geo = nvm_dev_get_geo(dev);
+
+	if (config.channels.empty())
+		for (size_t ch = 0; ch < geo->nchannels; ch++)
+			config.channels.push_back(ch);
+	if (config.luns.empty())
+		for (size_t lun = 0; lun < geo->nluns; lun++)
+			config.luns.push_back(lun);
+	if (config.sizes.empty())
+		for (size_t size = geo->vpg_nbytes; size <= geo->vpg_nbytes << 8; size *= 2)
+			config.sizes.push_back(size);
+
+	for (int ch : config.channels) {
+		if ((size_t)ch >= geo->nchannels) {
+			printf("no channel %d\n", ch);
+			ret = 1;
+		}
+	}
+	for (int lun : config.luns) {
+		if ((size_t)lun >= geo->nluns) {
+			printf("no LUN %d\n", lun);
+			ret = 1;
+		}
+	}
+	if ((size_t)config.blk >= geo->nblocks) {
+		printf("no block %d\n", config.blk);
+		ret = 1;
+	}
+	if (ret)
+		goto out;
+
+	if (!config.csv.empty()) {
+		csv = fopen(config.csv.c_str(), "w");
+		if (!csv) {
+			perror("fopen");
+			ret = 1;
+			goto out;
+		}
+		report_csv_header(csv);
+	}
+
+	if (!config.json.empty()) {
+		json = fopen(config.json.c_str(), "w");
+		if (!json) {
+			perror("fopen");
+			ret = 1;
+			goto out;
+		}
+		fprintf(json, "[\n");
+	}
+
+	if (config.sweep) {
+		for (size_t n = 1; n <= config.channels.size(); n++) {
+			std::vector<int> channels(config.channels.begin(),
+				config.channels.begin() + n);
+
+			if ((size_t)config.threads > n * config.luns.size())
+				continue;
+			if (bench_channels(config, dev, channels, csv, json, first))
+				ret = 1;
+		}
+	} else {
+		if (bench_channels(config, dev, config.channels, csv, json, first))
+			ret = 1;
+	}
+
+	if (json)
+		fprintf(json, "\n]\n");
+out:
+	if (csv)
+		fclose(csv);
+	if (json)
+		fclose(json);
+	nvm_dev_close(dev);
+	return ret;
+}
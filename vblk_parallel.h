@@ -0,0 +1,371 @@
+#ifndef VBLK_PARALLEL_H
+#define VBLK_PARALLEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+#include "ocssd_nvm.h"
+
+/*
+ * Channel parallelism runs, shared by vblk_write and vblk_read.
+ *
+ * The device is cut into units, one per channel or one per LUN, each
+ * with its vblks, one per block index used, and its own buffer aligned
+ * for the device. A pass runs every unit on its own thread; the threads
+ * set up, wait for each other, and then all start the timed part
+ * together.
+ *
+ * Every unit is run alone first, then all of them at once: the sum of
+ * the concurrent bandwidths over the sum of the solo ones tells how
+ * well the device scales, and the ratio of a unit tells how much its
+ * neighbours slow it down, which is what a shared channel carrying
+ * several tenants sees.
+ */
+
+struct vblk_options {
+	vblk_options() : per_lun(false), size(0), first_blk(0), nblocks(1),
+		filled(false) {}
+
+	std::string device;
+	std::vector<int> channels;
+	bool per_lun;
+	size_t size;		/* 0 for a page on every LUN of the unit */
+	int first_blk;
+	int nblocks;
+	bool filled;		/* vblk_read: the blocks hold data already */
+	std::string csv;
+};
+
+struct vblk_unit {
+	vblk_unit() : channel(0), lun(-1), size(0), buf(NULL), bytes(0), ns(0),
+		errors(0), solo_mbps(0), start_ns(0), end_ns(0) {}
+
+	int channel;
+	int lun;		/* -1 for every LUN of the channel */
+	std::vector<struct nvm_vblk *> vblks;
+	size_t size;
+	void *buf;
+
+	/* Of the last pass */
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t errors;
+	double solo_mbps;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+/* Untimed setup of a unit, then its timed run, which sets bytes and errors */
+typedef std::function<int(vblk_unit &unit)> vblk_step;
+
+static inline uint64_t vblk_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vblk_usage(const char *tool)
+{
+	printf("usage: ./%s $DEVICE [options]\n"
+		"  -c CHANNELS   channels, as 0-3,8 (all)\n"
+		"  -l            one thread per LUN, not per channel\n"
+		"  -b SIZE       request size (a page on every LUN of the unit)\n"
+		"  -B BLOCK      first block index (0)\n"
+		"  -n BLOCKS     blocks per LUN (1)\n"
+		"  -o FILE       CSV report\n", tool);
+	if (strcmp(tool, "vblk_read") == 0)
+		printf("  -k            the blocks hold data, do not write them first\n");
+}
+
+/* "0-3,8" */
+static bool vblk_parse_list(const char *arg, std::vector<int> &list)
+{
+	std::string s(arg);
+	size_t start = 0;
+
+	list.clear();
+	while (start <= s.size()) {
+		size_t end = s.find(',', start);
+		std::string item = s.substr(start, end == std::string::npos ?
+			std::string::npos : end - start);
+		int first, last;
+		char c;
+
+		if (sscanf(item.c_str(), "%d-%d%c", &first, &last, &c) == 2) {
+			if (first < 0 || last < first)
+				return false;
+			for (int i = first; i <= last; i++)
+				list.push_back(i);
+		} else if (sscanf(item.c_str(), "%d%c", &first, &c) == 1 && first >= 0) {
+			list.push_back(first);
+		} else {
+			return false;
+		}
+
+		if (end == std::string::npos)
+			break;
+		start = end + 1;
+	}
+
+	return !list.empty();
+}
+
+static bool vblk_parse_options(int argc, char **argv, const char *tool,
+	vblk_options &options)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:lb:B:n:ko:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (!vblk_parse_list(optarg, options.channels))
+				return false;
+			break;
+		case 'l':
+			options.per_lun = true;
+			break;
+		case 'b':
+			options.size = atol(optarg);
+			break;
+		case 'B':
+			options.first_blk = atoi(optarg);
+			break;
+		case 'n':
+			options.nblocks = atoi(optarg);
+			break;
+		case 'k':
+			options.filled = true;
+			break;
+		case 'o':
+			options.csv = optarg;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc - 1 || options.first_blk < 0 || options.nblocks < 1)
+		return false;
+
+	options.device = argv[optind];
+	return true;
+}
+
+static void vblk_free_units(std::vector<vblk_unit> &units)
+{
+	for (vblk_unit &unit : units) {
+		for (struct nvm_vblk *vblk : unit.vblks)
+			nvm_vblk_free(vblk);
+		free(unit.buf);
+	}
+	units.clear();
+}
+
+static int vblk_alloc_units(struct nvm_dev *dev, const vblk_options &options,
+	std::vector<vblk_unit> &units)
+{
+	const struct nvm_geo *geo = nvm_dev_get_geo(dev);
+	std::vector<int> channels(options.channels);
+
+	if (channels.empty())
+		for (size_t ch = 0; ch < geo->nchannels; ch++)
+			channels.push_back(ch);
+
+	if ((size_t)(options.first_blk + options.nblocks) > geo->nblocks) {
+		printf("blocks %d to %d past the %lu of a LUN\n", options.first_blk,
+			options.first_blk + options.nblocks - 1, geo->nblocks);
+		return -EINVAL;
+	}
+
+	for (int ch : channels) {
+		if ((size_t)ch >= geo->nchannels) {
+			printf("no channel %d\n", ch);
+			return -EINVAL;
+		}
+
+		for (size_t lun = 0; lun < geo->nluns; lun++) {
+			if (options.per_lun || lun == 0) {
+				units.push_back(vblk_unit());
+				units.back().channel = ch;
+				units.back().lun = options.per_lun ? lun : -1;
+			}
+		}
+	}
+
+	for (vblk_unit &unit : units) {
+		size_t nluns = unit.lun < 0 ? geo->nluns : 1;
+
+		for (int b = 0; b < options.nblocks; b++) {
+			std::vector<struct nvm_addr> addrs;
+
+			for (size_t lun = 0; lun < geo->nluns; lun++) {
+				struct nvm_addr addr;
+
+				if (unit.lun >= 0 && (size_t)unit.lun != lun)
+					continue;
+
+				addr.ppa = 0;
+				addr.g.ch = unit.channel;
+				addr.g.lun = lun;
+				addr.g.blk = options.first_blk + b;
+				addrs.push_back(addr);
+			}
+
+			struct nvm_vblk *vblk = nvm_vblk_alloc(dev, addrs.data(), addrs.size());
+			if (!vblk) {
+				printf("nvm_vblk_alloc failed: %s\n", strerror(errno));
+				return -ENOMEM;
+			}
+			unit.vblks.push_back(vblk);
+		}
+
+		unit.size = options.size ? options.size : geo->vpg_nbytes * nluns;
+		if (unit.size % geo->vpg_nbytes ||
+				nvm_vblk_get_nbytes(unit.vblks[0]) % unit.size) {
+			printf("size %lu does not split a vblk of %lu bytes in write units\n",
+				unit.size, nvm_vblk_get_nbytes(unit.vblks[0]));
+			return -EINVAL;
+		}
+
+		/* Every thread has its own buffer, no two share a cache line */
+		unit.buf = nvm_buf_alloc(geo, unit.size);
+		if (!unit.buf) {
+			printf("nvm_buf_alloc failed\n");
+			return -ENOMEM;
+		}
+		memset(unit.buf, 'a' + unit.channel % 26, unit.size);
+	}
+
+	return 0;
+}
+
+/* Run the units on a thread each, the timed steps all start together */
+static int vblk_pass(const std::vector<vblk_unit *> &units, vblk_step setup,
+	vblk_step run)
+{
+	std::vector<std::thread> threads;
+	std::atomic<size_t> ready(0);
+	std::atomic<int> failed(0);
+
+	for (vblk_unit *unit : units) {
+		threads.push_back(std::thread([&, unit]() {
+			bool ok = !setup || setup(*unit) == 0;
+
+			if (!ok)
+				failed++;
+
+			ready++;
+			while (ready.load() < units.size())
+				sched_yield();
+			if (!ok || failed.load())
+				return;
+
+			unit->bytes = 0;
+			unit->errors = 0;
+			unit->start_ns = vblk_now_ns();
+			if (run)
+				run(*unit);
+			unit->end_ns = vblk_now_ns();
+			unit->ns = unit->end_ns - unit->start_ns;
+		}));
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	return failed.load() ? -EIO : 0;
+}
+
+static double vblk_mbps(uint64_t bytes, uint64_t ns)
+{
+	return ns ? bytes * 1e3 / ns : 0;
+}
+
+/*
+ * Every unit alone, then all at once, and the report. Returns 0, or 1
+ * if a pass could not be set up or a request failed.
+ */
+static int vblk_run(std::vector<vblk_unit> &units, const vblk_options &options,
+	const char *op, vblk_step setup, vblk_step run)
+{
+	std::vector<vblk_unit *> all;
+	uint64_t errors = 0, bytes = 0, start = UINT64_MAX, end = 0;
+	double solo_sum = 0, concurrent_sum = 0;
+	FILE *csv = NULL;
+
+	for (vblk_unit &unit : units) {
+		if (vblk_pass(std::vector<vblk_unit *>(1, &unit), setup, run) < 0)
+			return 1;
+
+		unit.solo_mbps = vblk_mbps(unit.bytes, unit.ns);
+		errors += unit.errors;
+		all.push_back(&unit);
+	}
+
+	if (vblk_pass(all, setup, run) < 0)
+		return 1;
+
+	if (!options.csv.empty()) {
+		csv = fopen(options.csv.c_str(), "w");
+		if (!csv)
+			perror("fopen");
+		else
+			fprintf(csv, "Op,Channel,LUN,Request size,Solo (MB/s),"
+				"Concurrent (MB/s),Concurrent / solo\n");
+	}
+
+	for (vblk_unit &unit : units) {
+		double mbps = vblk_mbps(unit.bytes, unit.ns);
+		std::string lun = unit.lun < 0 ? "all" : std::to_string(unit.lun);
+
+		printf("%s channel %d LUN %s, size %lu: alone %.2f MB/s, "
+			"concurrent %.2f MB/s (%.2f)\n", op, unit.channel, lun.c_str(),
+			unit.size, unit.solo_mbps, mbps,
+			unit.solo_mbps ? mbps / unit.solo_mbps : 0);
+		if (csv)
+			fprintf(csv, "%s,%d,%s,%lu,%.2f,%.2f,%.3f\n", op, unit.channel,
+				lun.c_str(), unit.size, unit.solo_mbps, mbps,
+				unit.solo_mbps ? mbps / unit.solo_mbps : 0);
+
+		solo_sum += unit.solo_mbps;
+		concurrent_sum += mbps;
+		bytes += unit.bytes;
+		errors += unit.errors;
+		start = std::min(start, unit.start_ns);
+		end = std::max(end, unit.end_ns);
+	}
+
+	/* Over the wall time, the units need not end together */
+	printf("%s %lu units: aggregate %.2f MB/s, sum of the units alone %.2f "
+		"MB/s, concurrent %.2f MB/s (%.2f)\n", op, units.size(),
+		vblk_mbps(bytes, end - start), solo_sum, concurrent_sum,
+		solo_sum ? concurrent_sum / solo_sum : 0);
+	if (csv) {
+		fprintf(csv, "%s,all,all,,%.2f,%.2f,%.3f\n", op, solo_sum,
+			vblk_mbps(bytes, end - start),
+			solo_sum ? vblk_mbps(bytes, end - start) / solo_sum : 0);
+		fclose(csv);
+	}
+
+	if (errors) {
+		printf("%lu %s errors\n", errors, op);
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif
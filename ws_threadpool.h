@@ -0,0 +1,387 @@
+#ifndef WS_THREADPOOL_H
+#define WS_THREADPOOL_H
+
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+/*
+ * Bounded lock-free multi-producer multi-consumer queue (Vyukov).
+ *
+ * Every cell carries a sequence number that tells a producer whether
+ * the cell is free for lap pos, and a consumer whether it has been
+ * filled for it. Claiming a cell is one CAS on the enqueue or dequeue
+ * position; producers and consumers only meet on the cell itself.
+ */
+template<typename T>
+class mpmc_queue {
+public:
+	explicit mpmc_queue(size_t capacity);
+	~mpmc_queue() {delete[] m_cells;}
+
+	/* false when full or empty, never blocks */
+	bool push(const T &item);
+	bool pop(T &item);
+
+	bool empty() const {
+		return m_dequeue_pos.load() >= m_enqueue_pos.load();
+	}
+
+private:
+	mpmc_queue(const mpmc_queue &);
+	mpmc_queue & operator=(const mpmc_queue &);
+
+	struct cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	cell *m_cells;
+	size_t m_mask;
+	/* Producers and consumers each get a cache line */
+	char m_pad0[64];
+	std::atomic<size_t> m_enqueue_pos;
+	char m_pad1[64];
+	std::atomic<size_t> m_dequeue_pos;
+	char m_pad2[64];
+};
+
+template<typename T>
+mpmc_queue<T>::mpmc_queue(size_t capacity)
+{
+	size_t size = 2;
+
+	while (size < capacity)
+		size <<= 1;
+
+	m_cells = new cell[size];
+	m_mask = size - 1;
+	for (size_t i = 0; i < size; i++)
+		m_cells[i].seq.store(i, std::memory_order_relaxed);
+
+	m_enqueue_pos.store(0, std::memory_order_relaxed);
+	m_dequeue_pos.store(0, std::memory_order_relaxed);
+}
+
+template<typename T>
+bool mpmc_queue<T>::push(const T &item)
+{
+	size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+	cell *c;
+
+	while (true) {
+		c = &m_cells[pos & m_mask];
+		size_t seq = c->seq.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	c->data = item;
+	c->seq.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+template<typename T>
+bool mpmc_queue<T>::pop(T &item)
+{
+	size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+	cell *c;
+
+	while (true) {
+		c = &m_cells[pos & m_mask];
+		size_t seq = c->seq.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	item = std::move(c->data);
+	c->data = T();
+	c->seq.store(pos + m_mask + 1, std::memory_order_release);
+	return true;
+}
+
+/*
+ * Drop-in replacement for threadpool<T>: T has a process() method, and
+ * requests are handed over as shared_ptrs.
+ *
+ * Each worker has its own lock-free queue. Requests from outside the
+ * pool are spread over the queues round robin, and requests appended by
+ * a worker go to its own queue. A worker whose queue is empty steals
+ * from the others before it sleeps, so no submission takes a lock, and
+ * a wakeup is only paid for when some worker is actually asleep.
+ *
+ * The pool holds at most max_requests. append() blocks while it is
+ * full, try_append() fails instead; process() should use the latter, as
+ * workers that all wait for room never make any. The destructor runs
+ * what is queued, then joins the workers.
+ */
+/* Empty polls of the queues before a worker goes to sleep */
+#define WS_SPIN_ROUNDS 64
+
+template<typename T>
+class ws_threadpool {
+public:
+	ws_threadpool(int thread_number = 8, size_t max_requests = 10000);
+	~ws_threadpool();
+
+	/* Wait for room; false only once the pool is shutting down */
+	bool append(const std::shared_ptr<T> &request);
+
+	/* false if the pool is full */
+	bool try_append(const std::shared_ptr<T> &request);
+
+	/* Queue all of them and wake the workers once, blocks like append() */
+	size_t append_batch(const std::vector<std::shared_ptr<T>> &requests);
+
+private:
+	ws_threadpool(const ws_threadpool &);
+	ws_threadpool & operator=(const ws_threadpool &);
+
+	bool push(const std::shared_ptr<T> &request);
+	bool pop(int index, std::shared_ptr<T> &request);
+	bool has_work() const;
+	void wake_workers(size_t count);
+	void wait_for_room();
+	void run(int index);
+
+	int m_thread_number;
+	std::vector<mpmc_queue<std::shared_ptr<T>> *> m_queues;
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_next_queue;
+	std::atomic<bool> m_stop;
+
+	/* Workers asleep and submitters waiting for room */
+	std::mutex m_mutex;
+	std::condition_variable m_work;
+	std::condition_variable m_room;
+	std::atomic<int> m_sleepers;
+	std::atomic<int> m_blocked;
+
+	/* The queue index of the calling thread, if it is one of ours */
+	static thread_local const ws_threadpool *t_pool;
+	static thread_local int t_index;
+};
+
+template<typename T>
+thread_local const ws_threadpool<T> *ws_threadpool<T>::t_pool = NULL;
+
+template<typename T>
+thread_local int ws_threadpool<T>::t_index = 0;
+
+template<typename T>
+ws_threadpool<T>::ws_threadpool(int thread_number, size_t max_requests)
+	: m_thread_number(thread_number), m_next_queue(0), m_stop(false),
+	m_sleepers(0), m_blocked(0)
+{
+	if (thread_number <= 0 || max_requests <= 0)
+		throw std::runtime_error("Error: invalid thread pool size\n");
+
+	size_t per_queue = (max_requests + thread_number - 1) / thread_number;
+
+	for (int i = 0; i < m_thread_number; i++)
+		m_queues.push_back(new mpmc_queue<std::shared_ptr<T>>(per_queue));
+
+	for (int i = 0; i < m_thread_number; i++)
+		m_threads.push_back(std::thread(&ws_threadpool::run, this, i));
+}
+
+template<typename T>
+ws_threadpool<T>::~ws_threadpool()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+
+	m_work.notify_all();
+	m_room.notify_all();
+	for (auto &thread : m_threads)
+		thread.join();
+
+	for (auto queue : m_queues)
+		delete queue;
+}
+
+/* Own queue first for a worker, the next one round robin otherwise */
+template<typename T>
+bool ws_threadpool<T>::push(const std::shared_ptr<T> &request)
+{
+	size_t start = t_pool == this ? t_index :
+		m_next_queue.fetch_add(1, std::memory_order_relaxed);
+
+	for (int i = 0; i < m_thread_number; i++) {
+		if (m_queues[(start + i) % m_thread_number]->push(request))
+			return true;
+	}
+
+	return false;
+}
+
+template<typename T>
+bool ws_threadpool<T>::pop(int index, std::shared_ptr<T> &request)
+{
+	for (int i = 0; i < m_thread_number; i++) {
+		if (m_queues[(index + i) % m_thread_number]->pop(request))
+			return true;
+	}
+
+	return false;
+}
+
+template<typename T>
+bool ws_threadpool<T>::has_work() const
+{
+	for (auto queue : m_queues) {
+		if (!queue->empty())
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The sleeper count is read after the push, and a worker counts itself
+ * before it checks the queues for the last time, so one of the two
+ * always sees the other.
+ */
+template<typename T>
+void ws_threadpool<T>::wake_workers(size_t count)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_sleepers.load() == 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (count == 1)
+		m_work.notify_one();
+	else
+		m_work.notify_all();
+}
+
+/*
+ * Workers signal room as they take requests, but only while someone is
+ * blocked, and without a lock around the queues a signal can slip by,
+ * so the wait is also bounded. The caller tries again either way.
+ */
+template<typename T>
+void ws_threadpool<T>::wait_for_room()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_blocked++;
+	if (!m_stop)
+		m_room.wait_for(lock, std::chrono::milliseconds(1));
+	m_blocked--;
+}
+
+template<typename T>
+bool ws_threadpool<T>::try_append(const std::shared_ptr<T> &request)
+{
+	if (m_stop || !push(request))
+		return false;
+
+	wake_workers(1);
+	return true;
+}
+
+template<typename T>
+bool ws_threadpool<T>::append(const std::shared_ptr<T> &request)
+{
+	while (!m_stop) {
+		if (push(request)) {
+			wake_workers(1);
+			return true;
+		}
+		wait_for_room();
+	}
+
+	return false;
+}
+
+template<typename T>
+size_t ws_threadpool<T>::append_batch(const std::vector<std::shared_ptr<T>> &requests)
+{
+	size_t done = 0;
+
+	while (done < requests.size() && !m_stop) {
+		size_t before = done;
+
+		while (done < requests.size() && push(requests[done]))
+			done++;
+
+		if (done > before)
+			wake_workers(done - before);
+		if (done < requests.size())
+			wait_for_room();
+	}
+
+	return done;
+}
+
+template<typename T>
+void ws_threadpool<T>::run(int index)
+{
+	t_pool = this;
+	t_index = index;
+
+	int idle = 0;
+
+	while (true) {
+		std::shared_ptr<T> request;
+
+		if (pop(index, request)) {
+			idle = 0;
+			if (m_blocked.load() > 0) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_room.notify_all();
+			}
+			if (request)
+				request->process();
+			continue;
+		}
+
+		/* Sleeping and waking cost more than a short wait for work */
+		if (++idle < WS_SPIN_ROUNDS) {
+			std::this_thread::yield();
+			continue;
+		}
+		idle = 0;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_sleepers++;
+		while (!m_stop && !has_work())
+			m_work.wait(lock);
+		m_sleepers--;
+
+		/* Drain what is left before leaving */
+		if (m_stop && !has_work())
+			return;
+	}
+}
+
+#endif